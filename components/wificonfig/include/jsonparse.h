@@ -0,0 +1,54 @@
+/*
+ * jsonparse
+ *
+ * A small streaming JSON parser. Input is fed in pieces of any size (an
+ * MQTT message arrives in fragments, an HTTP body in recv() chunks) and
+ * every scalar value is handed to a callback along with the keys leading
+ * to it, so nothing but the current key path and value is ever buffered.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define JSONPARSE_MAX_DEPTH 4   // nested objects/arrays
+#define JSONPARSE_KEY_LEN   24
+#define JSONPARSE_VALUE_LEN 96  // longest string or number, plus the nul
+
+enum jsonparse_type {
+    JSONPARSE_STRING = 0,
+    JSONPARSE_NUMBER,
+    JSONPARSE_TRUE,
+    JSONPARSE_FALSE,
+    JSONPARSE_NULL,
+};
+
+struct jsonparse;
+
+// A scalar value: p->key[0..p->depth-1] are the keys leading to it (the
+// key for an array level is ""). Return false to stop the parse.
+//
+typedef bool (*jsonparse_cb_t)(struct jsonparse *p, enum jsonparse_type type, const char *value);
+
+struct jsonparse {
+    jsonparse_cb_t cb;
+    void *ctx;
+    uint8_t state;
+    uint8_t depth;
+    uint8_t arrays;     // bit n set: level n is an array
+    bool in_key;        // the string being read is a key
+    uint8_t esc_left;   // hex digits still to come in a \u escape
+    uint16_t esc_val;
+    uint16_t len;
+    uint32_t pos;       // bytes consumed, for error messages
+    const char *error;  // NULL unless the parse failed
+    char key[JSONPARSE_MAX_DEPTH][JSONPARSE_KEY_LEN];
+    char value[JSONPARSE_VALUE_LEN];
+};
+
+extern void jsonparse_init (struct jsonparse *p, jsonparse_cb_t cb, void *ctx);
+
+// returns false once the document is in error (see p->error)
+extern bool jsonparse_feed (struct jsonparse *p, const char *data, size_t len);
+
+// end of input; returns false unless exactly one complete value was read
+extern bool jsonparse_finish (struct jsonparse *p);
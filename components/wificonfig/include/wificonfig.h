@@ -1,7 +1,65 @@
 #include "wificonfig_int.h"
+#include "jsonparse.h"
+#include <nvs.h>
+#include <esp_http_server.h>
 
+// enter config mode; the application carries on meanwhile
 extern void trigger_wificonfig (void);
-extern void wificonfig (void);
+extern bool wificonfig_active (void);
+// load the configuration; ESP_OK if it's valid, else config mode is needed
+extern esp_err_t wificonfig (void);
+extern esp_err_t wificonfig_save (struct wificonfig_save_stats *stats, const char **err_msg);
+extern esp_err_t wificonfig_get_nvs_stats (nvs_stats_t *stats);
+extern esp_err_t wificonfig_register_uri (const httpd_uri_t *uri);
+// like wificonfig_register_uri, but served only in config mode
+extern esp_err_t wificonfig_register_config_uri (const httpd_uri_t *uri);
+extern esp_err_t wificonfig_start_server (void);
 extern struct wificonfig_vals_wifi wificonfig_vals_wifi;
 extern struct wificonfig_vals_mqtt wificonfig_vals_mqtt;
-extern struct wificonfig_vals_watchdog wificonfig_vals_watchdog;
+
+extern struct wificonfig_save_stats wificonfig_last_save;
+
+// Called when new values have been made active (by the config pages or a
+// JSON document) with what they were before, so the application can put
+// them into effect.
+//
+typedef void (*wificonfig_commit_cb_t)(const struct wificonfig_watchdog *old, const struct wificonfig_vals_mqtt *old_mqtt);
+extern void wificonfig_set_commit_cb (wificonfig_commit_cb_t cb);
+extern void wificonfig_commit (struct wificonfig_watchdog *stage, const struct wificonfig_vals_mqtt *mqtt,
+                               const struct wificonfig_vals_wifi *wifi);
+
+// Applying a JSON configuration document, {"wifi":{...},"mqtt":{...},
+// "watchdog":{...},"persist":true,"restart":false}, fed in pieces as it
+// arrives. Values are validated by the same rules as the config pages
+// into a staged copy, and every error is collected; only a document with
+// no errors is made active. Restarting is left to the caller. WiFi
+// values and restart are only accepted from a config_mode document (the
+// config-mode HTTP endpoint), since they can take the controller off the
+// network.
+//
+struct wificonfig_json {
+    struct jsonparse parser;
+    struct wificonfig_vals_wifi wifi;       // staged values
+    struct wificonfig_vals_mqtt mqtt;
+    struct wificonfig_watchdog *watchdog;
+    bool config_mode;   // wifi values and restart allowed
+    bool persist;
+    bool restart;
+    uint8_t changed;    // bit per WIFICONFIG_GROUP_* that was given values
+    int errors;
+    char *result;       // the result, {"ok":...,"errors":[...]}, goes here
+    size_t result_len;
+    int result_pos;
+};
+
+extern esp_err_t wificonfig_json_begin (struct wificonfig_json *doc, char *result, size_t result_len, bool config_mode);
+extern void wificonfig_json_feed (struct wificonfig_json *doc, const char *data, size_t len);
+extern esp_err_t wificonfig_json_end (struct wificonfig_json *doc);
+
+// Writing the current values, less any secrets, as a JSON document in
+// the same form. The output is passed to cb in pieces of up to 128 bytes.
+//
+typedef esp_err_t (*wificonfig_write_cb_t)(void *ctx, const char *data, size_t len);
+extern esp_err_t wificonfig_json_write (wificonfig_write_cb_t cb, void *ctx);
+// into buf; returns the length, or -1 if it didn't fit
+extern int wificonfig_json_dump (char *buf, size_t len);
@@ -20,13 +20,86 @@ struct wificonfig_vals_mqtt {
     uint16_t update;  // mqtt_update
 };
 
-struct wificonfig_vals_watchdog {
+struct wificonfig_watchdog {
     uint8_t  sensor;    // watch_sensor
     uint16_t thresh;    // watch_thresh
-    uint16_t maxtime;   // watch_maxtime
+    uint16_t maxtime_s; // watch_max_s (watch_maxtime in minutes)
     uint8_t  dutycycle; // watch_dutycycle
     uint16_t window;    // watch_window
-    uint16_t cooldown;  // watch_cooldown
-    uint16_t button_to; // watch_button_to
-    uint16_t mqtt_to;   // watch_mqtt_to
+    uint16_t cooldown_s; // watch_cool_s (watch_cooldown in minutes)
+    uint16_t button_to_s; // watch_button_s (watch_button_to in minutes)
+    uint16_t mqtt_to_s; // watch_mqtt_s (watch_mqtt_to in minutes)
+    uint8_t  prewarn1;  // watch_prewarn1
+    uint8_t  prewarn2;  // watch_prewarn2
+    uint16_t trip;      // watch_trip
+    uint16_t inrush;    // watch_inrush
+    uint16_t unload;    // watch_unload
+    uint16_t nostart;   // watch_nostart
+    uint8_t  anom_alarm; // watch_anom_alm
+    uint16_t min_on;    // watch_min_on
+    uint16_t min_off;   // watch_min_off
+    uint16_t coalesce;  // watch_coalesce
+    uint16_t thresh_off; // watch_thr_off
+    uint8_t  autocal;   // watch_autocal
+    uint16_t ct_ratio0; // watch_ct_r0, CT turns ratio per sensor
+    uint16_t ct_ratio1; // watch_ct_r1
+    uint16_t ct_ratio2; // watch_ct_r2
+    uint16_t ct_ratio3; // watch_ct_r3
+    uint16_t ct_burden0; // watch_ct_b0, burden ohms per sensor, 0: raw counts
+    uint16_t ct_burden1; // watch_ct_b1
+    uint16_t ct_burden2; // watch_ct_b2
+    uint16_t ct_burden3; // watch_ct_b3
 };
+
+// a configuration value, for setting values by name (see wificonfig_fields)
+enum wificonfig_group {
+    WIFICONFIG_GROUP_MQTT = 0,
+    WIFICONFIG_GROUP_WATCHDOG,
+    WIFICONFIG_GROUP_WIFI,      // takes effect at the next restart
+};
+
+enum wificonfig_type {
+    WIFICONFIG_U8 = 0,
+    WIFICONFIG_U16,
+    WIFICONFIG_STR,
+    WIFICONFIG_HOST,    // dotted IPv4 address, or empty
+    WIFICONFIG_SECRET,  // a string that is never reported back
+};
+
+struct wificonfig_field {
+    const char *id;     // form id on the config pages
+    const char *name;   // struct member, and name in JSON
+    uint8_t group;
+    uint8_t type;
+    uint16_t offset;    // in the group's struct
+    uint16_t size;
+    uint16_t min;       // numbers only
+    uint16_t max;
+};
+
+// what the last wificonfig_save() actually wrote to flash
+struct wificonfig_save_stats {
+    uint16_t keys;      // keys whose value changed
+    uint16_t entries;   // 32-byte NVS entries consumed
+    uint32_t bytes;     // payload bytes written
+};
+
+// The watchdog values are double-buffered so they can be changed while
+// running: wificonfig_watchdog_stage returns a copy of the active values
+// to change (NULL if another change is under way), and
+// wificonfig_watchdog_swap makes the copy active in one pointer store, or
+// wificonfig_watchdog_unstage drops it. wificonfig_watchdog_active
+// points at the active values.
+extern struct wificonfig_watchdog *volatile wificonfig_watchdog_active;
+extern struct wificonfig_watchdog *wificonfig_watchdog_stage (void);
+extern void wificonfig_watchdog_swap (struct wificonfig_watchdog *stage);
+extern void wificonfig_watchdog_unstage (void);
+
+// the WiFi values that will be saved, and used from the next restart
+extern const struct wificonfig_vals_wifi *wificonfig_next_wifi (void);
+
+extern const struct wificonfig_field wificonfig_fields[];
+extern const int wificonfig_num_fields;
+extern const struct wificonfig_field *wificonfig_find_field (int group, const char *name);
+extern const char *wificonfig_set_field (const struct wificonfig_field *field, void *vals, const char *val);
+extern int wificonfig_format_field (const struct wificonfig_field *field, const void *vals, char *buf, size_t len);
@@ -0,0 +1,296 @@
+/*
+ * jsonparse
+ *
+ * A byte-at-a-time state machine, so a piece boundary can fall anywhere,
+ * even inside an escape. Numbers and literals have no closing character;
+ * they end at the first byte that can't be part of them, which is then
+ * handled as the byte after the value.
+ */
+#include <string.h>
+
+#include "jsonparse.h"
+
+enum state_t {
+    S_VALUE = 0,        // a value must come next
+    S_ARRAY_START,      // a value or ]
+    S_OBJECT_START,     // a key or }
+    S_KEY,              // a key must come next
+    S_COLON,
+    S_AFTER,            // , or a close
+    S_STRING,
+    S_ESCAPE,
+    S_UNICODE,
+    S_BARE,             // number or literal
+    S_DONE,             // only whitespace may follow
+    S_ERROR,
+};
+
+void jsonparse_init (struct jsonparse *p, jsonparse_cb_t cb, void *ctx) {
+    memset (p, 0, sizeof(*p));
+    p->cb = cb;
+    p->ctx = ctx;
+    p->state = S_VALUE;
+}
+
+static bool fail (struct jsonparse *p, const char *error) {
+    if (p->error == NULL) {
+        p->error = error;
+    }
+    p->state = S_ERROR;
+    return false;
+}
+
+static bool is_space (char c) {
+    return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+static bool is_bare (char c) {
+    return ((c >= '0') && (c <= '9')) || ((c >= 'a') && (c <= 'z')) ||
+           ((c >= 'A') && (c <= 'Z')) || (c == '-') || (c == '+') || (c == '.');
+}
+
+static bool append (struct jsonparse *p, char c) {
+    if (p->len >= ((p->in_key ? JSONPARSE_KEY_LEN : JSONPARSE_VALUE_LEN) - 1)) {
+        return fail (p, p->in_key ? "key too long" : "value too long");
+    }
+    p->value[p->len++] = c;
+    return true;
+}
+
+// -?digits(.digits)?([eE][+-]?digits)?
+//
+static bool is_number (const char *s) {
+    int digits = 0;
+
+    if (*s == '-') s++;
+    while ((*s >= '0') && (*s <= '9')) { s++; digits++; }
+    if (digits == 0) return false;
+    if (*s == '.') {
+        s++;
+        for (digits = 0; (*s >= '0') && (*s <= '9'); digits++) s++;
+        if (digits == 0) return false;
+    }
+    if ((*s == 'e') || (*s == 'E')) {
+        s++;
+        if ((*s == '+') || (*s == '-')) s++;
+        for (digits = 0; (*s >= '0') && (*s <= '9'); digits++) s++;
+        if (digits == 0) return false;
+    }
+    return (*s == '\0');
+}
+
+static bool after_value (struct jsonparse *p) {
+    p->state = (p->depth == 0) ? S_DONE : S_AFTER;
+    return true;
+}
+
+static bool emit (struct jsonparse *p, enum jsonparse_type type) {
+    p->value[p->len] = '\0';
+    if (!p->cb (p, type, p->value)) {
+        return fail (p, "stopped");
+    }
+    return after_value (p);
+}
+
+static bool end_bare (struct jsonparse *p) {
+    p->value[p->len] = '\0';
+    if (strcmp (p->value, "true") == 0) {
+        return emit (p, JSONPARSE_TRUE);
+    } else if (strcmp (p->value, "false") == 0) {
+        return emit (p, JSONPARSE_FALSE);
+    } else if (strcmp (p->value, "null") == 0) {
+        return emit (p, JSONPARSE_NULL);
+    } else if (is_number (p->value)) {
+        return emit (p, JSONPARSE_NUMBER);
+    }
+    return fail (p, "bad value");
+}
+
+static bool open_level (struct jsonparse *p, bool array) {
+    if (p->depth >= JSONPARSE_MAX_DEPTH) {
+        return fail (p, "nested too deeply");
+    }
+    p->key[p->depth][0] = '\0';
+    if (array) {
+        p->arrays |= (1 << p->depth);
+    } else {
+        p->arrays &= ~(1 << p->depth);
+    }
+    p->depth++;
+    p->state = array ? S_ARRAY_START : S_OBJECT_START;
+    return true;
+}
+
+static bool close_level (struct jsonparse *p, bool array) {
+    bool is_array = (p->arrays & (1 << (p->depth - 1))) != 0;
+    if (is_array != array) {
+        return fail (p, array ? "unexpected ]" : "unexpected }");
+    }
+    p->depth--;
+    return after_value (p);
+}
+
+static bool start_string (struct jsonparse *p, bool key) {
+    p->in_key = key;
+    p->len = 0;
+    p->state = S_STRING;
+    return true;
+}
+
+static bool end_string (struct jsonparse *p) {
+    if (p->in_key) {
+        p->value[p->len] = '\0';
+        strcpy (p->key[p->depth - 1], p->value);
+        p->state = S_COLON;
+        return true;
+    }
+    return emit (p, JSONPARSE_STRING);
+}
+
+// the \u escape is complete: store it as UTF-8
+//
+static bool end_unicode (struct jsonparse *p) {
+    uint16_t u = p->esc_val;
+    p->state = S_STRING;
+    if (u < 0x80) {
+        return append (p, u);
+    } else if (u < 0x800) {
+        return append (p, 0xc0 | (u >> 6)) && append (p, 0x80 | (u & 0x3f));
+    }
+    return append (p, 0xe0 | (u >> 12)) && append (p, 0x80 | ((u >> 6) & 0x3f)) &&
+           append (p, 0x80 | (u & 0x3f));
+}
+
+static bool step (struct jsonparse *p, char c) {
+    while (1) {
+        switch (p->state) {
+            case S_ARRAY_START:
+                if (c == ']') {
+                    return close_level (p, true);
+                }
+                // fall through
+            case S_VALUE:
+                if (is_space (c)) {
+                    return true;
+                } else if (c == '{') {
+                    return open_level (p, false);
+                } else if (c == '[') {
+                    return open_level (p, true);
+                } else if (c == '"') {
+                    return start_string (p, false);
+                } else if (is_bare (c)) {
+                    p->in_key = false;
+                    p->len = 0;
+                    p->state = S_BARE;
+                    return append (p, c);
+                }
+                return fail (p, "expected a value");
+
+            case S_OBJECT_START:
+                if (c == '}') {
+                    return close_level (p, false);
+                }
+                // fall through
+            case S_KEY:
+                if (is_space (c)) {
+                    return true;
+                } else if (c == '"') {
+                    return start_string (p, true);
+                }
+                return fail (p, "expected a key");
+
+            case S_COLON:
+                if (is_space (c)) {
+                    return true;
+                } else if (c == ':') {
+                    p->state = S_VALUE;
+                    return true;
+                }
+                return fail (p, "expected :");
+
+            case S_AFTER:
+                if (is_space (c)) {
+                    return true;
+                } else if (c == ',') {
+                    p->state = (p->arrays & (1 << (p->depth - 1))) ? S_VALUE : S_KEY;
+                    return true;
+                } else if ((c == '}') || (c == ']')) {
+                    return close_level (p, c == ']');
+                }
+                return fail (p, "expected , or a close");
+
+            case S_STRING:
+                if (c == '"') {
+                    return end_string (p);
+                } else if (c == '\\') {
+                    p->state = S_ESCAPE;
+                    return true;
+                } else if ((unsigned char) c < 0x20) {
+                    return fail (p, "control character in string");
+                }
+                return append (p, c);
+
+            case S_ESCAPE: {
+                static const char from[] = "\"\\/bfnrt";
+                static const char to[]   = "\"\\/\b\f\n\r\t";
+                const char *e = (c != '\0') ? strchr (from, c) : NULL;
+                if (c == 'u') {
+                    p->esc_left = 4;
+                    p->esc_val = 0;
+                    p->state = S_UNICODE;
+                    return true;
+                } else if (e == NULL) {
+                    return fail (p, "bad escape");
+                }
+                p->state = S_STRING;
+                return append (p, to[e - from]);
+            }
+
+            case S_UNICODE:
+                if ((c >= '0') && (c <= '9')) {
+                    p->esc_val = (p->esc_val << 4) | (c - '0');
+                } else if (((c | 0x20) >= 'a') && ((c | 0x20) <= 'f')) {
+                    p->esc_val = (p->esc_val << 4) | ((c | 0x20) - 'a' + 10);
+                } else {
+                    return fail (p, "bad \\u escape");
+                }
+                return (--p->esc_left > 0) ? true : end_unicode (p);
+
+            case S_BARE:
+                if (is_bare (c)) {
+                    return append (p, c);
+                }
+                // c follows the value, so handle it again in the new state
+                if (!end_bare (p)) {
+                    return false;
+                }
+                continue;
+
+            case S_DONE:
+                return is_space (c) ? true : fail (p, "data after the end");
+
+            default:
+                return false;
+        }
+    }
+}
+
+bool jsonparse_feed (struct jsonparse *p, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!step (p, data[i])) {
+            return false;
+        }
+        p->pos++;
+    }
+    return true;
+}
+
+bool jsonparse_finish (struct jsonparse *p) {
+    if ((p->state == S_BARE) && (p->depth == 0)) {
+        end_bare (p);
+    }
+    if (p->state == S_DONE) {
+        return true;
+    }
+    return fail (p, (p->state == S_VALUE) && (p->depth == 0) ? "empty" : "unexpected end");
+}
@@ -12,6 +12,7 @@ Allows configuration of a device over wifi
 #include <nvs_flash.h>
 #include <nvs.h>
 #include <esp_netif.h>
+#include <esp_timer.h>
 #include <esp_eth.h>
 
 #include <esp_http_server.h>
@@ -20,11 +21,12 @@ Allows configuration of a device over wifi
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 
 #include <lwip/err.h>
 #include <lwip/sys.h>
 
-#include <wificonfig_int.h>
+#include <wificonfig.h>
 
 /* A simple example that demonstrates how to create GET and POST
  * handlers for the web server.
@@ -33,7 +35,6 @@ Allows configuration of a device over wifi
 #define WIFI_SSID     "ESP32"
 #define WIFI_PASS     ""
 #define MAX_STA_CONN  4
-#define DEFAULT_SCAN_LIST_SIZE 10
 #define NUM_SENSORS   4
 
 #define D_TITLE       CONFIG_WIFI_PAGE_TITLE
@@ -43,7 +44,29 @@ Allows configuration of a device over wifi
 
 struct wificonfig_vals_wifi wificonfig_vals_wifi;
 struct wificonfig_vals_mqtt wificonfig_vals_mqtt;
-struct wificonfig_vals_watchdog wificonfig_vals_watchdog;
+static struct wificonfig_watchdog watchdog_buffers[2];
+struct wificonfig_watchdog *volatile wificonfig_watchdog_active = &watchdog_buffers[0];
+static portMUX_TYPE watchdog_swap_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool watchdog_staged = false;    // the inactive buffer is in use
+
+// The config pages edit these copies while the watchdog carries on with
+// the active values; saving makes them active. WiFi values only take
+// effect at the next restart, so next_wifi holds what is to be saved.
+// The active values can also change meanwhile (over MQTT, or by
+// auto-calibration), so saving applies only the fields the pages changed
+// from the *_base copies taken with them.
+//
+static struct wificonfig_vals_wifi staged_wifi;
+static struct wificonfig_vals_mqtt staged_mqtt;
+static struct wificonfig_watchdog staged_watchdog;
+static struct wificonfig_vals_wifi staged_wifi_base;
+static struct wificonfig_vals_mqtt staged_mqtt_base;
+static struct wificonfig_watchdog staged_watchdog_base;
+static struct wificonfig_vals_wifi next_wifi;
+
+static wificonfig_commit_cb_t commit_cb = NULL;
+static bool config_mode = false;        // soft-AP and config pages are up
+static bool config_requested = false;   // enter config mode once the server starts
 
 extern const char *TAG;
 
@@ -118,12 +141,25 @@ const char *THIS_HTTP_HOME_SCRIPT =
 
 const char *THIS_HTTP_WIFI_SCRIPT =
     "<script>"
+    "var x=null;"
     "function eb(s){return document.getElementById(s);}"
     "function sp(i){eb(i).type=(eb(i).type==='text'?'password':'text');}"
     "function c(l){"
         "eb('s1').value=l.innerText||l.textContent;"
         "eb('p1').focus();"
         "}"
+    "function ls(){"
+        "if(x!=null){x.abort();}"
+        "x=new XMLHttpRequest();"
+        "x.onreadystatechange=function(){"
+            "if(x.readyState==4 && x.status==200){"
+                "eb('sc').innerHTML=x.responseText;"
+                "}"
+            "};"
+        "x.open('GET','scan',true);"
+        "x.send();"
+        "setTimeout(ls,5000);}"
+    "window.addEventListener('load',function(){setTimeout(ls,5000);});"
     "</script>"
     ;
 
@@ -134,6 +170,54 @@ const char *THIS_HTTP_MQTT_SCRIPT =
     "</script>"
     ;
 
+// Live chart on the watchdog page, fed by the /live WebSocket: the last
+// 300 readings of each sensor, the selected one drawn heavier, against
+// the thresholds in the form (dashed)
+//
+const char *THIS_HTTP_WATCH_SCRIPT =
+    "<script>"
+    "var h=[[],[],[],[]],st=null,AL=['maxtime','dutycycle','overcurrent','nostart','lowcurrent','welded','open','valve'];"
+    "function eb(s){return document.getElementById(s);}"
+    "function dr(){"
+        "var c=eb('lc'),g=c.getContext('2d'),W=c.width,H=c.height,n=300;"
+        "var th=parseInt(eb('th').value)||(st?st.th:0),se=parseInt(eb('se').value),m=th*1.5;"
+        "for(var i=0;i<4;i++){for(var j=0;j<h[i].length;j++){if(h[i][j]>m){m=h[i][j];}}}"
+        "m=Math.max(m,16);"
+        "g.fillStyle='#1f1f1f';g.fillRect(0,0,W,H);"
+        "var col=['#65c115','#1fa3ec','#eaeaea','#d4a035'];"
+        "for(var i=0;i<4;i++){"
+            "g.strokeStyle=col[i];g.lineWidth=(i==se)?2.5:1;g.beginPath();"
+            "for(var j=0;j<h[i].length;j++){"
+                "var x=W-(h[i].length-j)*W/n,y=H-h[i][j]*H/m;"
+                "if(j){g.lineTo(x,y);}else{g.moveTo(x,y);}"
+                "}"
+            "g.stroke();"
+            "}"
+        "var tf=parseInt(eb('tf').value)||0;"
+        "g.lineWidth=1;g.setLineDash([6,4]);"
+        "g.strokeStyle='#d43535';g.beginPath();g.moveTo(0,H-th*H/m);g.lineTo(W,H-th*H/m);g.stroke();"
+        "if(tf>0&&tf<th){g.strokeStyle='#931f1f';g.beginPath();g.moveTo(0,H-tf*H/m);g.lineTo(W,H-tf*H/m);g.stroke();}"
+        "g.setLineDash([]);"
+        "}"
+    "function lv(){"
+        "var w=new WebSocket('ws://'+location.host+'/live');"
+        "w.onmessage=function(e){"
+            "st=JSON.parse(e.data);"
+            "var d=document.querySelectorAll('.sv');"
+            "for(var i=0;i<4;i++){"
+                "h[i].push(st.a[i]);if(h[i].length>300){h[i].shift();}"
+                "if(d[i]){d[i].innerHTML='Sensor '+i+': '+((st.u>>i)&1?(st.a[i]/100).toFixed(2)+' A':st.a[i]);}"
+                "}"
+            "var a=[];for(var i=0;i<AL.length;i++){if(st.al&(1<<i)){a.push(AL[i]);}}"
+            "eb('ls').innerHTML='Relay '+(st.p?'on':'off')+', '+(st.r?'running':'not running')+(a.length?', alarm: '+a.join(' '):'');"
+            "dr();"
+            "};"
+        "w.onclose=function(){eb('ls').innerHTML='Live view disconnected';setTimeout(lv,5000);};"
+        "}"
+    "window.addEventListener('load',lv);"
+    "</script>"
+    ;
+
 const char *THIS_HTTP_HEAD_START =
     "<!DOCTYPE html>"
     "<html class=\"\">"
@@ -166,6 +250,8 @@ const char *THIS_HTTP_BODY_HOME =
     "<button name>Configure Watchdog</button></form><p></p>"
     "<p></p><form action=\"save\" method=\"get\">"
     "<button name>Save Configuration</button></form><p></p>"
+    "<p></p><form action=\"exit\" method=\"get\">"
+    "<button name>Leave Config Mode</button></form><p></p>"
     "<p></p><form action=\"restart\" method=\"get\" onsubmit=\"return confirm(\'Confirm Restart\');\">"
     "<button name=\"restart\" class=\"button bred\">Restart</button></form><p></p>"
     ;
@@ -178,9 +264,17 @@ const char *THIS_HTTP_BODY_WIFI_0 =
     "<div>"
     ;
 
+const char *THIS_HTTP_BODY_WIFI_SC_0 = 
+    "<div id=\"sc\">"
+    ;
+
+const char *THIS_HTTP_BODY_WIFI_SC_1 = 
+    "</div>"
+    ;
+
 const char *THIS_HTTP_BODY_WIFI_SCAN_0 = 
     "<div>"
-    "No wifi networks found"
+    "No wifi networks found yet"
     "</div>"
     "<br>"
     ;
@@ -317,13 +411,18 @@ const char *THIS_HTTP_BODY_WATCH_0 =
     ;
 
 const char *THIS_HTTP_BODY_WATCH_SENSOR_0 = 
-    "<div>"
+    "<div class=\"sv\">"
     ;
 
 const char *THIS_HTTP_BODY_WATCH_SENSOR_1 = 
     "</div>"
     ;
 
+const char *THIS_HTTP_BODY_WATCH_LIVE = 
+    "<div id=\"ls\" style=\"color:#eaeaea;\"></div>"
+    "<canvas id=\"lc\" width=\"600\" height=\"200\" style=\"width:100%;\"></canvas>"
+    ;
+
 const char *THIS_HTTP_BODY_WATCH_1 = 
     "<fieldset>"
     "<legend><b>Watchdog Parameters</b></legend>"
@@ -333,12 +432,12 @@ const char *THIS_HTTP_BODY_WATCH_1 =
 
 const char *THIS_HTTP_BODY_WATCH_2 = 
     "\" name=\"se\"></p>"
-    "<p><b>Sensor Threshold (1-4096)</b><br><input id=\"th\" value=\""
+    "<p><b>Sensor Threshold (ADC counts, or 0.01 A with the sensor's CT set)</b><br><input id=\"th\" value=\""
     ;
 
 const char *THIS_HTTP_BODY_WATCH_3 = 
     "\" name=\"th\"></p>"
-    "<p><b>Maxtime (in minutes)</b><br><input id=\"ma\" value=\""
+    "<p><b>Maxtime (in seconds)</b><br><input id=\"ma\" value=\""
     ;
 
 const char *THIS_HTTP_BODY_WATCH_4 = 
@@ -353,21 +452,90 @@ const char *THIS_HTTP_BODY_WATCH_5 =
 
 const char *THIS_HTTP_BODY_WATCH_6 = 
     "\" name=\"wi\"></p>"
-    "<p><b>Alarm Cooldown (in minutes)</b><br><input id=\"co\" value=\""
+    "<p><b>Alarm Cooldown (in seconds)</b><br><input id=\"co\" value=\""
     ;
 
 const char *THIS_HTTP_BODY_WATCH_7 = 
     "\" name=\"co\"></p>"
-    "<p><b>ON-Button Timeout (in minutes)</b><br><input id=\"bt\" value=\""
+    "<p><b>ON-Button Timeout (in seconds)</b><br><input id=\"bt\" value=\""
     ;
 
 const char *THIS_HTTP_BODY_WATCH_8 = 
     "\" name=\"bt\"></p>"
-    "<p><b>ON-MQTT Timeout (in minutes)</b><br><input id=\"mt\" value=\""
+    "<p><b>ON-MQTT Timeout (in seconds)</b><br><input id=\"mt\" value=\""
     ;
 
 const char *THIS_HTTP_BODY_WATCH_9 = 
     "\" name=\"mt\"></p>"
+    "<p><b>First Pre-alarm Warning (% of MAXTIME/duty cycle budget, 0 = off)</b><br><input id=\"p1\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_10 = 
+    "\" name=\"p1\"></p>"
+    "<p><b>Second Pre-alarm Warning (% of budget, 0 = off)</b><br><input id=\"p2\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_11 = 
+    "\" name=\"p2\"></p>"
+    "<p><b>Overcurrent Trip Level (per-cycle amplitude, 0 = off)</b><br><input id=\"ft\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_12 = 
+    "\" name=\"ft\"></p>"
+    "<p><b>Inrush Allowance (in milliseconds)</b><br><input id=\"ir\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_13 = 
+    "\" name=\"ir\"></p>"
+    "<p><b>Unloaded Below (amplitude, 0 = off)</b><br><input id=\"ul\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_14 = 
+    "\" name=\"ul\"></p>"
+    "<p><b>No-start Time (in seconds, 0 = off)</b><br><input id=\"ns\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_15 = 
+    "\" name=\"ns\"></p>"
+    "<p><b>Anomaly Alarms (0 = none, 1 = no start, 2 = low current, 3 = both)</b><br><input id=\"aa\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_16 = 
+    "\" name=\"aa\"></p>"
+    "<p><b>Minimum On Time (in seconds, 0 = off)</b><br><input id=\"mn\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_17 = 
+    "\" name=\"mn\"></p>"
+    "<p><b>Minimum Off Time (in seconds, 0 = off)</b><br><input id=\"mf\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_18 = 
+    "\" name=\"mf\"></p>"
+    "<p><b>Request Coalescing Window (in seconds, 0 = off)</b><br><input id=\"cw\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_19 = 
+    "\" name=\"cw\"></p>"
+    "<p><b>Stop Threshold (running carries on down to this, 0 = Sensor Threshold)</b><br><input id=\"tf\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_20 = 
+    "\" name=\"tf\"></p>"
+    "<p><b>Auto-calibration (0 = off, 1 = propose thresholds, 2 = apply them)</b><br><input id=\"ac\" value=\""
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_21 = 
+    "\" name=\"ac\"></p>"
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_CT = 
+    "<p><b>Sensor %d CT Ratio and Burden (ohms, 0 = raw ADC counts)</b><br>"
+    "<input id=\"r%d\" name=\"r%d\" value=\"%u\" style=\"width:49%%\"> "
+    "<input id=\"b%d\" name=\"b%d\" value=\"%u\" style=\"width:49%%\"></p>"
+    ;
+
+const char *THIS_HTTP_BODY_WATCH_22 = 
     "<br><button name=\"save\" type=\"submit\" class=\"button bgrn\">Update</button>"
     "</form>"
     "</fieldset>"
@@ -376,12 +544,16 @@ const char *THIS_HTTP_BODY_WATCH_9 =
     "<form action=\"/\" method=\"get\"><button name>Home</button></form>"
     ;
 
-const char *THIS_HTTP_BODY_SAVE = 
+const char *THIS_HTTP_BODY_SAVE_0 = 
     "<div style=\"text-align:center;color:#eaeaea;\">"
     "<h3>Save Configuration</h3>"
     "<h2>" D_DEVICE "</h2>"
     "</div>"
-    "Configuration Saved. Restart to use saved settings."
+    "Configuration saved and in use. Restart to use new WiFi settings."
+    "<p></p>"
+    ;
+
+const char *THIS_HTTP_BODY_SAVE_1 = 
     "<p></p>"
     "<form action=\"/\" method=\"get\"><button name>Home</button></form>"
     ;
@@ -396,6 +568,15 @@ const char *THIS_HTTP_BODY_RESTART =
     "<form action=\"/\" method=\"get\"><button name>Home</button></form>"
     ;
 
+const char *THIS_HTTP_BODY_EXIT = 
+    "<div style=\"text-align:center;color:#eaeaea;\">"
+    "<h3>Leave Config Mode</h3>"
+    "<h2>" D_DEVICE "</h2>"
+    "</div>"
+    "Config mode is over: the access point is shutting down. Unsaved changes are discarded."
+    "<p></p>"
+    ;
+
 const char *THIS_HTTP_BODY_END =
     "</div>"
     "</body>"
@@ -425,14 +606,30 @@ void dump_wificonfig () {
     ESP_LOGI(TAG, "mqtt update interval = %d", wificonfig_vals_mqtt.update);
 
     // Dump watchdog
-    ESP_LOGI(TAG, "watchdog sensor = %u", wificonfig_vals_watchdog.sensor);
-    ESP_LOGI(TAG, "watchdog threshold = %u", wificonfig_vals_watchdog.thresh);
-    ESP_LOGI(TAG, "watchdog maxtime = %u", wificonfig_vals_watchdog.maxtime);
-    ESP_LOGI(TAG, "watchdog dutycycle = %u", wificonfig_vals_watchdog.dutycycle);
-    ESP_LOGI(TAG, "watchdog window = %u", wificonfig_vals_watchdog.window);
-    ESP_LOGI(TAG, "watchdog cooldown = %u", wificonfig_vals_watchdog.cooldown);
-    ESP_LOGI(TAG, "watchdog button timeout = %u", wificonfig_vals_watchdog.button_to);
-    ESP_LOGI(TAG, "watchdog mqtt timeout = %u", wificonfig_vals_watchdog.mqtt_to);
+    ESP_LOGI(TAG, "watchdog sensor = %u", wificonfig_watchdog_active->sensor);
+    ESP_LOGI(TAG, "watchdog threshold = %u", wificonfig_watchdog_active->thresh);
+    ESP_LOGI(TAG, "watchdog maxtime = %u s", wificonfig_watchdog_active->maxtime_s);
+    ESP_LOGI(TAG, "watchdog dutycycle = %u", wificonfig_watchdog_active->dutycycle);
+    ESP_LOGI(TAG, "watchdog window = %u", wificonfig_watchdog_active->window);
+    ESP_LOGI(TAG, "watchdog cooldown = %u s", wificonfig_watchdog_active->cooldown_s);
+    ESP_LOGI(TAG, "watchdog button timeout = %u s", wificonfig_watchdog_active->button_to_s);
+    ESP_LOGI(TAG, "watchdog mqtt timeout = %u s", wificonfig_watchdog_active->mqtt_to_s);
+    ESP_LOGI(TAG, "watchdog pre-alarm 1 = %u", wificonfig_watchdog_active->prewarn1);
+    ESP_LOGI(TAG, "watchdog pre-alarm 2 = %u", wificonfig_watchdog_active->prewarn2);
+    ESP_LOGI(TAG, "watchdog trip level = %u", wificonfig_watchdog_active->trip);
+    ESP_LOGI(TAG, "watchdog inrush = %u", wificonfig_watchdog_active->inrush);
+    ESP_LOGI(TAG, "watchdog unload = %u", wificonfig_watchdog_active->unload);
+    ESP_LOGI(TAG, "watchdog nostart = %u", wificonfig_watchdog_active->nostart);
+    ESP_LOGI(TAG, "watchdog anomaly alarms = %u", wificonfig_watchdog_active->anom_alarm);
+    ESP_LOGI(TAG, "watchdog min on = %u", wificonfig_watchdog_active->min_on);
+    ESP_LOGI(TAG, "watchdog min off = %u", wificonfig_watchdog_active->min_off);
+    ESP_LOGI(TAG, "watchdog coalesce = %u", wificonfig_watchdog_active->coalesce);
+    ESP_LOGI(TAG, "watchdog stop threshold = %u", wificonfig_watchdog_active->thresh_off);
+    ESP_LOGI(TAG, "watchdog auto-calibration = %u", wificonfig_watchdog_active->autocal);
+    ESP_LOGI(TAG, "watchdog CT ratios = %u %u %u %u", wificonfig_watchdog_active->ct_ratio0, wificonfig_watchdog_active->ct_ratio1,
+             wificonfig_watchdog_active->ct_ratio2, wificonfig_watchdog_active->ct_ratio3);
+    ESP_LOGI(TAG, "watchdog CT burdens = %u %u %u %u", wificonfig_watchdog_active->ct_burden0, wificonfig_watchdog_active->ct_burden1,
+             wificonfig_watchdog_active->ct_burden2, wificonfig_watchdog_active->ct_burden3);
 }
 
 static esp_err_t home_get_handler(httpd_req_t *req)
@@ -481,9 +678,159 @@ void set_authmode (char* b, int authmode) {
     }
 }
 
-static uint16_t number = DEFAULT_SCAN_LIST_SIZE;
-static wifi_ap_record_t ap_info[DEFAULT_SCAN_LIST_SIZE];
-static uint16_t ap_count = 0;
+// Scan results are kept in a cache, one entry per SSID (strongest RSSI
+// wins), sorted strongest first. Scans run in the background while the
+// soft-AP is up; an SSID is dropped once it has been missing from
+// SCAN_MAX_AGE consecutive scans.
+//
+#define SCAN_CACHE_SIZE CONFIG_WIFI_SCAN_CACHE_SIZE
+#define SCAN_INTERVAL   CONFIG_WIFI_SCAN_INTERVAL
+#define SCAN_MAX_AGE    3
+
+struct scan_entry {
+    char ssid[33];
+    int8_t rssi;
+    uint8_t authmode;
+    uint8_t age;        // scans since last seen
+};
+
+static struct scan_entry scan_cache[SCAN_CACHE_SIZE];
+static int scan_count = 0;
+static bool scan_mine = false;  // the scan under way is ours, not wifimgr's
+static SemaphoreHandle_t scan_mutex = NULL;
+static esp_timer_handle_t scan_timer = NULL;
+
+// insert or update an SSID, keeping the cache sorted by RSSI
+//
+static void scan_cache_add (const char *ssid, int8_t rssi, uint8_t authmode) {
+    int i;
+
+    for (i = 0; i < scan_count; i++) {
+        if (strcmp (scan_cache[i].ssid, ssid) == 0) {
+            break;
+        }
+    }
+    if (i < scan_count) {
+        // already seen this scan on another BSSID at a stronger level?
+        if ((scan_cache[i].age == 0) && (scan_cache[i].rssi >= rssi)) {
+            return;
+        }
+    } else if (scan_count < SCAN_CACHE_SIZE) {
+        i = scan_count++;
+    } else if (scan_cache[scan_count - 1].rssi < rssi) {
+        i = scan_count - 1;    // replace the weakest
+    } else {
+        return;
+    }
+
+    struct scan_entry e;
+    strlcpy (e.ssid, ssid, sizeof(e.ssid));
+    e.rssi = rssi;
+    e.authmode = authmode;
+    e.age = 0;
+
+    // move up or down to keep the order
+    while ((i > 0) && (scan_cache[i-1].rssi < rssi)) {
+        scan_cache[i] = scan_cache[i-1];
+        i--;
+    }
+    while ((i < scan_count - 1) && (scan_cache[i+1].rssi > rssi)) {
+        scan_cache[i] = scan_cache[i+1];
+        i++;
+    }
+    scan_cache[i] = e;
+}
+
+static void scan_done (void) {
+    uint16_t num = 0;
+    wifi_ap_record_t *records;
+
+    // wifimgr scans too, and fetches its own results
+    if (!scan_mine) {
+        return;
+    }
+    scan_mine = false;
+
+    esp_wifi_scan_get_ap_num (&num);
+    records = malloc ((num > 0 ? num : 1) * sizeof(wifi_ap_record_t));
+    if (records == NULL) {
+        esp_wifi_scan_get_ap_records (&num, NULL);   // frees the driver's list
+        return;
+    }
+    if (esp_wifi_scan_get_ap_records (&num, records) != ESP_OK) {
+        num = 0;
+    }
+
+    xSemaphoreTake (scan_mutex, portMAX_DELAY);
+
+    // age what we had, then merge in this scan
+    int n = 0;
+    for (int i = 0; i < scan_count; i++) {
+        if (++scan_cache[i].age < SCAN_MAX_AGE) {
+            scan_cache[n++] = scan_cache[i];
+        }
+    }
+    scan_count = n;
+    for (int i = 0; i < num; i++) {
+        if (records[i].ssid[0] != '\0') {
+            scan_cache_add ((char *) records[i].ssid, records[i].rssi, records[i].authmode);
+        }
+    }
+    ESP_LOGI(TAG, "scan done: %d APs found, %d SSIDs cached", num, scan_count);
+
+    xSemaphoreGive (scan_mutex);
+    free (records);
+}
+
+static void scan_start (void) {
+    esp_err_t err = esp_wifi_scan_start (NULL, false);
+    if (err == ESP_OK) {
+        scan_mine = true;
+    } else {
+        ESP_LOGI(TAG, "unable to start scan: %s", esp_err_to_name (err));
+    }
+}
+
+static void scan_timer_cb (void *arg) {
+    scan_start ();
+}
+
+// send the cached scan results as HTML
+//
+static void send_scan_list (httpd_req_t *req) {
+    xSemaphoreTake (scan_mutex, portMAX_DELAY);
+    if (scan_count > 0) {
+        char html_buf[80];
+        for (int i = 0; i < scan_count; i++) {
+            httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_SCAN_1, strlen(THIS_HTTP_BODY_WIFI_SCAN_1));
+            sprintf(html_buf, "%s</a>&nbsp %d &nbsp", scan_cache[i].ssid, scan_cache[i].rssi);
+            httpd_resp_send_chunk (req, html_buf, strlen(html_buf));
+            httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_SCAN_2, strlen(THIS_HTTP_BODY_WIFI_SCAN_2));
+            set_authmode (html_buf, scan_cache[i].authmode);
+            httpd_resp_send_chunk (req, html_buf, strlen(html_buf));
+            httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_SCAN_3, strlen(THIS_HTTP_BODY_WIFI_SCAN_3));
+        }
+    } else {
+        httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_SCAN_0, strlen(THIS_HTTP_BODY_WIFI_SCAN_0));
+    }
+    xSemaphoreGive (scan_mutex);
+}
+
+static esp_err_t scan_get_handler(httpd_req_t *req)
+{
+    send_scan_list (req);
+    httpd_resp_send_chunk (req, NULL, 0);
+    return ESP_OK;
+}
+
+static const httpd_uri_t scan = {
+    .uri       = "/scan",
+    .method    = HTTP_GET,
+    .handler   = scan_get_handler,
+    .user_ctx  = NULL
+};
+
+static void set_query_fields (const char *query, int group, void *vals);
 
 static esp_err_t wifi_get_handler(httpd_req_t *req)
 {
@@ -496,15 +843,7 @@ static esp_err_t wifi_get_handler(httpd_req_t *req)
     if (buf_len > 1) {
         buf = malloc(buf_len);
         if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK) {
-            httpd_query_key_value(buf, "s1", wificonfig_vals_wifi.ap1_ssid, sizeof(wificonfig_vals_wifi.ap1_ssid));
-            httpd_query_key_value(buf, "p1", wificonfig_vals_wifi.ap1_pswd, sizeof(wificonfig_vals_wifi.ap1_pswd));
-            httpd_query_key_value(buf, "s2", wificonfig_vals_wifi.ap2_ssid, sizeof(wificonfig_vals_wifi.ap2_ssid));
-            httpd_query_key_value(buf, "p2", wificonfig_vals_wifi.ap2_pswd, sizeof(wificonfig_vals_wifi.ap2_pswd));
-            httpd_query_key_value(buf, "s3", wificonfig_vals_wifi.ap3_ssid, sizeof(wificonfig_vals_wifi.ap3_ssid));
-            httpd_query_key_value(buf, "p3", wificonfig_vals_wifi.ap3_pswd, sizeof(wificonfig_vals_wifi.ap3_pswd));
-            httpd_query_key_value(buf, "s4", wificonfig_vals_wifi.ap4_ssid, sizeof(wificonfig_vals_wifi.ap4_ssid));
-            httpd_query_key_value(buf, "p4", wificonfig_vals_wifi.ap4_pswd, sizeof(wificonfig_vals_wifi.ap4_pswd));
-            httpd_query_key_value(buf, "hn", wificonfig_vals_wifi.hostname, sizeof(wificonfig_vals_wifi.hostname));
+            set_query_fields (buf, WIFICONFIG_GROUP_WIFI, &staged_wifi);
         }
         free(buf);
     }
@@ -516,57 +855,45 @@ static esp_err_t wifi_get_handler(httpd_req_t *req)
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_START, strlen(THIS_HTTP_BODY_START));
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_0, strlen(THIS_HTTP_BODY_WIFI_0));
 
-    if (ap_count > 0) {
-        char html_buf[80];
-        for (int i = 0; (i < DEFAULT_SCAN_LIST_SIZE) && (i < ap_count); i++) {
-            httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_SCAN_1, strlen(THIS_HTTP_BODY_WIFI_SCAN_1));
-            sprintf(html_buf, "%s</a>&nbsp %d &nbsp", ap_info[i].ssid, ap_info[i].rssi);
-            httpd_resp_send_chunk (req, html_buf, strlen(html_buf));
-            httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_SCAN_2, strlen(THIS_HTTP_BODY_WIFI_SCAN_2));
-            set_authmode (html_buf, ap_info[i].authmode);
-            httpd_resp_send_chunk (req, html_buf, strlen(html_buf));
-            httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_SCAN_3, strlen(THIS_HTTP_BODY_WIFI_SCAN_3));
-        }
-        
-    } else {
-        httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_SCAN_0, strlen(THIS_HTTP_BODY_WIFI_SCAN_0));
-    }
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_SC_0, strlen(THIS_HTTP_BODY_WIFI_SC_0));
+    send_scan_list (req);
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_SC_1, strlen(THIS_HTTP_BODY_WIFI_SC_1));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_1, strlen(THIS_HTTP_BODY_WIFI_1));
-    if (strlen(wificonfig_vals_wifi.ap1_ssid) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_wifi.ap1_ssid, strlen(wificonfig_vals_wifi.ap1_ssid));
+    if (strlen(staged_wifi.ap1_ssid) > 0)
+        httpd_resp_send_chunk (req, staged_wifi.ap1_ssid, strlen(staged_wifi.ap1_ssid));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_2, strlen(THIS_HTTP_BODY_WIFI_2));
-    if (strlen(wificonfig_vals_wifi.ap1_pswd) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_wifi.ap1_pswd, strlen(wificonfig_vals_wifi.ap1_pswd));
+    if (strlen(staged_wifi.ap1_pswd) > 0)
+        httpd_resp_send_chunk (req, staged_wifi.ap1_pswd, strlen(staged_wifi.ap1_pswd));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_3, strlen(THIS_HTTP_BODY_WIFI_3));
-    if (strlen(wificonfig_vals_wifi.ap2_ssid) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_wifi.ap2_ssid, strlen(wificonfig_vals_wifi.ap2_ssid));
+    if (strlen(staged_wifi.ap2_ssid) > 0)
+        httpd_resp_send_chunk (req, staged_wifi.ap2_ssid, strlen(staged_wifi.ap2_ssid));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_4, strlen(THIS_HTTP_BODY_WIFI_4));
-    if (strlen(wificonfig_vals_wifi.ap2_pswd) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_wifi.ap2_pswd, strlen(wificonfig_vals_wifi.ap2_pswd));
+    if (strlen(staged_wifi.ap2_pswd) > 0)
+        httpd_resp_send_chunk (req, staged_wifi.ap2_pswd, strlen(staged_wifi.ap2_pswd));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_5, strlen(THIS_HTTP_BODY_WIFI_5));
-    if (strlen(wificonfig_vals_wifi.ap3_ssid) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_wifi.ap3_ssid, strlen(wificonfig_vals_wifi.ap3_ssid));
+    if (strlen(staged_wifi.ap3_ssid) > 0)
+        httpd_resp_send_chunk (req, staged_wifi.ap3_ssid, strlen(staged_wifi.ap3_ssid));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_6, strlen(THIS_HTTP_BODY_WIFI_6));
-    if (strlen(wificonfig_vals_wifi.ap3_pswd) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_wifi.ap3_pswd, strlen(wificonfig_vals_wifi.ap3_pswd));
+    if (strlen(staged_wifi.ap3_pswd) > 0)
+        httpd_resp_send_chunk (req, staged_wifi.ap3_pswd, strlen(staged_wifi.ap3_pswd));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_7, strlen(THIS_HTTP_BODY_WIFI_7));
-    if (strlen(wificonfig_vals_wifi.ap4_ssid) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_wifi.ap4_ssid, strlen(wificonfig_vals_wifi.ap4_ssid));
+    if (strlen(staged_wifi.ap4_ssid) > 0)
+        httpd_resp_send_chunk (req, staged_wifi.ap4_ssid, strlen(staged_wifi.ap4_ssid));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_8, strlen(THIS_HTTP_BODY_WIFI_8));
-    if (strlen(wificonfig_vals_wifi.ap4_pswd) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_wifi.ap4_pswd, strlen(wificonfig_vals_wifi.ap4_pswd));
+    if (strlen(staged_wifi.ap4_pswd) > 0)
+        httpd_resp_send_chunk (req, staged_wifi.ap4_pswd, strlen(staged_wifi.ap4_pswd));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_9, strlen(THIS_HTTP_BODY_WIFI_9));
-    if (strlen(wificonfig_vals_wifi.hostname) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_wifi.hostname, strlen(wificonfig_vals_wifi.hostname));
+    if (strlen(staged_wifi.hostname) > 0)
+        httpd_resp_send_chunk (req, staged_wifi.hostname, strlen(staged_wifi.hostname));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WIFI_10, strlen(THIS_HTTP_BODY_WIFI_10));
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_END, strlen(THIS_HTTP_BODY_END));
@@ -583,10 +910,84 @@ static const httpd_uri_t wifi = {
     .user_ctx  = NULL
 };
 
-void validate_host (char *val, char *host) {
+// A change is made to a copy in the inactive buffer; making it active is
+// a single pointer store, so readers never see a half-made change. There
+// is only the one inactive buffer, so stage returns NULL while it's in use.
+//
+struct wificonfig_watchdog *wificonfig_watchdog_stage (void) {
+    struct wificonfig_watchdog *stage = NULL;
+
+    portENTER_CRITICAL (&watchdog_swap_mux);
+    if (!watchdog_staged) {
+        watchdog_staged = true;
+        stage = (wificonfig_watchdog_active == &watchdog_buffers[0]) ? &watchdog_buffers[1] : &watchdog_buffers[0];
+        *stage = *wificonfig_watchdog_active;
+    }
+    portEXIT_CRITICAL (&watchdog_swap_mux);
+    return stage;
+}
+
+void wificonfig_watchdog_swap (struct wificonfig_watchdog *stage) {
+    portENTER_CRITICAL (&watchdog_swap_mux);
+    wificonfig_watchdog_active = stage;
+    watchdog_staged = false;
+    portEXIT_CRITICAL (&watchdog_swap_mux);
+}
+
+void wificonfig_watchdog_unstage (void) {
+    portENTER_CRITICAL (&watchdog_swap_mux);
+    watchdog_staged = false;
+    portEXIT_CRITICAL (&watchdog_swap_mux);
+}
+
+void wificonfig_set_commit_cb (wificonfig_commit_cb_t cb) {
+    commit_cb = cb;
+}
+
+// Make new values active: a staged watchdog buffer (or NULL) and MQTT
+// values (or NULL). The application is then told what the values were.
+// WiFi values (or NULL) are only noted, to be saved.
+//
+void wificonfig_commit (struct wificonfig_watchdog *stage, const struct wificonfig_vals_mqtt *mqtt,
+                        const struct wificonfig_vals_wifi *wifi) {
+    struct wificonfig_watchdog old = *wificonfig_watchdog_active;
+    struct wificonfig_vals_mqtt old_mqtt = wificonfig_vals_mqtt;
+
+    if (stage != NULL) {
+        wificonfig_watchdog_swap (stage);
+    }
+    if (mqtt != NULL) {
+        wificonfig_vals_mqtt = *mqtt;
+    }
+    if (wifi != NULL) {
+        next_wifi = *wifi;
+    }
+    if (commit_cb != NULL) {
+        commit_cb (&old, &old_mqtt);
+    }
+}
+
+const struct wificonfig_vals_wifi *wificonfig_next_wifi (void) {
+    return &next_wifi;
+}
+
+// start the config pages from the active values
+//
+static void reset_staged (void) {
+    staged_wifi = next_wifi;
+    staged_mqtt = wificonfig_vals_mqtt;
+    staged_watchdog = *wificonfig_watchdog_active;
+    staged_wifi_base = staged_wifi;
+    staged_mqtt_base = staged_mqtt;
+    staged_watchdog_base = staged_watchdog;
+}
+
+// The validate_* functions store val if it passes, and say whether it did
+//
+bool validate_host (const char *val, char *host) {
     if (strcmp (val, "") == 0) {
         strcpy (host, "");
-        return;
+        return true;
     }
     unsigned int byte[4];
     if (sscanf (val, "%u.%u.%u.%u", &(byte[0]), &(byte[1]), &(byte[2]), &(byte[3])) == 4) {
@@ -595,24 +996,169 @@ void validate_host (char *val, char *host) {
             (byte[2] <= 255) &&
             (byte[3] <= 255)) {
             sprintf (host, "%u.%u.%u.%u", byte[0], byte[1], byte[2], byte[3]);
+            return true;
         }
     }
+    return false;
 }
 
-void validate_u16 (char *val, unsigned int min, unsigned int max, uint16_t *number) {
+// digits only, so that "1.5" or "1e3" isn't cut short to 1
+//
+static bool is_whole_number (const char *val) {
+    if ((*val == '\0') || (strlen (val) > 5)) {
+        return false;
+    }
+    for (; *val; val++) {
+        if ((*val < '0') || (*val > '9')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool validate_u16 (const char *val, unsigned int min, unsigned int max, uint16_t *number) {
     unsigned int sp;
-    if (sscanf (val, "%u", &sp) == 1) {
+    if (is_whole_number (val) && (sscanf (val, "%u", &sp) == 1)) {
         if ((sp >= min) && (sp <= max)) {
             *number = (uint16_t) sp;
+            return true;
         }
     }
+    return false;
 }
 
-void validate_u8 (char *val, unsigned int min, unsigned int max, uint8_t *number) {
+bool validate_u8 (const char *val, unsigned int min, unsigned int max, uint8_t *number) {
     unsigned int sp;
-    if (sscanf (val, "%u", &sp) == 1) {
+    if (is_whole_number (val) && (sscanf (val, "%u", &sp) == 1)) {
         if ((sp >= min) && (sp <= max)) {
             *number = (uint16_t) sp;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Every configuration value: its form id on the config pages, its name
+// in JSON (the struct member), and the rule it is validated by.
+//
+#define WIFI_FIELD(id, member, type) \
+    { id, #member, WIFICONFIG_GROUP_WIFI, type, offsetof (struct wificonfig_vals_wifi, member), \
+      sizeof(((struct wificonfig_vals_wifi *) 0)->member), 0, 0 }
+#define MQTT_FIELD(id, member, type, min, max) \
+    { id, #member, WIFICONFIG_GROUP_MQTT, type, offsetof (struct wificonfig_vals_mqtt, member), \
+      sizeof(((struct wificonfig_vals_mqtt *) 0)->member), min, max }
+#define WATCH_FIELD(id, member, type, min, max) \
+    { id, #member, WIFICONFIG_GROUP_WATCHDOG, type, offsetof (struct wificonfig_watchdog, member), \
+      sizeof(((struct wificonfig_watchdog *) 0)->member), min, max }
+
+const struct wificonfig_field wificonfig_fields[] = {
+    WIFI_FIELD  ("s1", ap1_ssid,    WIFICONFIG_STR),
+    WIFI_FIELD  ("p1", ap1_pswd,    WIFICONFIG_SECRET),
+    WIFI_FIELD  ("s2", ap2_ssid,    WIFICONFIG_STR),
+    WIFI_FIELD  ("p2", ap2_pswd,    WIFICONFIG_SECRET),
+    WIFI_FIELD  ("s3", ap3_ssid,    WIFICONFIG_STR),
+    WIFI_FIELD  ("p3", ap3_pswd,    WIFICONFIG_SECRET),
+    WIFI_FIELD  ("s4", ap4_ssid,    WIFICONFIG_STR),
+    WIFI_FIELD  ("p4", ap4_pswd,    WIFICONFIG_SECRET),
+    WIFI_FIELD  ("hn", hostname,    WIFICONFIG_STR),
+    MQTT_FIELD  ("ho", host,        WIFICONFIG_HOST, 0, 0),
+    MQTT_FIELD  ("po", port,        WIFICONFIG_U16,  1, 65535),
+    MQTT_FIELD  ("cl", client,      WIFICONFIG_STR,  0, 0),
+    MQTT_FIELD  ("us", user,        WIFICONFIG_STR,  0, 0),
+    MQTT_FIELD  ("pa", pswd,        WIFICONFIG_SECRET, 0, 0),
+    MQTT_FIELD  ("to", topic,       WIFICONFIG_STR,  0, 0),
+    MQTT_FIELD  ("up", update,      WIFICONFIG_U16,  0, 240),
+    WATCH_FIELD ("se", sensor,      WIFICONFIG_U8,   0, 3),
+    WATCH_FIELD ("th", thresh,      WIFICONFIG_U16,  1, 65535),
+    WATCH_FIELD ("ma", maxtime_s,   WIFICONFIG_U16,  10, 7200),
+    WATCH_FIELD ("dc", dutycycle,   WIFICONFIG_U8,   1, 100),
+    WATCH_FIELD ("wi", window,      WIFICONFIG_U16,  1, 480),
+    WATCH_FIELD ("co", cooldown_s,  WIFICONFIG_U16,  10, 28800),
+    WATCH_FIELD ("bt", button_to_s, WIFICONFIG_U16,  10, 28800),
+    WATCH_FIELD ("mt", mqtt_to_s,   WIFICONFIG_U16,  10, 28800),
+    WATCH_FIELD ("p1", prewarn1,    WIFICONFIG_U8,   0, 99),
+    WATCH_FIELD ("p2", prewarn2,    WIFICONFIG_U8,   0, 99),
+    WATCH_FIELD ("ft", trip,        WIFICONFIG_U16,  0, 65535),
+    WATCH_FIELD ("ir", inrush,      WIFICONFIG_U16,  0, 10000),
+    WATCH_FIELD ("ul", unload,      WIFICONFIG_U16,  0, 65535),
+    WATCH_FIELD ("ns", nostart,     WIFICONFIG_U16,  0, 600),
+    WATCH_FIELD ("aa", anom_alarm,  WIFICONFIG_U8,   0, 3),
+    WATCH_FIELD ("mn", min_on,      WIFICONFIG_U16,  0, 3600),
+    WATCH_FIELD ("mf", min_off,     WIFICONFIG_U16,  0, 3600),
+    WATCH_FIELD ("cw", coalesce,    WIFICONFIG_U16,  0, 600),
+    WATCH_FIELD ("tf", thresh_off,  WIFICONFIG_U16,  0, 65535),
+    WATCH_FIELD ("ac", autocal,     WIFICONFIG_U8,   0, 2),
+    WATCH_FIELD ("r0", ct_ratio0,   WIFICONFIG_U16,  1, 65535),
+    WATCH_FIELD ("r1", ct_ratio1,   WIFICONFIG_U16,  1, 65535),
+    WATCH_FIELD ("r2", ct_ratio2,   WIFICONFIG_U16,  1, 65535),
+    WATCH_FIELD ("r3", ct_ratio3,   WIFICONFIG_U16,  1, 65535),
+    WATCH_FIELD ("b0", ct_burden0,  WIFICONFIG_U16,  0, 10000),
+    WATCH_FIELD ("b1", ct_burden1,  WIFICONFIG_U16,  0, 10000),
+    WATCH_FIELD ("b2", ct_burden2,  WIFICONFIG_U16,  0, 10000),
+    WATCH_FIELD ("b3", ct_burden3,  WIFICONFIG_U16,  0, 10000),
+};
+
+const int wificonfig_num_fields = sizeof(wificonfig_fields) / sizeof(wificonfig_fields[0]);
+
+const struct wificonfig_field *wificonfig_find_field (int group, const char *name) {
+    for (int i = 0; i < wificonfig_num_fields; i++) {
+        if ((wificonfig_fields[i].group == group) && (strcmp (wificonfig_fields[i].name, name) == 0)) {
+            return &wificonfig_fields[i];
+        }
+    }
+    return NULL;
+}
+
+// validate val and store it in vals (a struct of the field's group);
+// returns NULL if it was stored, otherwise why not
+//
+const char *wificonfig_set_field (const struct wificonfig_field *field, void *vals, const char *val) {
+    char *p = (char *) vals + field->offset;
+
+    switch (field->type) {
+        case WIFICONFIG_U8:
+            return validate_u8 (val, field->min, field->max, (uint8_t *) p) ? NULL : "not a number in range";
+        case WIFICONFIG_U16:
+            return validate_u16 (val, field->min, field->max, (uint16_t *) p) ? NULL : "not a number in range";
+        case WIFICONFIG_HOST:
+            return validate_host (val, p) ? NULL : "not an IP address";
+        case WIFICONFIG_STR:
+        case WIFICONFIG_SECRET:
+            if (strlen (val) >= field->size) {
+                return "too long";
+            }
+            strcpy (p, val);
+            return NULL;
+        default:
+            return "unknown type";
+    }
+}
+
+// format a field's value; strings are not quoted
+//
+int wificonfig_format_field (const struct wificonfig_field *field, const void *vals, char *buf, size_t len) {
+    const char *p = (const char *) vals + field->offset;
+
+    switch (field->type) {
+        case WIFICONFIG_U8:
+            return snprintf (buf, len, "%u", *(const uint8_t *) p);
+        case WIFICONFIG_U16:
+            return snprintf (buf, len, "%u", *(const uint16_t *) p);
+        default:
+            return snprintf (buf, len, "%s", p);
+    }
+}
+
+// apply the values a config page submitted for one group
+//
+static void set_query_fields (const char *query, int group, void *vals) {
+    char val[80];
+
+    for (int i = 0; i < wificonfig_num_fields; i++) {
+        const struct wificonfig_field *field = &wificonfig_fields[i];
+        if ((field->group == group) &&
+            (httpd_query_key_value (query, field->id, val, sizeof(val)) == ESP_OK)) {
+            wificonfig_set_field (field, vals, val);
         }
     }
 }
@@ -621,7 +1167,6 @@ static esp_err_t mqtt_get_handler(httpd_req_t *req)
 {
     ESP_LOGI(TAG, "in mqtt config handler");
 
-    char val[20];
     char val_str[10];
     size_t buf_len;
     char* buf;
@@ -630,16 +1175,7 @@ static esp_err_t mqtt_get_handler(httpd_req_t *req)
     if (buf_len > 1) {
         buf = malloc(buf_len);
         if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK) {
-            httpd_query_key_value(buf, "ho", val, sizeof(val));
-            validate_host (val, wificonfig_vals_mqtt.host);
-            httpd_query_key_value(buf, "po", val, sizeof(val));
-            validate_u16 (val, 1, 65535, &wificonfig_vals_mqtt.port);
-            httpd_query_key_value(buf, "cl", wificonfig_vals_mqtt.client, sizeof(wificonfig_vals_mqtt.client));
-            httpd_query_key_value(buf, "us", wificonfig_vals_mqtt.user,   sizeof(wificonfig_vals_mqtt.user));
-            httpd_query_key_value(buf, "pa", wificonfig_vals_mqtt.pswd,   sizeof(wificonfig_vals_mqtt.pswd));
-            httpd_query_key_value(buf, "to", wificonfig_vals_mqtt.topic,  sizeof(wificonfig_vals_mqtt.topic));
-            httpd_query_key_value(buf, "up", val, sizeof(val));
-            validate_u16 (val, 0, 240, &wificonfig_vals_mqtt.update);
+            set_query_fields (buf, WIFICONFIG_GROUP_MQTT, &staged_mqtt);
         }
         free(buf);
     }
@@ -653,31 +1189,31 @@ static esp_err_t mqtt_get_handler(httpd_req_t *req)
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_MQTT_0, strlen(THIS_HTTP_BODY_MQTT_0));
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_MQTT_1, strlen(THIS_HTTP_BODY_MQTT_1));
-    if (strlen(wificonfig_vals_mqtt.host) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_mqtt.host, strlen(wificonfig_vals_mqtt.host));
+    if (strlen(staged_mqtt.host) > 0)
+        httpd_resp_send_chunk (req, staged_mqtt.host, strlen(staged_mqtt.host));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_MQTT_2, strlen(THIS_HTTP_BODY_MQTT_2));
-    sprintf (val_str, "%u", wificonfig_vals_mqtt.port);
+    sprintf (val_str, "%u", staged_mqtt.port);
     httpd_resp_send_chunk (req, val_str, strlen(val_str));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_MQTT_3, strlen(THIS_HTTP_BODY_MQTT_3));
-    if (strlen(wificonfig_vals_mqtt.client) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_mqtt.client, strlen(wificonfig_vals_mqtt.client));
+    if (strlen(staged_mqtt.client) > 0)
+        httpd_resp_send_chunk (req, staged_mqtt.client, strlen(staged_mqtt.client));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_MQTT_4, strlen(THIS_HTTP_BODY_MQTT_4));
-    if (strlen(wificonfig_vals_mqtt.user) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_mqtt.user, strlen(wificonfig_vals_mqtt.user));
+    if (strlen(staged_mqtt.user) > 0)
+        httpd_resp_send_chunk (req, staged_mqtt.user, strlen(staged_mqtt.user));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_MQTT_5, strlen(THIS_HTTP_BODY_MQTT_5));
-    if (strlen(wificonfig_vals_mqtt.pswd) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_mqtt.pswd, strlen(wificonfig_vals_mqtt.pswd));
+    if (strlen(staged_mqtt.pswd) > 0)
+        httpd_resp_send_chunk (req, staged_mqtt.pswd, strlen(staged_mqtt.pswd));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_MQTT_6, strlen(THIS_HTTP_BODY_MQTT_6));
-    if (strlen(wificonfig_vals_mqtt.topic) > 0)
-        httpd_resp_send_chunk (req, wificonfig_vals_mqtt.topic, strlen(wificonfig_vals_mqtt.topic));
+    if (strlen(staged_mqtt.topic) > 0)
+        httpd_resp_send_chunk (req, staged_mqtt.topic, strlen(staged_mqtt.topic));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_MQTT_7, strlen(THIS_HTTP_BODY_MQTT_7));
-    sprintf (val_str, "%u", wificonfig_vals_mqtt.update);
+    sprintf (val_str, "%u", staged_mqtt.update);
     httpd_resp_send_chunk (req, val_str, strlen(val_str));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_MQTT_8, strlen(THIS_HTTP_BODY_MQTT_8));
@@ -700,7 +1236,6 @@ static esp_err_t watchdog_get_handler(httpd_req_t *req)
 {
     ESP_LOGI(TAG, "in watchdog config handler");
 
-    char val[20];
     char num_str[10];
     size_t buf_len;
     char* buf;
@@ -709,22 +1244,7 @@ static esp_err_t watchdog_get_handler(httpd_req_t *req)
     if (buf_len > 1) {
         buf = malloc(buf_len);
         if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK) {
-            httpd_query_key_value(buf, "se", val, sizeof(val));
-            validate_u8 (val, 0, 3, &wificonfig_vals_watchdog.sensor);
-            httpd_query_key_value(buf, "th", val, sizeof(val));
-            validate_u16 (val, 1, 4096, &wificonfig_vals_watchdog.thresh);
-            httpd_query_key_value(buf, "ma", val, sizeof(val));
-            validate_u16 (val, 1, 120, &wificonfig_vals_watchdog.maxtime);
-            httpd_query_key_value(buf, "dc", val, sizeof(val));
-            validate_u8 (val, 1, 100, &wificonfig_vals_watchdog.dutycycle);
-            httpd_query_key_value(buf, "wi", val, sizeof(val));
-            validate_u16 (val, 1, 480, &wificonfig_vals_watchdog.window);
-            httpd_query_key_value(buf, "co", val, sizeof(val));
-            validate_u16 (val, 1, 480, &wificonfig_vals_watchdog.cooldown);
-            httpd_query_key_value(buf, "bt", val, sizeof(val));
-            validate_u16 (val, 1, 480, &wificonfig_vals_watchdog.button_to);
-            httpd_query_key_value(buf, "mt", val, sizeof(val));
-            validate_u16 (val, 1, 480, &wificonfig_vals_watchdog.mqtt_to);
+            set_query_fields (buf, WIFICONFIG_GROUP_WATCHDOG, &staged_watchdog);
         }
         free(buf);
     }
@@ -732,6 +1252,7 @@ static esp_err_t watchdog_get_handler(httpd_req_t *req)
 
     httpd_resp_send_chunk (req, THIS_HTTP_HEAD_START, strlen(THIS_HTTP_HEAD_START));
     httpd_resp_send_chunk (req, THIS_HTTP_STYLE, strlen(THIS_HTTP_STYLE));
+    httpd_resp_send_chunk (req, THIS_HTTP_WATCH_SCRIPT, strlen(THIS_HTTP_WATCH_SCRIPT));
     httpd_resp_send_chunk (req, THIS_HTTP_HEAD_END, strlen(THIS_HTTP_HEAD_END));
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_START, strlen(THIS_HTTP_BODY_START));
 
@@ -746,40 +1267,103 @@ static esp_err_t watchdog_get_handler(httpd_req_t *req)
         httpd_resp_send_chunk (req, html_buf, strlen(html_buf));
         httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_SENSOR_1, strlen(THIS_HTTP_BODY_WATCH_SENSOR_1));
     }
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_LIVE, strlen(THIS_HTTP_BODY_WATCH_LIVE));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_1, strlen(THIS_HTTP_BODY_WATCH_1));
-    sprintf (num_str, "%u", wificonfig_vals_watchdog.sensor);
+    sprintf (num_str, "%u", staged_watchdog.sensor);
     httpd_resp_send_chunk (req, num_str, strlen(num_str));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_2, strlen(THIS_HTTP_BODY_WATCH_2));
-    sprintf (num_str, "%u", wificonfig_vals_watchdog.thresh);
+    sprintf (num_str, "%u", staged_watchdog.thresh);
     httpd_resp_send_chunk (req, num_str, strlen(num_str));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_3, strlen(THIS_HTTP_BODY_WATCH_3));
-    sprintf (num_str, "%u", wificonfig_vals_watchdog.maxtime);
+    sprintf (num_str, "%u", staged_watchdog.maxtime_s);
     httpd_resp_send_chunk (req, num_str, strlen(num_str));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_4, strlen(THIS_HTTP_BODY_WATCH_4));
-    sprintf (num_str, "%u", wificonfig_vals_watchdog.dutycycle);
+    sprintf (num_str, "%u", staged_watchdog.dutycycle);
     httpd_resp_send_chunk (req, num_str, strlen(num_str));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_5, strlen(THIS_HTTP_BODY_WATCH_5));
-    sprintf (num_str, "%u", wificonfig_vals_watchdog.window);
+    sprintf (num_str, "%u", staged_watchdog.window);
     httpd_resp_send_chunk (req, num_str, strlen(num_str));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_6, strlen(THIS_HTTP_BODY_WATCH_6));
-    sprintf (num_str, "%u", wificonfig_vals_watchdog.cooldown);
+    sprintf (num_str, "%u", staged_watchdog.cooldown_s);
     httpd_resp_send_chunk (req, num_str, strlen(num_str));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_7, strlen(THIS_HTTP_BODY_WATCH_7));
-    sprintf (num_str, "%u", wificonfig_vals_watchdog.button_to);
+    sprintf (num_str, "%u", staged_watchdog.button_to_s);
     httpd_resp_send_chunk (req, num_str, strlen(num_str));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_8, strlen(THIS_HTTP_BODY_WATCH_8));
-    sprintf (num_str, "%u", wificonfig_vals_watchdog.mqtt_to);
+    sprintf (num_str, "%u", staged_watchdog.mqtt_to_s);
     httpd_resp_send_chunk (req, num_str, strlen(num_str));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_9, strlen(THIS_HTTP_BODY_WATCH_9));
+    sprintf (num_str, "%u", staged_watchdog.prewarn1);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_10, strlen(THIS_HTTP_BODY_WATCH_10));
+    sprintf (num_str, "%u", staged_watchdog.prewarn2);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_11, strlen(THIS_HTTP_BODY_WATCH_11));
+    sprintf (num_str, "%u", staged_watchdog.trip);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_12, strlen(THIS_HTTP_BODY_WATCH_12));
+    sprintf (num_str, "%u", staged_watchdog.inrush);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_13, strlen(THIS_HTTP_BODY_WATCH_13));
+    sprintf (num_str, "%u", staged_watchdog.unload);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_14, strlen(THIS_HTTP_BODY_WATCH_14));
+    sprintf (num_str, "%u", staged_watchdog.nostart);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_15, strlen(THIS_HTTP_BODY_WATCH_15));
+    sprintf (num_str, "%u", staged_watchdog.anom_alarm);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_16, strlen(THIS_HTTP_BODY_WATCH_16));
+    sprintf (num_str, "%u", staged_watchdog.min_on);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_17, strlen(THIS_HTTP_BODY_WATCH_17));
+    sprintf (num_str, "%u", staged_watchdog.min_off);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_18, strlen(THIS_HTTP_BODY_WATCH_18));
+    sprintf (num_str, "%u", staged_watchdog.coalesce);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_19, strlen(THIS_HTTP_BODY_WATCH_19));
+    sprintf (num_str, "%u", staged_watchdog.thresh_off);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_20, strlen(THIS_HTTP_BODY_WATCH_20));
+    sprintf (num_str, "%u", staged_watchdog.autocal);
+    httpd_resp_send_chunk (req, num_str, strlen(num_str));
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_21, strlen(THIS_HTTP_BODY_WATCH_21));
+
+    const uint16_t ct_ratio[NUM_SENSORS] = {
+        staged_watchdog.ct_ratio0, staged_watchdog.ct_ratio1, staged_watchdog.ct_ratio2, staged_watchdog.ct_ratio3
+    };
+    const uint16_t ct_burden[NUM_SENSORS] = {
+        staged_watchdog.ct_burden0, staged_watchdog.ct_burden1, staged_watchdog.ct_burden2, staged_watchdog.ct_burden3
+    };
+    char ct_buf[256];
+    for (int i=0; i<NUM_SENSORS; i++) {
+        snprintf (ct_buf, sizeof(ct_buf), THIS_HTTP_BODY_WATCH_CT, i, i, i, ct_ratio[i], i, i, ct_burden[i]);
+        httpd_resp_send_chunk (req, ct_buf, strlen(ct_buf));
+    }
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_WATCH_22, strlen(THIS_HTTP_BODY_WATCH_22));
 
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_END, strlen(THIS_HTTP_BODY_END));
     httpd_resp_send_chunk (req, NULL, 0);
@@ -793,94 +1377,266 @@ static const httpd_uri_t watchdog = {
     .user_ctx  = NULL
 };
 
-static esp_err_t save_get_handler(httpd_req_t *req)
-{
-    ESP_LOGI(TAG, "in save config handler");
+// NVS stores every value in 32-byte entries; a string takes one header
+// entry plus as many entries as its data (including terminator) needs
+//
+#define NVS_ENTRY_SIZE 32
+
+struct wificonfig_save_stats wificonfig_last_save;
+
+// Each nvs_set_* appends a new entry and retires the old one, even when the
+// value is unchanged, so compare against what is stored and only write
+// the keys that actually differ.
+//
+static esp_err_t save_str (nvs_handle_t my_handle, const char *key, const char *val, struct wificonfig_save_stats *stats) {
+    char old_val[80];
+    size_t ss = sizeof(old_val);
+    if ((nvs_get_str (my_handle, key, old_val, &ss) == ESP_OK) && (strcmp (old_val, val) == 0)) {
+        return ESP_OK;
+    }
+    esp_err_t err = nvs_set_str (my_handle, key, val);
+    if (err == ESP_OK) {
+        size_t len = strlen (val) + 1;
+        stats->keys++;
+        stats->entries += 1 + (len + NVS_ENTRY_SIZE - 1) / NVS_ENTRY_SIZE;
+        stats->bytes += len;
+    }
+    return err;
+}
+
+static esp_err_t save_u16 (nvs_handle_t my_handle, const char *key, uint16_t val, struct wificonfig_save_stats *stats) {
+    uint16_t old_val;
+    if ((nvs_get_u16 (my_handle, key, &old_val) == ESP_OK) && (old_val == val)) {
+        return ESP_OK;
+    }
+    esp_err_t err = nvs_set_u16 (my_handle, key, val);
+    if (err == ESP_OK) {
+        stats->keys++;
+        stats->entries++;
+        stats->bytes += sizeof(val);
+    }
+    return err;
+}
+
+static esp_err_t save_u8 (nvs_handle_t my_handle, const char *key, uint8_t val, struct wificonfig_save_stats *stats) {
+    uint8_t old_val;
+    if ((nvs_get_u8 (my_handle, key, &old_val) == ESP_OK) && (old_val == val)) {
+        return ESP_OK;
+    }
+    esp_err_t err = nvs_set_u8 (my_handle, key, val);
+    if (err == ESP_OK) {
+        stats->keys++;
+        stats->entries++;
+        stats->bytes += sizeof(val);
+    }
+    return err;
+}
 
+static esp_err_t save_i8 (nvs_handle_t my_handle, const char *key, int8_t val, struct wificonfig_save_stats *stats) {
+    int8_t old_val;
+    if ((nvs_get_i8 (my_handle, key, &old_val) == ESP_OK) && (old_val == val)) {
+        return ESP_OK;
+    }
+    esp_err_t err = nvs_set_i8 (my_handle, key, val);
+    if (err == ESP_OK) {
+        stats->keys++;
+        stats->entries++;
+        stats->bytes += sizeof(val);
+    }
+    return err;
+}
+
+// The timeouts were whole minutes until they moved to seconds. The
+// minute keys are still written, rounded up, so a unit loaded with older
+// firmware keeps a sensible configuration.
+//
+static uint16_t to_minutes (uint16_t seconds, uint16_t max) {
+    uint16_t minutes = (seconds + 59) / 60;
+    return (minutes < max) ? minutes : max;
+}
+
+// save configuration values to NVS, writing only what has changed
+//
+esp_err_t wificonfig_save (struct wificonfig_save_stats *stats, const char **err_msg) {
     esp_err_t err;
+    int64_t start_time = esp_timer_get_time ();
+
+    memset (stats, 0, sizeof(*stats));
+    *err_msg = NULL;
 
-    // try to save values to NVS
     nvs_handle_t my_handle;
     err = nvs_open(D_NAMESPACE, NVS_READWRITE, &my_handle);
     if (err != ESP_OK) {
-        char *resp_str = "Error opening NVS handle!";
-        httpd_resp_send(req, resp_str, strlen(resp_str));
+        *err_msg = "Error opening NVS handle!";
         return (err);
-    } else {
-        int8_t nvs_valid = true;
-        err = nvs_set_i8 (my_handle, "valid_flag", nvs_valid);
-        if (err != ESP_OK) {
-            char *resp_str = "Error setting valid_flag in NVS!";
-            httpd_resp_send(req, resp_str, strlen(resp_str));
-            nvs_close (my_handle);
-            return (err);
-        }
+    }
 
-        // save wifi configuration to NVS
-        if (((err = nvs_set_str (my_handle, "wifi_ap1_ssid", wificonfig_vals_wifi.ap1_ssid)) != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "wifi_ap1_pswd", wificonfig_vals_wifi.ap1_pswd)) != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "wifi_ap2_ssid", wificonfig_vals_wifi.ap2_ssid)) != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "wifi_ap2_pswd", wificonfig_vals_wifi.ap2_pswd)) != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "wifi_ap3_ssid", wificonfig_vals_wifi.ap3_ssid)) != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "wifi_ap3_pswd", wificonfig_vals_wifi.ap3_pswd)) != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "wifi_ap4_ssid", wificonfig_vals_wifi.ap4_ssid)) != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "wifi_ap4_pswd", wificonfig_vals_wifi.ap4_pswd)) != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "wifi_hostname", wificonfig_vals_wifi.hostname)) != ESP_OK)) {
-
-            char *resp_str = "Error setting wifi values in NVS!";
-            httpd_resp_send(req, resp_str, strlen(resp_str));
-            nvs_close (my_handle);
-            return (err);
-        }
+    int8_t nvs_valid = true;
+    err = save_i8 (my_handle, "valid_flag", nvs_valid, stats);
+    if (err != ESP_OK) {
+        *err_msg = "Error setting valid_flag in NVS!";
+        nvs_close (my_handle);
+        return (err);
+    }
 
-        // save wifi configuration to NVS
-        if (((err = nvs_set_str (my_handle, "mqtt_host",   wificonfig_vals_mqtt.host))   != ESP_OK) ||
-            ((err = nvs_set_u16 (my_handle, "mqtt_port",   wificonfig_vals_mqtt.port))   != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "mqtt_client", wificonfig_vals_mqtt.client)) != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "mqtt_user",   wificonfig_vals_mqtt.user))   != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "mqtt_pswd",   wificonfig_vals_mqtt.pswd))   != ESP_OK) ||
-            ((err = nvs_set_str (my_handle, "mqtt_topic",  wificonfig_vals_mqtt.topic))  != ESP_OK) ||
-            ((err = nvs_set_u16 (my_handle, "mqtt_update", wificonfig_vals_mqtt.update)) != ESP_OK)) {
-
-            char *resp_str = "Error setting mqtt values in NVS!";
-            httpd_resp_send(req, resp_str, strlen(resp_str));
-            nvs_close (my_handle);
-            return (err);
-        }
+    // save wifi configuration to NVS
+    if (((err = save_str (my_handle, "wifi_ap1_ssid", next_wifi.ap1_ssid, stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "wifi_ap1_pswd", next_wifi.ap1_pswd, stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "wifi_ap2_ssid", next_wifi.ap2_ssid, stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "wifi_ap2_pswd", next_wifi.ap2_pswd, stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "wifi_ap3_ssid", next_wifi.ap3_ssid, stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "wifi_ap3_pswd", next_wifi.ap3_pswd, stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "wifi_ap4_ssid", next_wifi.ap4_ssid, stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "wifi_ap4_pswd", next_wifi.ap4_pswd, stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "wifi_hostname", next_wifi.hostname, stats)) != ESP_OK)) {
+
+        *err_msg = "Error setting wifi values in NVS!";
+        nvs_close (my_handle);
+        return (err);
+    }
+
+    // save mqtt configuration to NVS
+    if (((err = save_str (my_handle, "mqtt_host",   wificonfig_vals_mqtt.host,   stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "mqtt_port",   wificonfig_vals_mqtt.port,   stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "mqtt_client", wificonfig_vals_mqtt.client, stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "mqtt_user",   wificonfig_vals_mqtt.user,   stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "mqtt_pswd",   wificonfig_vals_mqtt.pswd,   stats)) != ESP_OK) ||
+        ((err = save_str (my_handle, "mqtt_topic",  wificonfig_vals_mqtt.topic,  stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "mqtt_update", wificonfig_vals_mqtt.update, stats)) != ESP_OK)) {
 
+        *err_msg = "Error setting mqtt values in NVS!";
+        nvs_close (my_handle);
+        return (err);
+    }
 
-        // save watchdog configuration to NVS
-        if (((err = nvs_set_u8  (my_handle, "watch_sensor",     wificonfig_vals_watchdog.sensor))    != ESP_OK) ||
-            ((err = nvs_set_u16 (my_handle, "watch_thresh",     wificonfig_vals_watchdog.thresh))    != ESP_OK) ||
-            ((err = nvs_set_u16 (my_handle, "watch_maxtime",    wificonfig_vals_watchdog.maxtime))   != ESP_OK) ||
-            ((err = nvs_set_u8  (my_handle, "watch_dutycycle",  wificonfig_vals_watchdog.dutycycle)) != ESP_OK) ||
-            ((err = nvs_set_u16 (my_handle, "watch_window",     wificonfig_vals_watchdog.window))    != ESP_OK) ||
-            ((err = nvs_set_u16 (my_handle, "watch_cooldown",   wificonfig_vals_watchdog.cooldown))  != ESP_OK) ||
-            ((err = nvs_set_u16 (my_handle, "watch_button_to",  wificonfig_vals_watchdog.button_to)) != ESP_OK) ||
-            ((err = nvs_set_u16 (my_handle, "watch_mqtt_to",    wificonfig_vals_watchdog.mqtt_to))   != ESP_OK)) {
+    // save watchdog configuration to NVS
+    if (((err = save_u8  (my_handle, "watch_sensor",     wificonfig_watchdog_active->sensor,    stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_thresh",     wificonfig_watchdog_active->thresh,    stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_maxtime",    to_minutes (wificonfig_watchdog_active->maxtime_s, 120), stats)) != ESP_OK) ||
+        ((err = save_u8  (my_handle, "watch_dutycycle",  wificonfig_watchdog_active->dutycycle, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_window",     wificonfig_watchdog_active->window,    stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_cooldown",   to_minutes (wificonfig_watchdog_active->cooldown_s, 480),  stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_button_to",  to_minutes (wificonfig_watchdog_active->button_to_s, 480), stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_mqtt_to",    to_minutes (wificonfig_watchdog_active->mqtt_to_s, 480),   stats)) != ESP_OK) ||
+        ((err = save_u8  (my_handle, "watch_prewarn1",   wificonfig_watchdog_active->prewarn1,  stats)) != ESP_OK) ||
+        ((err = save_u8  (my_handle, "watch_prewarn2",   wificonfig_watchdog_active->prewarn2,  stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_trip",       wificonfig_watchdog_active->trip,      stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_inrush",     wificonfig_watchdog_active->inrush,    stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_unload",     wificonfig_watchdog_active->unload,    stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_nostart",    wificonfig_watchdog_active->nostart,   stats)) != ESP_OK) ||
+        ((err = save_u8  (my_handle, "watch_anom_alm",   wificonfig_watchdog_active->anom_alarm, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_min_on",     wificonfig_watchdog_active->min_on,    stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_min_off",    wificonfig_watchdog_active->min_off,   stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_coalesce",   wificonfig_watchdog_active->coalesce,  stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_thr_off",    wificonfig_watchdog_active->thresh_off, stats)) != ESP_OK) ||
+        ((err = save_u8  (my_handle, "watch_autocal",    wificonfig_watchdog_active->autocal,   stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_ct_r0",      wificonfig_watchdog_active->ct_ratio0, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_ct_r1",      wificonfig_watchdog_active->ct_ratio1, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_ct_r2",      wificonfig_watchdog_active->ct_ratio2, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_ct_r3",      wificonfig_watchdog_active->ct_ratio3, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_ct_b0",      wificonfig_watchdog_active->ct_burden0, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_ct_b1",      wificonfig_watchdog_active->ct_burden1, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_ct_b2",      wificonfig_watchdog_active->ct_burden2, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_ct_b3",      wificonfig_watchdog_active->ct_burden3, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_max_s",      wificonfig_watchdog_active->maxtime_s, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_cool_s",     wificonfig_watchdog_active->cooldown_s, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_button_s",   wificonfig_watchdog_active->button_to_s, stats)) != ESP_OK) ||
+        ((err = save_u16 (my_handle, "watch_mqtt_s",     wificonfig_watchdog_active->mqtt_to_s, stats)) != ESP_OK)) {
+
+        *err_msg = "Error setting watchdog values in NVS!";
+        nvs_close (my_handle);
+        return (err);
+    }
 
-            char *resp_str = "Error setting watchdog values in NVS!";
-            httpd_resp_send(req, resp_str, strlen(resp_str));
-            nvs_close (my_handle);
-            return (err);
-        }
-        
+    if (stats->keys > 0) {
         err = nvs_commit (my_handle);
         if (err != ESP_OK) {
-            char *resp_str = "Error committing NVS!";
-            httpd_resp_send(req, resp_str, strlen(resp_str));
+            *err_msg = "Error committing NVS!";
             nvs_close (my_handle);
             return (err);
         }
+    }
 
-        nvs_close (my_handle);
+    nvs_close (my_handle);
+
+    wificonfig_last_save = *stats;
+    ESP_LOGI(TAG, "saved config: %u keys changed, %u entries, %u bytes in %lld us",
+             stats->keys, stats->entries, stats->bytes, esp_timer_get_time () - start_time);
+    return (ESP_OK);
+}
+
+esp_err_t wificonfig_get_nvs_stats (nvs_stats_t *stats) {
+    return nvs_get_stats (NULL, stats);
+}
+
+// copy into vals the fields of a group that the pages changed from base;
+// whether there were any
+//
+static bool apply_changed (int group, void *vals, const void *staged, const void *base) {
+    bool changed = false;
+
+    for (int i = 0; i < wificonfig_num_fields; i++) {
+        const struct wificonfig_field *f = &wificonfig_fields[i];
+        if ((f->group == group) &&
+            (memcmp ((const char *) staged + f->offset, (const char *) base + f->offset, f->size) != 0)) {
+            memcpy ((char *) vals + f->offset, (const char *) staged + f->offset, f->size);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static esp_err_t save_get_handler(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "in save config handler");
+
+    esp_err_t err;
+    const char *err_msg;
+    struct wificonfig_save_stats stats;
+
+    // put the edited values into effect, then save them
+    struct wificonfig_watchdog *stage = wificonfig_watchdog_stage ();
+    if (stage == NULL) {
+        err_msg = "Configuration is being changed over MQTT, try again";
+        httpd_resp_send(req, err_msg, strlen(err_msg));
+        return (ESP_OK);
+    }
+    struct wificonfig_vals_mqtt mqtt = wificonfig_vals_mqtt;
+    struct wificonfig_vals_wifi wifi = next_wifi;
+    bool watchdog_changed = apply_changed (WIFICONFIG_GROUP_WATCHDOG, stage, &staged_watchdog, &staged_watchdog_base);
+    bool mqtt_changed = apply_changed (WIFICONFIG_GROUP_MQTT, &mqtt, &staged_mqtt, &staged_mqtt_base);
+    bool wifi_changed = apply_changed (WIFICONFIG_GROUP_WIFI, &wifi, &staged_wifi, &staged_wifi_base);
+    if (!watchdog_changed) {
+        wificonfig_watchdog_unstage ();
+    }
+    wificonfig_commit (watchdog_changed ? stage : NULL, mqtt_changed ? &mqtt : NULL, wifi_changed ? &wifi : NULL);
+    reset_staged ();
+
+    err = wificonfig_save (&stats, &err_msg);
+    if (err != ESP_OK) {
+        httpd_resp_send(req, err_msg, strlen(err_msg));
+        return (err);
     }
 
     httpd_resp_send_chunk (req, THIS_HTTP_HEAD_START, strlen(THIS_HTTP_HEAD_START));
     httpd_resp_send_chunk (req, THIS_HTTP_STYLE, strlen(THIS_HTTP_STYLE));
     httpd_resp_send_chunk (req, THIS_HTTP_HEAD_END, strlen(THIS_HTTP_HEAD_END));
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_START, strlen(THIS_HTTP_BODY_START));
-    httpd_resp_send_chunk (req, THIS_HTTP_BODY_SAVE, strlen(THIS_HTTP_BODY_SAVE));
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_SAVE_0, strlen(THIS_HTTP_BODY_SAVE_0));
+
+    char html_buf[160];
+    sprintf (html_buf, "<div>Changed keys: %u (%u NVS entries, %u bytes written)</div>",
+             stats.keys, stats.entries, stats.bytes);
+    httpd_resp_send_chunk (req, html_buf, strlen(html_buf));
+
+    nvs_stats_t nvs_stats;
+    if (wificonfig_get_nvs_stats (&nvs_stats) == ESP_OK) {
+        sprintf (html_buf, "<div>NVS entries: %u used, %u free, %u total</div>",
+                 nvs_stats.used_entries, nvs_stats.free_entries, nvs_stats.total_entries);
+        httpd_resp_send_chunk (req, html_buf, strlen(html_buf));
+    }
+
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_SAVE_1, strlen(THIS_HTTP_BODY_SAVE_1));
     httpd_resp_send_chunk (req, THIS_HTTP_BODY_END, strlen(THIS_HTTP_BODY_END));
     httpd_resp_send_chunk (req, NULL, 0);
     return ESP_OK;
@@ -894,6 +1650,83 @@ static const httpd_uri_t save = {
 };
 
 
+// JSON API for scripted provisioning: GET /api/config returns the whole
+// configuration (less passwords), PUT /api/config takes a document in the
+// same form (see wificonfig_json), streamed from the request body.
+//
+static esp_err_t send_chunk (void *ctx, const char *data, size_t len)
+{
+    return httpd_resp_send_chunk ((httpd_req_t *) ctx, data, len);
+}
+
+static esp_err_t api_config_get_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type (req, "application/json");
+    if (wificonfig_json_write (send_chunk, req) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk (req, NULL, 0);
+}
+
+static const httpd_uri_t api_config_get = {
+    .uri       = "/api/config",
+    .method    = HTTP_GET,
+    .handler   = api_config_get_handler,
+    .user_ctx  = NULL
+};
+
+static esp_err_t api_config_put_handler(httpd_req_t *req)
+{
+    // the server runs one handler at a time, so these can be static
+    static struct wificonfig_json doc;
+    static char result[768];
+    char buf[128];
+    size_t remaining = req->content_len;
+
+    ESP_LOGI(TAG, "in api config handler, %u bytes", req->content_len);
+
+    httpd_resp_set_type (req, "application/json");
+    if (wificonfig_json_begin (&doc, result, sizeof(result), true) != ESP_OK) {
+        httpd_resp_set_status (req, "409 Conflict");
+        httpd_resp_send (req, "{\"errors\":[{\"key\":\"\",\"error\":\"busy\"}],\"ok\":false}", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    while (remaining > 0) {
+        int len = httpd_req_recv (req, buf, MIN(remaining, sizeof(buf)));
+        if (len == HTTPD_SOCK_ERR_TIMEOUT) {
+            continue;
+        }
+        if (len <= 0) {
+            // the connection is gone; this ends in an error, so nothing changes
+            wificonfig_json_end (&doc);
+            return ESP_FAIL;
+        }
+        wificonfig_json_feed (&doc, buf, len);
+        remaining -= len;
+    }
+
+    bool ok = (wificonfig_json_end (&doc) == ESP_OK);
+    if (!ok) {
+        httpd_resp_set_status (req, HTTPD_400);
+    }
+    httpd_resp_send (req, result, HTTPD_RESP_USE_STRLEN);
+
+    if (ok && doc.restart) {
+        // wait two seconds before resetting so the result can be sent
+        vTaskDelay(2000 / portTICK_RATE_MS);
+        esp_restart();
+    }
+    return ESP_OK;
+}
+
+static const httpd_uri_t api_config_put = {
+    .uri       = "/api/config",
+    .method    = HTTP_PUT,
+    .handler   = api_config_put_handler,
+    .user_ctx  = NULL
+};
+
+
 static esp_err_t restart_get_handler(httpd_req_t *req)
 {
     ESP_LOGI(TAG, "in restart config handler");
@@ -919,6 +1752,40 @@ static const httpd_uri_t restart = {
     .user_ctx  = NULL
 };
 
+static void leave_config_mode (void *arg);
+
+static esp_err_t leave_get_handler(httpd_req_t *req)
+{
+    ESP_LOGI(TAG, "in leave config handler");
+
+    httpd_resp_send_chunk (req, THIS_HTTP_HEAD_START, strlen(THIS_HTTP_HEAD_START));
+    httpd_resp_send_chunk (req, THIS_HTTP_STYLE, strlen(THIS_HTTP_STYLE));
+    httpd_resp_send_chunk (req, THIS_HTTP_HEAD_END, strlen(THIS_HTTP_HEAD_END));
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_START, strlen(THIS_HTTP_BODY_START));
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_EXIT, strlen(THIS_HTTP_BODY_EXIT));
+    httpd_resp_send_chunk (req, THIS_HTTP_BODY_END, strlen(THIS_HTTP_BODY_END));
+    httpd_resp_send_chunk (req, NULL, 0);
+
+    // not from inside this handler, which is one of those going away
+    httpd_queue_work (req->handle, leave_config_mode, NULL);
+    return ESP_OK;
+}
+
+static const httpd_uri_t leave = {
+    .uri       = "/exit",
+    .method    = HTTP_GET,
+    .handler   = leave_get_handler,
+    .user_ctx  = NULL
+};
+
+// the pages served only in config mode
+//
+static const httpd_uri_t *config_uris[] = {
+    &home, &wifi, &scan, &mqtt, &watchdog, &save, &restart, &leave,
+    &api_config_get, &api_config_put
+};
+#define NUM_CONFIG_URIS (sizeof(config_uris) / sizeof(config_uris[0]))
+
 
 /* This handler allows the custom error handling functionality to be
  * tested from client side. For that, when a PUT request 0 is sent to
@@ -947,34 +1814,91 @@ esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err)
     return ESP_FAIL;
 }
 
+// handlers registered by the application, served in both config mode
+// and (via wificonfig_start_server) normal operation
+//
+#define MAX_EXTRA_URIS 8
+static const httpd_uri_t *extra_uris[MAX_EXTRA_URIS];
+static int extra_uri_count = 0;
+static httpd_handle_t server = NULL;
+
+esp_err_t wificonfig_register_uri (const httpd_uri_t *uri)
+{
+    if (extra_uri_count >= MAX_EXTRA_URIS) {
+        ESP_LOGE(TAG, "Too many URI handlers, not registering %s", uri->uri);
+        return ESP_ERR_NO_MEM;
+    }
+    extra_uris[extra_uri_count++] = uri;
+    if (server != NULL) {
+        return httpd_register_uri_handler(server, uri);
+    }
+    return ESP_OK;
+}
+
+// handlers registered by the application that, like the config pages,
+// change the controller and so are served only in config mode
+//
+#define MAX_APP_CONFIG_URIS 2
+static const httpd_uri_t *app_config_uris[MAX_APP_CONFIG_URIS];
+static int app_config_uri_count = 0;
+
+esp_err_t wificonfig_register_config_uri (const httpd_uri_t *uri)
+{
+    if (app_config_uri_count >= MAX_APP_CONFIG_URIS) {
+        ESP_LOGE(TAG, "Too many config URI handlers, not registering %s", uri->uri);
+        return ESP_ERR_NO_MEM;
+    }
+    app_config_uris[app_config_uri_count++] = uri;
+    if ((server != NULL) && config_mode) {
+        return httpd_register_uri_handler(server, uri);
+    }
+    return ESP_OK;
+}
+
 static httpd_handle_t start_webserver(void)
 {
-    httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.max_uri_handlers = NUM_CONFIG_URIS + MAX_APP_CONFIG_URIS + MAX_EXTRA_URIS;
 
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
     if (httpd_start(&server, &config) == ESP_OK) {
         // Set URI handlers
         ESP_LOGI(TAG, "Registering URI handlers");
-        httpd_register_uri_handler(server, &home);
-        httpd_register_uri_handler(server, &wifi);
-        httpd_register_uri_handler(server, &mqtt);
-        httpd_register_uri_handler(server, &watchdog);
-        httpd_register_uri_handler(server, &save);
-        httpd_register_uri_handler(server, &restart);
+        for (int i = 0; i < extra_uri_count; i++) {
+            httpd_register_uri_handler(server, extra_uris[i]);
+        }
         return server;
     }
 
     ESP_LOGI(TAG, "Error starting server!");
+    server = NULL;
     return NULL;
 }
 
+esp_err_t wificonfig_start_server (void)
+{
+    if (server != NULL) {
+        return ESP_OK;
+    }
+    if (start_webserver() == NULL) {
+        return ESP_FAIL;
+    }
+    if (config_requested) {
+        trigger_wificonfig ();
+    }
+    return ESP_OK;
+}
+
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                                     int32_t event_id, void* event_data)
 {
     if (event_id == WIFI_EVENT_AP_START) {
         ESP_LOGI(TAG, "ESP32 is started in AP mode");
+        scan_start ();
+
+    } else if (event_id == WIFI_EVENT_SCAN_DONE) {
+        scan_done ();
 
     } else if (event_id == WIFI_EVENT_AP_STACONNECTED) {
         wifi_event_ap_staconnected_t* event = (wifi_event_ap_staconnected_t*) event_data;
@@ -987,37 +1911,26 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
     }
 }
 
-void wificonfig_scan(void) {
-    esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
-    assert(sta_netif);
-
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
-    memset(ap_info, 0, sizeof(ap_info));
-
-    ap_count = 0;
-    ESP_LOGI(TAG, "Starting AP scan");
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_start());
-    ESP_ERROR_CHECK(esp_wifi_scan_start(NULL, true));
-    ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&number, ap_info));
-    ESP_ERROR_CHECK(esp_wifi_scan_get_ap_num(&ap_count));
-    ESP_ERROR_CHECK(esp_wifi_stop());
-}
-
-void wifi_init_ap(void)
+// Bring up the soft-AP alongside the station. The WiFi driver is already
+// running for normal operation, so only the AP side is set up here.
+//
+static void start_ap (void)
 {
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_ap();
+    static bool initialized = false;
 
-    wificonfig_scan();
+    if (!initialized) {
+        initialized = true;
+        esp_netif_create_default_wifi_ap();
 
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+        scan_mutex = xSemaphoreCreateMutex();
+        const esp_timer_create_args_t timer_args = {
+            .callback = &scan_timer_cb,
+            .name = "wificonfig_scan",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &scan_timer));
 
-    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
+        ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
+    }
 
     wifi_config_t wifi_config = {
         .ap = {
@@ -1032,14 +1945,47 @@ void wifi_init_ap(void)
         wifi_config.ap.authmode = WIFI_AUTH_OPEN;
     }
 
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_AP));
+    // APSTA: the station stays connected (or keeps trying) and scans in
+    // the background while the soft-AP serves pages
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
     ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_AP, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
+    ESP_ERROR_CHECK(esp_timer_start_periodic(scan_timer, SCAN_INTERVAL * 1000000ULL));
 
-    ESP_LOGI(TAG, "wifi_init_softap finished. SSID:%s password:%s",
+    ESP_LOGI(TAG, "soft-AP started. SSID:%s password:%s",
              WIFI_SSID, WIFI_PASS);
 }
 
+// runs in the server task, via httpd_queue_work
+//
+static void register_config_pages (void *arg)
+{
+    for (int i = 0; i < NUM_CONFIG_URIS; i++) {
+        httpd_register_uri_handler(server, config_uris[i]);
+    }
+    for (int i = 0; i < app_config_uri_count; i++) {
+        httpd_register_uri_handler(server, app_config_uris[i]);
+    }
+}
+
+static void leave_config_mode (void *arg)
+{
+    for (int i = 0; i < NUM_CONFIG_URIS; i++) {
+        httpd_unregister_uri_handler(server, config_uris[i]->uri, config_uris[i]->method);
+    }
+    for (int i = 0; i < app_config_uri_count; i++) {
+        httpd_unregister_uri_handler(server, app_config_uris[i]->uri, app_config_uris[i]->method);
+    }
+    esp_timer_stop (scan_timer);
+    esp_wifi_set_mode (WIFI_MODE_STA);
+    config_mode = false;
+    ESP_LOGI(TAG, "left config mode");
+}
+
+bool wificonfig_active (void)
+{
+    return config_mode;
+}
+
 // set configuration values to defaults
 //
 void init_wificonfig(void) {
@@ -1068,14 +2014,34 @@ void init_wificonfig(void) {
     wificonfig_vals_mqtt.update = 5;
 
     // watchdog
-    wificonfig_vals_watchdog.sensor = 0;
-    wificonfig_vals_watchdog.thresh = 500;
-    wificonfig_vals_watchdog.maxtime = 20;
-    wificonfig_vals_watchdog.dutycycle = 50;
-    wificonfig_vals_watchdog.window = 60;
-    wificonfig_vals_watchdog.cooldown = 60;
-    wificonfig_vals_watchdog.button_to = 120;
-    wificonfig_vals_watchdog.mqtt_to = 10;
+    wificonfig_watchdog_active->sensor = 0;
+    wificonfig_watchdog_active->thresh = 500;
+    wificonfig_watchdog_active->maxtime_s = 20 * 60;
+    wificonfig_watchdog_active->dutycycle = 50;
+    wificonfig_watchdog_active->window = 60;
+    wificonfig_watchdog_active->cooldown_s = 60 * 60;
+    wificonfig_watchdog_active->button_to_s = 120 * 60;
+    wificonfig_watchdog_active->mqtt_to_s = 10 * 60;
+    wificonfig_watchdog_active->prewarn1 = 80;
+    wificonfig_watchdog_active->prewarn2 = 90;
+    wificonfig_watchdog_active->trip = 0;
+    wificonfig_watchdog_active->inrush = 1000;
+    wificonfig_watchdog_active->unload = 0;
+    wificonfig_watchdog_active->nostart = 0;
+    wificonfig_watchdog_active->anom_alarm = 0;
+    wificonfig_watchdog_active->min_on = 0;
+    wificonfig_watchdog_active->min_off = 0;
+    wificonfig_watchdog_active->coalesce = 0;
+    wificonfig_watchdog_active->thresh_off = 0;
+    wificonfig_watchdog_active->autocal = 1;
+    wificonfig_watchdog_active->ct_ratio0 = 2000;
+    wificonfig_watchdog_active->ct_ratio1 = 2000;
+    wificonfig_watchdog_active->ct_ratio2 = 2000;
+    wificonfig_watchdog_active->ct_ratio3 = 2000;
+    wificonfig_watchdog_active->ct_burden0 = 0;
+    wificonfig_watchdog_active->ct_burden1 = 0;
+    wificonfig_watchdog_active->ct_burden2 = 0;
+    wificonfig_watchdog_active->ct_burden3 = 0;
 
 }
 // read configuration values from NVS
@@ -1084,6 +2050,7 @@ esp_err_t get_nvs_wificonfig(nvs_handle_t my_handle) {
     esp_err_t err;
     esp_err_t last_err = ESP_OK;
     size_t ss;
+    uint16_t minutes;
 
     // wifi parameters
     if ((err = nvs_get_str(my_handle, "wifi_ap1_ssid", NULL,                          &ss)) != ESP_OK) last_err = err;
@@ -1134,52 +2101,70 @@ esp_err_t get_nvs_wificonfig(nvs_handle_t my_handle) {
     if ((err = nvs_get_u16(my_handle, "mqtt_update", &wificonfig_vals_mqtt.update)) != ESP_OK) last_err = err;
 
     // watchdog parameters
-    if ((err = nvs_get_u8(my_handle,  "watch_sensor",     &wificonfig_vals_watchdog.sensor))    != ESP_OK) last_err = err;
-    if ((err = nvs_get_u16(my_handle, "watch_thresh",     &wificonfig_vals_watchdog.thresh))    != ESP_OK) last_err = err;
-    if ((err = nvs_get_u16(my_handle, "watch_maxtime",    &wificonfig_vals_watchdog.maxtime))   != ESP_OK) last_err = err;
-    if ((err = nvs_get_u8(my_handle,  "watch_dutycycle",  &wificonfig_vals_watchdog.dutycycle)) != ESP_OK) last_err = err;
-    if ((err = nvs_get_u16(my_handle, "watch_window",     &wificonfig_vals_watchdog.window))    != ESP_OK) last_err = err;
-    if ((err = nvs_get_u16(my_handle, "watch_cooldown",   &wificonfig_vals_watchdog.cooldown))  != ESP_OK) last_err = err;
-    if ((err = nvs_get_u16(my_handle, "watch_button_to",  &wificonfig_vals_watchdog.button_to)) != ESP_OK) last_err = err;
-    if ((err = nvs_get_u16(my_handle, "watch_mqtt_to",    &wificonfig_vals_watchdog.mqtt_to))   != ESP_OK) last_err = err;
+    if ((err = nvs_get_u8(my_handle,  "watch_sensor",     &wificonfig_watchdog_active->sensor))    != ESP_OK) last_err = err;
+    if ((err = nvs_get_u16(my_handle, "watch_thresh",     &wificonfig_watchdog_active->thresh))    != ESP_OK) last_err = err;
+    if ((err = nvs_get_u16(my_handle, "watch_maxtime",    &minutes))                               != ESP_OK) last_err = err;
+    else wificonfig_watchdog_active->maxtime_s = minutes * 60;
+    if ((err = nvs_get_u8(my_handle,  "watch_dutycycle",  &wificonfig_watchdog_active->dutycycle)) != ESP_OK) last_err = err;
+    if ((err = nvs_get_u16(my_handle, "watch_window",     &wificonfig_watchdog_active->window))    != ESP_OK) last_err = err;
+    if ((err = nvs_get_u16(my_handle, "watch_cooldown",   &minutes))                               != ESP_OK) last_err = err;
+    else wificonfig_watchdog_active->cooldown_s = minutes * 60;
+    if ((err = nvs_get_u16(my_handle, "watch_button_to",  &minutes))                               != ESP_OK) last_err = err;
+    else wificonfig_watchdog_active->button_to_s = minutes * 60;
+    if ((err = nvs_get_u16(my_handle, "watch_mqtt_to",    &minutes))                               != ESP_OK) last_err = err;
+    else wificonfig_watchdog_active->mqtt_to_s = minutes * 60;
+
+    // Keys added since the first release are optional: a missing key
+    // keeps its default rather than sending an upgraded unit back into
+    // wificonfig mode.
+    nvs_get_u8(my_handle,  "watch_prewarn1",   &wificonfig_watchdog_active->prewarn1);
+    nvs_get_u8(my_handle,  "watch_prewarn2",   &wificonfig_watchdog_active->prewarn2);
+    nvs_get_u16(my_handle, "watch_trip",       &wificonfig_watchdog_active->trip);
+    nvs_get_u16(my_handle, "watch_inrush",     &wificonfig_watchdog_active->inrush);
+    nvs_get_u16(my_handle, "watch_unload",     &wificonfig_watchdog_active->unload);
+    nvs_get_u16(my_handle, "watch_nostart",    &wificonfig_watchdog_active->nostart);
+    nvs_get_u8(my_handle,  "watch_anom_alm",   &wificonfig_watchdog_active->anom_alarm);
+    nvs_get_u16(my_handle, "watch_min_on",     &wificonfig_watchdog_active->min_on);
+    nvs_get_u16(my_handle, "watch_min_off",    &wificonfig_watchdog_active->min_off);
+    nvs_get_u16(my_handle, "watch_coalesce",   &wificonfig_watchdog_active->coalesce);
+    nvs_get_u16(my_handle, "watch_thr_off",    &wificonfig_watchdog_active->thresh_off);
+    nvs_get_u8(my_handle,  "watch_autocal",    &wificonfig_watchdog_active->autocal);
+    nvs_get_u16(my_handle, "watch_ct_r0",      &wificonfig_watchdog_active->ct_ratio0);
+    nvs_get_u16(my_handle, "watch_ct_r1",      &wificonfig_watchdog_active->ct_ratio1);
+    nvs_get_u16(my_handle, "watch_ct_r2",      &wificonfig_watchdog_active->ct_ratio2);
+    nvs_get_u16(my_handle, "watch_ct_r3",      &wificonfig_watchdog_active->ct_ratio3);
+    nvs_get_u16(my_handle, "watch_ct_b0",      &wificonfig_watchdog_active->ct_burden0);
+    nvs_get_u16(my_handle, "watch_ct_b1",      &wificonfig_watchdog_active->ct_burden1);
+    nvs_get_u16(my_handle, "watch_ct_b2",      &wificonfig_watchdog_active->ct_burden2);
+    nvs_get_u16(my_handle, "watch_ct_b3",      &wificonfig_watchdog_active->ct_burden3);
+
+    // the timeouts in seconds, where saved, override the minute keys
+    nvs_get_u16(my_handle, "watch_max_s",      &wificonfig_watchdog_active->maxtime_s);
+    nvs_get_u16(my_handle, "watch_cool_s",     &wificonfig_watchdog_active->cooldown_s);
+    nvs_get_u16(my_handle, "watch_button_s",   &wificonfig_watchdog_active->button_to_s);
+    nvs_get_u16(my_handle, "watch_mqtt_s",     &wificonfig_watchdog_active->mqtt_to_s);
 
     return (last_err);
 }
 
-// Force return to wificonfig by clearing valid flag and restarting
+// Enter config mode: the soft-AP and config pages come up while the
+// watchdog carries on. Before the web server is running, this just notes
+// that config mode is wanted.
 //
 void trigger_wificonfig () {
     ESP_LOGI(TAG, "in trigger_wificonifg");
 
-    esp_err_t err;
-
-    // try to save values to NVS
-    nvs_handle_t my_handle;
-    err = nvs_open(D_NAMESPACE, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE (TAG, "Error opening NVS handle!");
-    } else {
-        int8_t nvs_valid = false;
-        err = nvs_set_i8 (my_handle, "valid_flag", nvs_valid);
-        if (err != ESP_OK) {
-            ESP_LOGE (TAG, "Error clearing valid_flag in NVS!");
-            nvs_close (my_handle);
-            return;
-        }
-        
-        err = nvs_commit (my_handle);
-        if (err != ESP_OK) {
-            ESP_LOGE (TAG, "Error committing NVS!");
-            nvs_close (my_handle);
-            return;
-        }
-
-        nvs_close (my_handle);
-        ESP_LOGI (TAG, "Restarting...");
-        esp_restart();
-
+    if (config_mode) {
+        return;
     }
-
+    if (server == NULL) {
+        config_requested = true;
+        return;
+    }
+    config_mode = true;
+    reset_staged ();
+    start_ap ();
+    httpd_queue_work (server, register_config_pages, NULL);
 }
 
 esp_err_t wificonfig(void)
@@ -1206,6 +2191,7 @@ esp_err_t wificonfig(void)
     if (err != ESP_OK) {
         printf("Error (%s) opening NVS handle!\n", esp_err_to_name(err));
         ESP_LOGE(TAG, "Error (%s) opening NVS handle!\n", esp_err_to_name(err));
+        next_wifi = wificonfig_vals_wifi;
         return (err);
     } else {
         ESP_LOGI(TAG, "Opened NVS");
@@ -1216,28 +2202,21 @@ esp_err_t wificonfig(void)
                 ESP_LOGI(TAG, "Have valid config data, returning to main");
                 nvs_close (my_handle);
                 dump_wificonfig();
+                next_wifi = wificonfig_vals_wifi;
                 return (ESP_OK);
             }
         } else {
             nvs_valid = false;
         }
 
-        ESP_LOGI(TAG, "invalid config data, starting server");
+        ESP_LOGI(TAG, "invalid config data, config mode needed");
         nvs_close (my_handle);
     }
     dump_wificonfig();
+    next_wifi = wificonfig_vals_wifi;
 
-    // if we are here, NVS isn't valid -> fire up the AP and webserver
+    // if we are here, NVS isn't valid: the caller runs with the defaults
+    // and enters config mode
     //
-
-    /* Start the access-point */
-    wifi_init_ap();
-
-    start_webserver();
-
-    // wait forever until restart
-    while (1) {
-        vTaskDelay(100 / portTICK_RATE_MS);
-    }
-    return (ESP_OK);
+    return (ESP_ERR_NOT_FOUND);
 }
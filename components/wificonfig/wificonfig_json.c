@@ -0,0 +1,283 @@
+/*
+ * wificonfig_json
+ *
+ * Setting the configuration values from a JSON document, and writing
+ * them out as one. Only one document can be in progress at a time, since
+ * the watchdog values are staged in the one inactive buffer.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "wificonfig.h"
+
+#define RESULT_TAIL 64  // room kept to close the result
+
+extern const char *TAG;
+
+static const char *group_names[] = { "mqtt", "watchdog", "wifi" };
+#define NUM_GROUPS (sizeof(group_names) / sizeof(group_names[0]))
+
+// write s as a JSON string, quotes included
+//
+static int json_string (char *buf, size_t len, const char *s) {
+    int pos = snprintf (buf, len, "\"");
+    for (; *s && (pos < len); s++) {
+        if ((*s == '"') || (*s == '\\')) {
+            pos += snprintf (buf + pos, len - pos, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            pos += snprintf (buf + pos, len - pos, "\\u%04x", *s);
+        } else {
+            pos += snprintf (buf + pos, len - pos, "%c", *s);
+        }
+    }
+    if (pos < len) {
+        pos += snprintf (buf + pos, len - pos, "\"");
+    }
+    return pos;
+}
+
+static void add_error (struct wificonfig_json *doc, const char *key, const char *error) {
+    int len = doc->result_len - RESULT_TAIL;
+    int pos = doc->result_pos;
+
+    ESP_LOGW(TAG, "config: %s: %s", key, error);
+    doc->errors++;
+    if (pos >= len) {
+        return;
+    }
+    pos += snprintf (doc->result + pos, len - pos, "%s{\"key\":", (doc->result[pos - 1] != '[') ? "," : "");
+    if (pos < len) pos += json_string (doc->result + pos, len - pos, key);
+    if (pos < len) pos += snprintf (doc->result + pos, len - pos, ",\"error\":");
+    if (pos < len) pos += json_string (doc->result + pos, len - pos, error);
+    if (pos < len) pos += snprintf (doc->result + pos, len - pos, "}");
+    // an error that doesn't fit is left out whole, so the result stays valid
+    if (pos < len) {
+        doc->result_pos = pos;
+    } else {
+        doc->result[doc->result_pos] = '\0';
+    }
+}
+
+static bool json_value (struct jsonparse *p, enum jsonparse_type type, const char *value) {
+    struct wificonfig_json *doc = p->ctx;
+    const struct wificonfig_field *field = NULL;
+    char key[2 * JSONPARSE_KEY_LEN];
+    int group;
+
+    snprintf (key, sizeof(key), "%s%s%s", p->key[0], (p->depth > 1) ? "." : "", (p->depth > 1) ? p->key[1] : "");
+    bool *flag = (strcmp (p->key[0], "persist") == 0) ? &doc->persist :
+                 (strcmp (p->key[0], "restart") == 0) ? &doc->restart : NULL;
+    if ((p->depth == 1) && (flag == &doc->restart) && !doc->config_mode) {
+        add_error (doc, key, "only in config mode");
+        return true;
+    }
+    if ((p->depth == 1) && (flag != NULL)) {
+        if ((type == JSONPARSE_TRUE) || (type == JSONPARSE_FALSE)) {
+            *flag = (type == JSONPARSE_TRUE);
+        } else {
+            add_error (doc, key, "not true or false");
+        }
+        return true;
+    }
+    for (group = 0; (p->depth == 2) && (group < NUM_GROUPS); group++) {
+        if (strcmp (p->key[0], group_names[group]) == 0) {
+            field = wificonfig_find_field (group, p->key[1]);
+            break;
+        }
+    }
+    if (field == NULL) {
+        add_error (doc, key, "unknown setting");
+        return true;
+    }
+    if ((group == WIFICONFIG_GROUP_WIFI) && !doc->config_mode) {
+        add_error (doc, key, "only in config mode");
+        return true;
+    }
+
+    bool is_number = (field->type == WIFICONFIG_U8) || (field->type == WIFICONFIG_U16);
+    if (type != (is_number ? JSONPARSE_NUMBER : JSONPARSE_STRING)) {
+        add_error (doc, key, is_number ? "not a number" : "not a string");
+        return true;
+    }
+    if (is_number && (strpbrk (value, ".eE-") != NULL)) {
+        add_error (doc, key, "not a whole number");
+        return true;
+    }
+    void *vals[NUM_GROUPS] = { &doc->mqtt, doc->watchdog, &doc->wifi };
+    const char *err = wificonfig_set_field (field, vals[group], value);
+    if (err != NULL) {
+        add_error (doc, key, err);
+    } else {
+        doc->changed |= (1 << group);
+    }
+    return true;
+}
+
+esp_err_t wificonfig_json_begin (struct wificonfig_json *doc, char *result, size_t result_len, bool config_mode) {
+    struct wificonfig_watchdog *stage = wificonfig_watchdog_stage ();
+
+    if (stage == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memset (doc, 0, sizeof(*doc));
+    doc->config_mode = config_mode;
+    doc->wifi = *wificonfig_next_wifi ();
+    doc->mqtt = wificonfig_vals_mqtt;
+    doc->watchdog = stage;
+    doc->result = result;
+    doc->result_len = result_len;
+    doc->result_pos = snprintf (result, result_len, "{\"errors\":[");
+    jsonparse_init (&doc->parser, json_value, doc);
+    return ESP_OK;
+}
+
+void wificonfig_json_feed (struct wificonfig_json *doc, const char *data, size_t len) {
+    jsonparse_feed (&doc->parser, data, len);
+}
+
+esp_err_t wificonfig_json_end (struct wificonfig_json *doc) {
+    struct wificonfig_save_stats stats = { 0 };
+    const char *err_msg = NULL;
+    char msg[64];
+
+    if (!jsonparse_finish (&doc->parser)) {
+        snprintf (msg, sizeof(msg), "bad JSON at byte %u: %s", doc->parser.pos, doc->parser.error);
+        add_error (doc, "", msg);
+    }
+    bool watchdog_changed = (doc->errors == 0) && (doc->changed & (1 << WIFICONFIG_GROUP_WATCHDOG));
+    if (!watchdog_changed) {
+        wificonfig_watchdog_unstage ();
+    }
+    if (doc->errors == 0) {
+        wificonfig_commit (watchdog_changed ? doc->watchdog : NULL,
+                           (doc->changed & (1 << WIFICONFIG_GROUP_MQTT)) ? &doc->mqtt : NULL,
+                           (doc->changed & (1 << WIFICONFIG_GROUP_WIFI)) ? &doc->wifi : NULL);
+        if (doc->persist && (wificonfig_save (&stats, &err_msg) != ESP_OK)) {
+            add_error (doc, "persist", err_msg);
+        }
+    }
+    snprintf (doc->result + doc->result_pos, doc->result_len - doc->result_pos,
+              "],\"ok\":%s,\"error_count\":%d,\"persisted\":%u}",
+              (doc->errors == 0) ? "true" : "false", doc->errors, stats.keys);
+    ESP_LOGI(TAG, "config: %d errors, %u keys saved", doc->errors, stats.keys);
+    return (doc->errors == 0) ? ESP_OK : ESP_FAIL;
+}
+
+// Output is gathered into a small buffer and handed on whenever it fills,
+// so that an HTTP response goes out in a few chunks rather than one per
+// value.
+//
+struct writer {
+    wificonfig_write_cb_t cb;
+    void *ctx;
+    esp_err_t err;
+    int len;
+    char buf[128];
+};
+
+static void flush (struct writer *w) {
+    if ((w->len > 0) && (w->err == ESP_OK)) {
+        w->err = w->cb (w->ctx, w->buf, w->len);
+    }
+    w->len = 0;
+}
+
+static void put (struct writer *w, const char *data, size_t len) {
+    while ((len > 0) && (w->err == ESP_OK)) {
+        size_t n = sizeof(w->buf) - w->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy (w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+        if (w->len == sizeof(w->buf)) {
+            flush (w);
+        }
+    }
+}
+
+static void put_str (struct writer *w, const char *s) {
+    put (w, s, strlen (s));
+}
+
+static void put_string (struct writer *w, const char *s) {
+    char esc[8];
+
+    put_str (w, "\"");
+    for (; *s; s++) {
+        if ((*s == '"') || (*s == '\\')) {
+            put (w, esc, snprintf (esc, sizeof(esc), "\\%c", *s));
+        } else if ((unsigned char) *s < 0x20) {
+            put (w, esc, snprintf (esc, sizeof(esc), "\\u%04x", *s));
+        } else {
+            put (w, s, 1);
+        }
+    }
+    put_str (w, "\"");
+}
+
+// the current values, less any secrets; WiFi values are those to be used
+// from the next restart
+//
+esp_err_t wificonfig_json_write (wificonfig_write_cb_t cb, void *ctx) {
+    const void *vals[NUM_GROUPS] = { &wificonfig_vals_mqtt, wificonfig_watchdog_active, wificonfig_next_wifi () };
+    struct writer w = { .cb = cb, .ctx = ctx, .err = ESP_OK, .len = 0 };
+    char num[8];
+
+    put_str (&w, "{");
+    for (int group = 0; group < NUM_GROUPS; group++) {
+        int n = 0;
+        put_str (&w, (group > 0) ? ",\"" : "\"");
+        put_str (&w, group_names[group]);
+        put_str (&w, "\":{");
+        for (int i = 0; i < wificonfig_num_fields; i++) {
+            const struct wificonfig_field *field = &wificonfig_fields[i];
+            if ((field->group != group) || (field->type == WIFICONFIG_SECRET)) {
+                continue;
+            }
+            put_str (&w, (n++ > 0) ? ",\"" : "\"");
+            put_str (&w, field->name);
+            put_str (&w, "\":");
+            if ((field->type == WIFICONFIG_U8) || (field->type == WIFICONFIG_U16)) {
+                wificonfig_format_field (field, vals[group], num, sizeof(num));
+                put_str (&w, num);
+            } else {
+                put_string (&w, (const char *) vals[group] + field->offset);
+            }
+        }
+        put_str (&w, "}");
+    }
+    put_str (&w, "}");
+    flush (&w);
+    return w.err;
+}
+
+struct dump_buf {
+    char *buf;
+    size_t len;
+    size_t pos;
+};
+
+static esp_err_t dump_cb (void *ctx, const char *data, size_t len) {
+    struct dump_buf *d = ctx;
+
+    if (d->pos + len >= d->len) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy (d->buf + d->pos, data, len);
+    d->pos += len;
+    d->buf[d->pos] = '\0';
+    return ESP_OK;
+}
+
+int wificonfig_json_dump (char *buf, size_t len) {
+    struct dump_buf d = { .buf = buf, .len = len, .pos = 0 };
+
+    if (len > 0) {
+        buf[0] = '\0';
+    }
+    return (wificonfig_json_write (dump_cb, &d) == ESP_OK) ? d.pos : -1;
+}
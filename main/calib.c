@@ -0,0 +1,159 @@
+/*
+ * calib
+ *
+ * Each percentile is a stochastic approximation: nudge the estimate up
+ * by step * p when a sample is above it and down by step * (1 - p) when
+ * not, which settles where a fraction p of samples are below. The step
+ * scales with a running average of how far samples sit from the median,
+ * so the same code suits a noise floor of a few counts and a running
+ * current of a thousand. Everything is integer, in counts << 16 so that
+ * the small steps used once learned still move the 99th percentile down.
+ *
+ * Samples are idle while the relay is off and running while it is on and
+ * the amplitude is well clear of the idle noise; anything else, and the
+ * couple of seconds after the relay switches, is left out.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#include "calib.h"
+
+#define CALIB_NUM_Q     3
+#define CALIB_Q_LOW     0           // index of the 5th percentile
+#define CALIB_Q_MEDIAN  1
+#define CALIB_Q_HIGH    2           // 99th
+#define CALIB_LEARN     (CONFIG_WATCHDOG_CALIB_LEARN * CALIB_SAMPLE_HZ)
+#define CALIB_SETTLE    (2 * CALIB_SAMPLE_HZ)   // samples skipped after the relay switches
+#define CALIB_MIN_GAP   (8 << 16)   // idle and running must be this far apart
+#define CALIB_MAX       32767       // readings are clipped to this, to fit in << 16
+
+extern const char *TAG;
+
+static const int16_t levels[CALIB_NUM_Q] = { 50, 500, 990 };   // per mille
+
+struct dist {
+    int32_t q[CALIB_NUM_Q];
+    int32_t spread;         // average distance from the median
+    uint32_t n;
+};
+
+static struct dist idle[CALIB_NUM_CHANNELS];
+static struct dist run[CALIB_NUM_CHANNELS];
+static bool last_relay = false;
+static int settle = CALIB_SETTLE;
+
+static void dist_add (struct dist *d, int amplitude) {
+    int32_t v = amplitude << 16;
+
+    if (d->n == 0) {
+        for (int i = 0; i < CALIB_NUM_Q; i++) {
+            d->q[i] = v;
+        }
+        d->spread = (v >> 2) > (1 << 16) ? (v >> 2) : (1 << 16);
+    }
+    // large steps while learning, small ones after
+    int32_t step = (d->n < CALIB_LEARN) ? (d->spread >> 2) : (d->spread >> 6);
+    if (step < (1 << 12)) {
+        step = 1 << 12;
+    }
+    for (int i = 0; i < CALIB_NUM_Q; i++) {
+        if (v > d->q[i]) {
+            d->q[i] += (int64_t) step * levels[i] / 1000;
+        } else {
+            d->q[i] -= (int64_t) step * (1000 - levels[i]) / 1000;
+        }
+    }
+    d->spread += (abs (v - d->q[CALIB_Q_MEDIAN]) - d->spread) >> 5;
+    if (d->n < UINT32_MAX) {
+        d->n++;
+    }
+}
+
+static bool learned (const struct dist *d) {
+    return (d->n >= CALIB_LEARN);
+}
+
+// how far above the idle 99th percentile running has to be
+static int64_t min_gap (int channel) {
+    int64_t gap = (int64_t) idle[channel].spread * 4;
+    return (gap > CALIB_MIN_GAP) ? gap : CALIB_MIN_GAP;
+}
+
+void calib_sample (bool relay_on, const int *amplitude) {
+    if (relay_on != last_relay) {
+        last_relay = relay_on;
+        settle = CALIB_SETTLE;
+    }
+    if (settle > 0) {
+        settle--;
+        return;
+    }
+    for (int ch = 0; ch < CALIB_NUM_CHANNELS; ch++) {
+        int a = (amplitude[ch] < CALIB_MAX) ? amplitude[ch] : CALIB_MAX;
+        if (!relay_on) {
+            dist_add (&idle[ch], a);
+        } else if (learned (&idle[ch]) && ((a << 16) >= (int64_t) idle[ch].q[CALIB_Q_HIGH] + min_gap (ch))) {
+            dist_add (&run[ch], a);
+        }
+    }
+}
+
+bool calib_proposal (int channel, int *thresh, int *thresh_off) {
+    if (!learned (&idle[channel]) || !learned (&run[channel])) {
+        return false;
+    }
+    int64_t low = idle[channel].q[CALIB_Q_HIGH];
+    int64_t gap = run[channel].q[CALIB_Q_LOW] - low;
+    if (gap < min_gap (channel)) {
+        return false;
+    }
+    *thresh = (low + gap / 2 + (1 << 15)) >> 16;
+    *thresh_off = (low + gap / 4 + (1 << 15)) >> 16;
+    return true;
+}
+
+void calib_reset (void) {
+    memset (idle, 0, sizeof(idle));
+    memset (run, 0, sizeof(run));
+    settle = CALIB_SETTLE;
+    ESP_LOGI(TAG, "calib: reset");
+}
+
+static int put_dist (char *buf, int len, const char *name, const struct dist *d) {
+    return snprintf (buf, len, "\"%s\":[%d,%d,%d],\"%s_s\":%u",
+                     name, (d->q[0] + (1 << 15)) >> 16, (d->q[1] + (1 << 15)) >> 16, (d->q[2] + (1 << 15)) >> 16,
+                     name, d->n / CALIB_SAMPLE_HZ);
+}
+
+// {"learn_s":300,"channels":[{"idle":[p5,p50,p99],"idle_s":secs,"run":[...],
+// "run_s":secs,"thresh":n,"thresh_off":n},...]} with the thresholds 0 where
+// there is no proposal
+//
+int calib_json (char *buf, int len) {
+    int pos = snprintf (buf, len, "{\"learn_s\":%d,\"channels\":[", CONFIG_WATCHDOG_CALIB_LEARN);
+
+    for (int ch = 0; (ch < CALIB_NUM_CHANNELS) && (pos < len); ch++) {
+        int thresh = 0, thresh_off = 0;
+        calib_proposal (ch, &thresh, &thresh_off);
+        pos += snprintf (buf + pos, len - pos, "%s{", ch ? "," : "");
+        if (pos < len) {
+            pos += put_dist (buf + pos, len - pos, "idle", &idle[ch]);
+        }
+        if (pos < len) {
+            pos += snprintf (buf + pos, len - pos, ",");
+        }
+        if (pos < len) {
+            pos += put_dist (buf + pos, len - pos, "run", &run[ch]);
+        }
+        if (pos < len) {
+            pos += snprintf (buf + pos, len - pos, ",\"thresh\":%d,\"thresh_off\":%d}", thresh, thresh_off);
+        }
+    }
+    if (pos < len) {
+        pos += snprintf (buf + pos, len - pos, "]}");
+    }
+    return (pos < len) ? pos : -1;
+}
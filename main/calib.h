@@ -0,0 +1,36 @@
+/*
+ * calib
+ *
+ * Learns, for each sensor, what its filtered amplitude looks like with
+ * the compressor idle (relay off) and running, as the 5th, 50th and 99th
+ * percentiles of each, and from those proposes a running threshold and
+ * stop threshold. The percentiles are streaming estimates in a few words
+ * per sensor: they move quickly until CONFIG_WATCHDOG_CALIB_LEARN seconds
+ * of each have been seen, then slowly, so they follow drift as the CT or
+ * motor ages.
+ */
+#include <stdbool.h>
+
+#define CALIB_NUM_CHANNELS 4
+
+enum calib_mode_t {
+    CALIB_OFF = 0,
+    CALIB_PROPOSE,      // learn and publish estimates and proposals
+    CALIB_APPLY,        // and use the proposals for the selected sensor
+};
+
+// feed the filtered amplitudes, CALIB_SAMPLE_HZ times a second; relay_on
+// says whether the compressor could be drawing current
+#define CALIB_SAMPLE_HZ 10
+extern void calib_sample (bool relay_on, const int *amplitude);
+
+// thresholds for a channel, midway and a quarter of the way up from the
+// idle 99th percentile to the running 5th percentile; false until both
+// have been learned, or if they're too close to tell apart
+extern bool calib_proposal (int channel, int *thresh, int *thresh_off);
+
+// forget everything and learn again
+extern void calib_reset (void);
+
+// the estimates as JSON; the length, or -1 if it didn't fit
+extern int calib_json (char *buf, int len);
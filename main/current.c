@@ -0,0 +1,86 @@
+/*
+ * current
+ *
+ * The table is 8K of DRAM rather than flash so the ISR can read it with
+ * the flash cache disabled. The per-channel scale is a 16.16 fixed-point
+ * multiplier from peak-to-peak millivolts to RMS current: a sine of RMS
+ * current I through a CT of ratio N into burden R gives 2 * sqrt(2) * I *
+ * R / N volts peak to peak.
+ */
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "driver/adc.h"
+#include "esp_adc_cal.h"
+
+#include "current.h"
+
+#define CURRENT_DEFAULT_VREF 1100   // mV, for chips with no eFuse calibration
+#define CURRENT_UNITS_PER_A  100    // amplitudes are in 10 mA
+
+extern const char *TAG;
+
+static DRAM_ATTR uint16_t mv_table[4097];     // one spare, for interpolating at the top
+static volatile uint32_t scale[CURRENT_NUM_CHANNELS];     // 0 -> raw counts
+static esp_adc_cal_value_t cal_type = ESP_ADC_CAL_VAL_DEFAULT_VREF;
+
+void current_init (void) {
+    esp_adc_cal_characteristics_t chars;
+
+    cal_type = esp_adc_cal_characterize (ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12,
+                                         CURRENT_DEFAULT_VREF, &chars);
+    for (int raw = 0; raw < 4096; raw++) {
+        mv_table[raw] = esp_adc_cal_raw_to_voltage (raw, &chars);
+    }
+    mv_table[4096] = mv_table[4095];
+    ESP_LOGI(TAG, "current: ADC calibration %s, full scale %u mV", current_cal_name (), mv_table[4095]);
+}
+
+void current_configure (int channel, int ratio, int burden) {
+    if ((burden == 0) || (ratio == 0)) {
+        scale[channel] = 0;
+    } else {
+        // done once per configuration change, so floating point is fine here
+        scale[channel] = (uint32_t) (65536.0 * CURRENT_UNITS_PER_A * ratio / (1000.0 * burden * 2.0 * 1.41421356));
+    }
+    ESP_LOGI(TAG, "current: channel %d ratio %d burden %d -> %s", channel, ratio, burden,
+             scale[channel] ? "amps" : "raw counts");
+}
+
+#if CURRENT_FRAC_BITS > 0
+// millivolts * 2^CURRENT_FRAC_BITS, interpolated
+static inline int IRAM_ATTR to_mv (int reading) {
+    int count = reading >> CURRENT_FRAC_BITS;
+    int frac = reading & ((1 << CURRENT_FRAC_BITS) - 1);
+    return (mv_table[count] << CURRENT_FRAC_BITS) + (mv_table[count + 1] - mv_table[count]) * frac;
+}
+#else
+#define to_mv(reading) (mv_table[reading])
+#endif
+
+int IRAM_ATTR current_amplitude (int channel, int max, int min) {
+    uint32_t s = scale[channel];
+
+    if (s == 0) {
+        return (max - min + ((1 << CURRENT_FRAC_BITS) >> 1)) >> CURRENT_FRAC_BITS;
+    }
+    if (max < min) {
+        return 0;       // no readings yet this cycle
+    }
+    int mv = to_mv (max) - to_mv (min);
+    return (int) (((uint64_t) mv * s) >> (16 + CURRENT_FRAC_BITS));
+}
+
+bool current_in_amps (int channel) {
+    return (scale[channel] != 0);
+}
+
+const char *current_cal_name (void) {
+    switch (cal_type) {
+        case ESP_ADC_CAL_VAL_EFUSE_TP:
+            return "efuse_tp";
+        case ESP_ADC_CAL_VAL_EFUSE_VREF:
+            return "efuse_vref";
+        default:
+            return "default";
+    }
+}
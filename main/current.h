@@ -0,0 +1,45 @@
+/*
+ * current
+ *
+ * Turns a cycle's ADC readings into current. The ADC's raw counts are
+ * not linear in voltage at 11 dB attenuation and differ from chip to
+ * chip, so at start-up every possible reading is converted to millivolts
+ * once, using the calibration burnt into the chip's eFuses, into a
+ * table. A cycle's amplitude is then the difference of the table entries
+ * for its highest and lowest readings, scaled by the channel's CT ratio
+ * and burden resistor to RMS current in units of 10 mA: integer only, so
+ * it can be done in the sampling ISR.
+ *
+ * A channel with no burden configured reports its amplitude in raw ADC
+ * counts, as firmware before this did.
+ *
+ * With oversampling, each reading is the average of 2^CONFIG_WATCHDOG_
+ * OVERSAMPLE conversions, and keeps up to two of the bits below a count
+ * that averaging gains; the table is interpolated between counts.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CURRENT_NUM_CHANNELS 4
+
+#define CURRENT_OVERSAMPLE_SHIFT CONFIG_WATCHDOG_OVERSAMPLE
+#define CURRENT_OVERSAMPLE  (1 << CURRENT_OVERSAMPLE_SHIFT)
+#define CURRENT_FRAC_BITS   ((CURRENT_OVERSAMPLE_SHIFT < 2) ? CURRENT_OVERSAMPLE_SHIFT : 2)
+#define CURRENT_READING_MAX (4096 << CURRENT_FRAC_BITS)     // above any reading
+
+// characterise the ADC and build the table; after adc1 is configured
+extern void current_init (void);
+
+// ratio: CT turns ratio, e.g. 2000 for 100 A : 50 mA
+// burden: ohms across the CT output, 0 -> raw counts
+extern void current_configure (int channel, int ratio, int burden);
+
+// amplitude of a cycle whose readings (in 1/2^CURRENT_FRAC_BITS counts)
+// ran from min to max; ISR-safe
+extern int current_amplitude (int channel, int max, int min);
+
+// whether a channel's amplitudes are in units of 10 mA
+extern bool current_in_amps (int channel);
+
+// how the ADC was calibrated: "efuse_tp", "efuse_vref" or "default"
+extern const char *current_cal_name (void);
@@ -0,0 +1,122 @@
+/*
+ * cyclehist
+ *
+ * Each edge costs one count-leading-zeros and an increment. The first
+ * period after boot (or reset) is not counted, since we don't know when
+ * it started.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#include "cyclehist.h"
+
+#define HOUR_US (60 * 60 * 1000000LL)
+
+static portMUX_TYPE hist_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t run_hist[CYCLEHIST_DURATION_BUCKETS];
+static uint32_t off_hist[CYCLEHIST_DURATION_BUCKETS];
+static uint32_t starts_hist[CYCLEHIST_STARTS_BUCKETS];
+
+static int64_t last_edge = 0;       // 0 -> start of the current period unknown
+static int64_t reset_time = 0;
+static int64_t hour = 0;            // uptime hour being counted
+static uint32_t hour_starts = 0;
+static bool hour_whole = true;      // counting started at the top of the hour
+
+// floor(log2(v)) + 1, clamped to the top bucket; 0 for v == 0
+//
+static int log_bucket (uint32_t v, int buckets) {
+    int b = (v == 0) ? 0 : (32 - __builtin_clz (v));
+    return (b < buckets) ? b : (buckets - 1);
+}
+
+static void close_hours (int64_t now) {
+    int64_t now_hour = now / HOUR_US;
+    if (now_hour == hour) {
+        return;
+    }
+    // a partial hour would understate the rate, so only whole ones count
+    if (hour_whole) {
+        starts_hist[log_bucket (hour_starts, CYCLEHIST_STARTS_BUCKETS)]++;
+    }
+    // hours with no edges at all had no starts
+    if (now_hour > hour + 1) {
+        starts_hist[0] += now_hour - hour - 1;
+    }
+    hour = now_hour;
+    hour_starts = 0;
+    hour_whole = true;
+}
+
+void cyclehist_edge (bool running) {
+    int64_t now = esp_timer_get_time ();
+
+    portENTER_CRITICAL (&hist_lock);
+    close_hours (now);
+    if (last_edge != 0) {
+        uint32_t secs = (now - last_edge) / 1000000;
+        // running now means an off period just ended
+        uint32_t *h = running ? off_hist : run_hist;
+        h[log_bucket (secs, CYCLEHIST_DURATION_BUCKETS)]++;
+    }
+    if (running) {
+        hour_starts++;
+    }
+    last_edge = now;
+    portEXIT_CRITICAL (&hist_lock);
+}
+
+void cyclehist_poll (void) {
+    portENTER_CRITICAL (&hist_lock);
+    close_hours (esp_timer_get_time ());
+    portEXIT_CRITICAL (&hist_lock);
+}
+
+void cyclehist_reset (void) {
+    int64_t now = esp_timer_get_time ();
+
+    portENTER_CRITICAL (&hist_lock);
+    memset (run_hist, 0, sizeof(run_hist));
+    memset (off_hist, 0, sizeof(off_hist));
+    memset (starts_hist, 0, sizeof(starts_hist));
+    last_edge = 0;
+    reset_time = now;
+    hour = now / HOUR_US;
+    hour_starts = 0;
+    hour_whole = false;
+    portEXIT_CRITICAL (&hist_lock);
+}
+
+static int append_list (char *buf, size_t len, const char *name, const uint32_t *h, int n) {
+    int pos = snprintf (buf, len, ",\"%s\":[", name);
+    for (int i = 0; (i < n) && (pos < len); i++) {
+        pos += snprintf (buf + pos, len - pos, "%s%u", (i > 0) ? "," : "", h[i]);
+    }
+    if (pos < len) {
+        pos += snprintf (buf + pos, len - pos, "]");
+    }
+    return pos;
+}
+
+int cyclehist_json (char *buf, size_t len) {
+    uint32_t run[CYCLEHIST_DURATION_BUCKETS], off[CYCLEHIST_DURATION_BUCKETS];
+    uint32_t starts[CYCLEHIST_STARTS_BUCKETS];
+    int64_t since;
+
+    portENTER_CRITICAL (&hist_lock);
+    memcpy (run, run_hist, sizeof(run));
+    memcpy (off, off_hist, sizeof(off));
+    memcpy (starts, starts_hist, sizeof(starts));
+    since = reset_time;
+    portEXIT_CRITICAL (&hist_lock);
+
+    int pos = snprintf (buf, len, "{\"since_ms\":%lld", since / 1000);
+    if (pos < len) pos += append_list (buf + pos, len - pos, "run", run, CYCLEHIST_DURATION_BUCKETS);
+    if (pos < len) pos += append_list (buf + pos, len - pos, "off", off, CYCLEHIST_DURATION_BUCKETS);
+    if (pos < len) pos += append_list (buf + pos, len - pos, "starts_per_hour", starts, CYCLEHIST_STARTS_BUCKETS);
+    if (pos < len) pos += snprintf (buf + pos, len - pos, "}");
+    return pos;
+}
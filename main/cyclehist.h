@@ -0,0 +1,24 @@
+/*
+ * cyclehist
+ *
+ * Histograms of compressor cycling: how long each run and each off period
+ * lasted, and how many starts each hour of uptime saw. Buckets are powers
+ * of two, so a handful of counters covers under a second to hours.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CYCLEHIST_DURATION_BUCKETS  16  // <1 s, [1,2) s, [2,4) s, ... 2^14 s+
+#define CYCLEHIST_STARTS_BUCKETS    8   // 0, 1, 2-3, 4-7, ... 64+ starts/hour
+
+// record a running-state edge
+extern void cyclehist_edge (bool running);
+
+// close out finished hours; call at least once a minute
+extern void cyclehist_poll (void);
+
+extern void cyclehist_reset (void);
+
+// describe the histograms as a JSON object
+extern int cyclehist_json (char *buf, size_t len);
@@ -0,0 +1,131 @@
+/*
+ * deadline
+ *
+ * The wheel ticks once a second but is only advanced when the esp_timer
+ * fires or a deadline is set. Expired deadlines are taken off the wheel
+ * one at a time and their callbacks run without the lock, so a callback
+ * can set deadlines, and code that sets a deadline under its own lock
+ * can't deadlock against one expiring.
+ */
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "deadline.h"
+
+#define TICK_US 1000000LL
+
+extern const char *TAG;
+
+static struct timerwheel wheel;
+static SemaphoreHandle_t wheel_mutex = NULL;
+static esp_timer_handle_t wheel_timer = NULL;
+static uint32_t armed_tick = 0;
+static bool armed = false;
+
+static uint32_t now_tick (void) {
+    return esp_timer_get_time () / TICK_US;
+}
+
+// arm the esp_timer for the earliest deadline, unless it already is
+//
+static void arm (void) {
+    uint32_t next;
+
+    if (!timerwheel_next (&wheel, &next)) {
+        if (armed) {
+            esp_timer_stop (wheel_timer);
+            armed = false;
+        }
+        return;
+    }
+    if (armed && (next == armed_tick)) {
+        return;
+    }
+    if (armed) {
+        esp_timer_stop (wheel_timer);
+    }
+    int64_t delay = (int64_t) next * TICK_US - esp_timer_get_time ();
+    esp_timer_start_once (wheel_timer, (delay > 0) ? delay : 0);
+    armed_tick = next;
+    armed = true;
+}
+
+static void wheel_timer_cb (void *arg) {
+    struct timerwheel_timer *timer;
+
+    xSemaphoreTake (wheel_mutex, portMAX_DELAY);
+    armed = false;
+    timerwheel_advance (&wheel, now_tick ());
+    while ((timer = timerwheel_pop (&wheel)) != NULL) {
+        xSemaphoreGive (wheel_mutex);
+        timer->callback (timer);
+        xSemaphoreTake (wheel_mutex, portMAX_DELAY);
+    }
+    arm ();
+    xSemaphoreGive (wheel_mutex);
+}
+
+void deadline_init (void) {
+    const esp_timer_create_args_t timer_args = {
+        .callback = &wheel_timer_cb,
+        .name = "deadline",
+    };
+
+    timerwheel_init (&wheel, now_tick ());
+    wheel_mutex = xSemaphoreCreateMutex ();
+    ESP_ERROR_CHECK( esp_timer_create (&timer_args, &wheel_timer) );
+}
+
+static void set_tick (struct timerwheel_timer *deadline, deadline_cb_t callback, uint32_t tick) {
+    xSemaphoreTake (wheel_mutex, portMAX_DELAY);
+    timerwheel_advance (&wheel, now_tick ());
+    deadline->callback = callback;
+    timerwheel_add (&wheel, deadline, tick);
+    arm ();
+    xSemaphoreGive (wheel_mutex);
+}
+
+void deadline_after (struct timerwheel_timer *deadline, deadline_cb_t callback, uint32_t seconds) {
+    // whole seconds from now, so round the current tick up
+    set_tick (deadline, callback, (esp_timer_get_time () + (int64_t) seconds * TICK_US + TICK_US - 1) / TICK_US);
+}
+
+void deadline_at (struct timerwheel_timer *deadline, deadline_cb_t callback, int64_t time_us) {
+    set_tick (deadline, callback, (time_us + TICK_US - 1) / TICK_US);
+}
+
+void deadline_cancel (struct timerwheel_timer *deadline) {
+    xSemaphoreTake (wheel_mutex, portMAX_DELAY);
+    timerwheel_cancel (&wheel, deadline);
+    xSemaphoreGive (wheel_mutex);
+}
+
+bool deadline_pending (struct timerwheel_timer *deadline) {
+    bool pending;
+
+    xSemaphoreTake (wheel_mutex, portMAX_DELAY);
+    pending = timerwheel_running (deadline);
+    xSemaphoreGive (wheel_mutex);
+    return pending;
+}
+
+int64_t deadline_next (void) {
+    uint32_t next;
+    bool found;
+
+    xSemaphoreTake (wheel_mutex, portMAX_DELAY);
+    found = timerwheel_next (&wheel, &next);
+    xSemaphoreGive (wheel_mutex);
+    return found ? (int64_t) next * TICK_US : 0;
+}
+
+int deadline_count (void) {
+    int n;
+
+    xSemaphoreTake (wheel_mutex, portMAX_DELAY);
+    n = timerwheel_count (&wheel);
+    xSemaphoreGive (wheel_mutex);
+    return n;
+}
@@ -0,0 +1,33 @@
+/*
+ * deadline
+ *
+ * One timer wheel, in seconds of esp_timer time, for all of the
+ * watchdog's timeouts. A single one-shot esp_timer is kept armed for the
+ * earliest deadline, so nothing runs between deadlines. Callbacks run on
+ * the esp_timer task and should only hand the work on, e.g. by setting
+ * an event group bit.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "timerwheel.h"
+
+typedef void (*deadline_cb_t) (struct timerwheel_timer *deadline);
+
+extern void deadline_init (void);
+
+// (re)start the deadline seconds from now
+extern void deadline_after (struct timerwheel_timer *deadline, deadline_cb_t callback, uint32_t seconds);
+
+// (re)start the deadline at esp_timer time time_us, rounded up to the
+// second
+extern void deadline_at (struct timerwheel_timer *deadline, deadline_cb_t callback, int64_t time_us);
+
+extern void deadline_cancel (struct timerwheel_timer *deadline);
+
+extern bool deadline_pending (struct timerwheel_timer *deadline);
+
+// esp_timer time of the next deadline, or 0 if none is pending
+extern int64_t deadline_next (void);
+
+extern int deadline_count (void);
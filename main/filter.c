@@ -0,0 +1,127 @@
+/*
+ * filter
+ *
+ * Run by the sampling ISR once per AC cycle for all four channels, so
+ * everything is integer arithmetic on static state, with loop bounds
+ * known at compile time. The EMA keeps 8 fractional bits so that small
+ * amplitudes don't stick; the boxcar keeps a running sum rather than
+ * adding up its window on every read.
+ */
+#include "esp_attr.h"
+#include "hal/cpu_hal.h"
+
+#include "filter.h"
+
+#define MEDIAN_LEN  CONFIG_WATCHDOG_FILTER_MEDIAN
+#define EMA_SHIFT   CONFIG_WATCHDOG_FILTER_EMA
+#define BOXCAR_LEN  CONFIG_WATCHDOG_FILTER_BOXCAR
+
+#if (MEDIAN_LEN % 2) == 0
+#error "CONFIG_WATCHDOG_FILTER_MEDIAN must be odd"
+#endif
+
+#if MEDIAN_LEN > 1
+static int median_win[FILTER_NUM_CHANNELS][MEDIAN_LEN];
+static int median_pos = 0;
+#endif
+
+#if EMA_SHIFT > 0
+static int32_t ema[FILTER_NUM_CHANNELS];    // amplitude << 8
+#endif
+
+#if BOXCAR_LEN > 1
+static int boxcar_win[FILTER_NUM_CHANNELS][BOXCAR_LEN];
+static int32_t boxcar_sum[FILTER_NUM_CHANNELS];
+static int boxcar_pos = 0;
+#endif
+
+static volatile int output[FILTER_NUM_CHANNELS];
+static volatile uint32_t cost_last = 0;
+static volatile uint32_t cost_max = 0;
+
+#if MEDIAN_LEN > 1
+// insertion sort of a copy; MEDIAN_LEN is small and fixed, so this is a
+// fixed, short run of compares
+//
+static int IRAM_ATTR median (const int *win) {
+    int s[MEDIAN_LEN];
+
+    for (int i = 0; i < MEDIAN_LEN; i++) {
+        int v = win[i];
+        int j = i;
+        while ((j > 0) && (s[j - 1] > v)) {
+            s[j] = s[j - 1];
+            j--;
+        }
+        s[j] = v;
+    }
+    return s[MEDIAN_LEN / 2];
+}
+#endif
+
+void IRAM_ATTR filter_cycle (const int *amplitude) {
+    uint32_t start = cpu_hal_get_cycle_count ();
+
+    for (int ch = 0; ch < FILTER_NUM_CHANNELS; ch++) {
+        int v = amplitude[ch];
+
+#if MEDIAN_LEN > 1
+        median_win[ch][median_pos] = v;
+        v = median (median_win[ch]);
+#endif
+
+#if EMA_SHIFT > 0
+        ema[ch] += ((v << 8) - ema[ch]) >> EMA_SHIFT;
+        v = (ema[ch] + 128) >> 8;
+#endif
+
+#if BOXCAR_LEN > 1
+        boxcar_sum[ch] += v - boxcar_win[ch][boxcar_pos];
+        boxcar_win[ch][boxcar_pos] = v;
+        v = boxcar_sum[ch] / BOXCAR_LEN;
+#endif
+
+        output[ch] = v;
+    }
+
+#if MEDIAN_LEN > 1
+    if (++median_pos >= MEDIAN_LEN) {
+        median_pos = 0;
+    }
+#endif
+#if BOXCAR_LEN > 1
+    if (++boxcar_pos >= BOXCAR_LEN) {
+        boxcar_pos = 0;
+    }
+#endif
+
+    uint32_t cost = cpu_hal_get_cycle_count () - start;
+    cost_last = cost;
+    if (cost > cost_max) {
+        cost_max = cost;
+    }
+}
+
+int filter_output (int channel) {
+    return output[channel];
+}
+
+bool filter_running (bool running, int amplitude, int on_level, int off_level) {
+    if ((off_level == 0) || (off_level > on_level)) {
+        off_level = on_level;
+    }
+    return (amplitude >= (running ? off_level : on_level));
+}
+
+void filter_cost (uint32_t *last, uint32_t *max) {
+    *last = cost_last;
+    *max = cost_max;
+}
+
+int filter_delay (void) {
+    int cycles = (MEDIAN_LEN - 1) / 2 + BOXCAR_LEN / 2;
+#if EMA_SHIFT > 0
+    cycles += ((1 << EMA_SHIFT) * 7 + 5) / 10;  // half-life, about 0.7 * 2^shift
+#endif
+    return cycles;
+}
@@ -0,0 +1,36 @@
+/*
+ * filter
+ *
+ * The per-cycle amplitude of each sensor goes through a chain of filters
+ * before it is compared with the running threshold:
+ *
+ * - median of the last CONFIG_WATCHDOG_FILTER_MEDIAN cycles, which throws
+ *   out single-cycle spikes (WiFi transmissions couple into ADC1)
+ * - exponential moving average with weight 1/2^CONFIG_WATCHDOG_FILTER_EMA
+ * - boxcar average over CONFIG_WATCHDOG_FILTER_BOXCAR cycles
+ *
+ * The stage sizes are fixed at build time, so filter_cycle costs the same
+ * every cycle, and a stage of length 1 (or weight shift 0) compiles out.
+ * filter_running then applies separate start and stop thresholds.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FILTER_NUM_CHANNELS 4
+
+// feed one cycle's amplitude for every channel; ISR-safe
+extern void filter_cycle (const int *amplitude);
+
+// the newest filtered amplitude of a channel
+extern int filter_output (int channel);
+
+// hysteresis: running starts at on_level and carries on down to
+// off_level (off_level 0, or above on_level, -> on_level)
+extern bool filter_running (bool running, int amplitude, int on_level, int off_level);
+
+// CPU cycles filter_cycle took last time, and at most since boot
+extern void filter_cost (uint32_t *last, uint32_t *max);
+
+// cycles from a step change in the amplitude until the output has moved
+// half way, for reporting
+extern int filter_delay (void);
@@ -0,0 +1,126 @@
+/*
+ * flashlog
+ *
+ * Append-only circular log of fixed-size records in a data partition,
+ * shared by the event journal and the statistics store.
+ */
+#include <string.h>
+#include "esp_log.h"
+#include "esp_spi_flash.h"
+
+#include "flashlog.h"
+
+#define ERASED_SEQ 0xffffffff
+
+extern const char *TAG;
+
+esp_err_t flashlog_open (struct flashlog *log, const char *name, uint32_t entry_size) {
+    memset (log, 0, sizeof(*log));
+    log->partition = esp_partition_find_first (ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+    if (log->partition == NULL) {
+        ESP_LOGE(TAG, "flashlog: no %s partition", name);
+        return ESP_ERR_NOT_FOUND;
+    }
+    log->entry_size = entry_size;
+    log->per_sector = SPI_FLASH_SEC_SIZE / entry_size;
+    log->slots = (log->partition->size / SPI_FLASH_SEC_SIZE) * log->per_sector;
+    return ESP_OK;
+}
+
+// slots are packed per sector, so a record never straddles two sectors
+//
+static uint32_t slot_offset (struct flashlog *log, uint32_t slot) {
+    return (slot / log->per_sector) * SPI_FLASH_SEC_SIZE + (slot % log->per_sector) * log->entry_size;
+}
+
+bool flashlog_read (struct flashlog *log, uint32_t slot, void *entry) {
+    uint32_t seq;
+
+    if (esp_partition_read (log->partition, slot_offset (log, slot), entry, log->entry_size) != ESP_OK) {
+        return false;
+    }
+    memcpy (&seq, entry, sizeof(seq));
+    return ((seq != ERASED_SEQ) && (seq != 0));
+}
+
+// The newest record is in the sector whose first record has the highest
+// sequence number; within that sector, it is the last of the run of
+// consecutive sequence numbers.
+//
+bool flashlog_scan (struct flashlog *log, void *last) {
+    uint8_t e[log->entry_size];
+    uint32_t sectors = log->slots / log->per_sector;
+    uint32_t best_sector = 0, best_seq = 0, seq;
+    bool found = false;
+
+    for (uint32_t s = 0; s < sectors; s++) {
+        if (flashlog_read (log, s * log->per_sector, e)) {
+            memcpy (&seq, e, sizeof(seq));
+            if (!found || (seq > best_seq)) {
+                memcpy (last, e, log->entry_size);
+                best_sector = s;
+                best_seq = seq;
+                found = true;
+            }
+        }
+    }
+    if (!found) {
+        log->pos = 0;
+        return false;
+    }
+
+    uint32_t i;
+    for (i = 1; i < log->per_sector; i++) {
+        if (!flashlog_read (log, best_sector * log->per_sector + i, e)) {
+            break;
+        }
+        memcpy (&seq, e, sizeof(seq));
+        if (seq != best_seq + 1) {
+            break;
+        }
+        memcpy (last, e, log->entry_size);
+        best_seq = seq;
+    }
+    log->pos = (best_sector * log->per_sector + i) % log->slots;
+    return true;
+}
+
+uint32_t flashlog_append (struct flashlog *log, const void *entries, uint32_t n) {
+    const uint8_t *p = entries;
+    uint32_t written = 0;
+
+    while (written < n) {
+        // write a run that doesn't cross into the next sector
+        uint32_t run = n - written;
+        uint32_t room = log->per_sector - (log->pos % log->per_sector);
+        if (run > room) {
+            run = room;
+        }
+
+        if ((log->pos % log->per_sector) == 0) {
+            if (esp_partition_erase_range (log->partition, slot_offset (log, log->pos), SPI_FLASH_SEC_SIZE) != ESP_OK) {
+                ESP_LOGE(TAG, "flashlog: unable to erase %s", log->partition->label);
+                break;
+            }
+        }
+        if (esp_partition_write (log->partition, slot_offset (log, log->pos),
+                                 p + written * log->entry_size, run * log->entry_size) != ESP_OK) {
+            ESP_LOGE(TAG, "flashlog: unable to write %s", log->partition->label);
+            break;
+        }
+        log->pos = (log->pos + run) % log->slots;
+        written += run;
+    }
+    return written;
+}
+
+// Everything from the start of the sector after the one being written
+// round to the write position, in order. If the write position is at the
+// start of a sector, that sector hasn't been erased yet and is the oldest.
+//
+uint32_t flashlog_oldest (struct flashlog *log) {
+    if ((log->pos % log->per_sector) == 0) {
+        return log->pos;
+    }
+    return ((log->pos / log->per_sector + 1) * log->per_sector) % log->slots;
+}
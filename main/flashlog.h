@@ -0,0 +1,37 @@
+/*
+ * flashlog
+ *
+ * Append-only circular log of fixed-size records in a data partition.
+ * Records are written in order and a sector is erased only when the log
+ * wraps round to it, so wear is spread evenly over the partition. Every
+ * record must start with a uint32_t sequence number that increases by one
+ * per record and is never 0 or 0xffffffff.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+
+struct flashlog {
+    const esp_partition_t *partition;
+    uint32_t entry_size;
+    uint32_t per_sector;    // records per sector
+    uint32_t slots;         // records in the partition
+    uint32_t pos;           // next slot to write
+};
+
+// find the partition; ESP_ERR_NOT_FOUND if it doesn't exist
+extern esp_err_t flashlog_open (struct flashlog *log, const char *name, uint32_t entry_size);
+
+// find the newest record and set the write position after it;
+// false if the log is empty
+extern bool flashlog_scan (struct flashlog *log, void *last);
+
+// append n records; returns the number written (fewer on flash error)
+extern uint32_t flashlog_append (struct flashlog *log, const void *entries, uint32_t n);
+
+// read a slot; false if it is erased or unreadable
+extern bool flashlog_read (struct flashlog *log, uint32_t slot, void *entry);
+
+// slot of the oldest record that may still be in the log
+extern uint32_t flashlog_oldest (struct flashlog *log);
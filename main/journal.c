@@ -0,0 +1,260 @@
+/*
+ * journal
+ *
+ * Events are 16-byte records numbered by a sequence number that runs
+ * across boots. The newest JOURNAL_RTC_SIZE events live in a ring in RTC
+ * slow memory, which survives every reset except power loss. Events are
+ * flushed from there to the "journal" flash partition in batches: once
+ * JOURNAL_FLUSH_BATCH are waiting, once the oldest has waited
+ * JOURNAL_FLUSH_MS, or straight away for alarm events, which we need after
+ * a power loss.
+ *
+ * The flash copy is a flashlog (see flashlog.h).
+ *
+ * The newest alarm or alarm_clear event is also kept on its own, since
+ * a busy hour of relay and motor events pushes it out of the RTC ring
+ * long before its cooldown is over.
+ */
+#include <string.h>
+#include <stddef.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "flashlog.h"
+#include "journal.h"
+
+#define JOURNAL_RTC_SIZE     64
+#define JOURNAL_FLUSH_BATCH  16
+#define JOURNAL_FLUSH_MS     (10 * 60 * 1000)
+#define JOURNAL_MAGIC        0x4a524e4c  // "JRNL"
+
+extern const char *TAG;
+
+struct journal_rtc {
+    uint32_t magic;
+    uint32_t next_seq;
+    uint32_t flushed_seq;   // events up to here are in flash
+    uint16_t boot;
+    uint16_t reserved;
+    struct journal_entry entries[JOURNAL_RTC_SIZE];  // slot = seq % JOURNAL_RTC_SIZE
+    struct journal_entry last_alarm;    // newest alarm/alarm_clear, seq 0 if none
+    uint32_t check;
+};
+
+static RTC_NOINIT_ATTR struct journal_rtc rtc;
+
+static struct flashlog flog;
+static bool have_flash = false;
+static SemaphoreHandle_t journal_mutex = NULL;
+static uint32_t boot_seq = 0;           // seq of this boot's JOURNAL_BOOT event
+static int64_t oldest_unflushed = 0;
+
+static const char *type_names[JOURNAL_NUM_TYPES] = {
+    "boot", "relay", "running", "alarm", "alarm_clear", "wifi_up", "mqtt_up", "config",
+    "motor", "anomaly", "valve", "ota"
+};
+
+static uint32_t rtc_check (void) {
+    const uint8_t *p = (const uint8_t *) &rtc;
+    uint32_t sum = 5381;
+    for (int i = 0; i < offsetof(struct journal_rtc, check); i++) {
+        sum = (sum << 5) + sum + p[i];
+    }
+    return sum;
+}
+
+// rebuild the RTC ring from the tail of the flash log (after power loss)
+//
+static void rtc_from_flash (void) {
+    struct journal_entry last, e;
+
+    memset (&rtc, 0, sizeof(rtc));
+    rtc.magic = JOURNAL_MAGIC;
+    rtc.next_seq = 1;
+
+    if (!have_flash || !flashlog_scan (&flog, &last)) {
+        return;
+    }
+    rtc.next_seq = last.seq + 1;
+    rtc.flushed_seq = last.seq;
+    rtc.boot = last.boot;
+
+    uint32_t slot = flog.pos;
+    for (uint32_t i = 0; i < JOURNAL_RTC_SIZE; i++) {
+        slot = (slot + flog.slots - 1) % flog.slots;
+        if (!flashlog_read (&flog, slot, &e) || (e.seq != last.seq - i)) {
+            break;
+        }
+        rtc.entries[e.seq % JOURNAL_RTC_SIZE] = e;
+    }
+
+    // and the newest alarm event, however far back
+    slot = flog.pos;
+    for (uint32_t i = 0; i < flog.slots; i++) {
+        slot = (slot + flog.slots - 1) % flog.slots;
+        if (!flashlog_read (&flog, slot, &e) || (e.seq != last.seq - i)) {
+            break;
+        }
+        if ((e.type == JOURNAL_ALARM) || (e.type == JOURNAL_ALARM_CLEAR)) {
+            rtc.last_alarm = e;
+            break;
+        }
+    }
+}
+
+static void flush_locked (void) {
+    struct journal_entry buf[JOURNAL_FLUSH_BATCH];
+
+    if (!have_flash) {
+        rtc.flushed_seq = rtc.next_seq - 1;
+        rtc.check = rtc_check ();
+        return;
+    }
+
+    while (rtc.flushed_seq + 1 < rtc.next_seq) {
+        uint32_t n = rtc.next_seq - 1 - rtc.flushed_seq;
+        if (n > JOURNAL_FLUSH_BATCH) {
+            n = JOURNAL_FLUSH_BATCH;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            buf[i] = rtc.entries[(rtc.flushed_seq + 1 + i) % JOURNAL_RTC_SIZE];
+        }
+        uint32_t written = flashlog_append (&flog, buf, n);
+        rtc.flushed_seq += written;
+        rtc.check = rtc_check ();
+        if (written < n) {
+            return;
+        }
+    }
+}
+
+void journal_init (void) {
+    struct journal_entry last;
+
+    journal_mutex = xSemaphoreCreateMutex ();
+
+    have_flash = (flashlog_open (&flog, "journal", sizeof(struct journal_entry)) == ESP_OK);
+    if (!have_flash) {
+        ESP_LOGE(TAG, "journal: events will not survive power loss");
+    }
+
+    bool rtc_valid = ((rtc.magic == JOURNAL_MAGIC) && (rtc.check == rtc_check ()) &&
+                      (rtc.flushed_seq < rtc.next_seq) &&
+                      (rtc.next_seq - 1 - rtc.flushed_seq <= JOURNAL_RTC_SIZE));
+    if (rtc_valid && have_flash) {
+        // the RTC copy must be at least as new as flash
+        if (flashlog_scan (&flog, &last) && (last.seq >= rtc.next_seq)) {
+            rtc_valid = false;
+        }
+    }
+    if (rtc_valid) {
+        ESP_LOGI(TAG, "journal: recovered from RTC memory, next seq %u", rtc.next_seq);
+    } else {
+        rtc_from_flash ();
+        ESP_LOGI(TAG, "journal: recovered from flash, next seq %u", rtc.next_seq);
+    }
+    rtc.boot++;
+    rtc.check = rtc_check ();
+
+    boot_seq = rtc.next_seq;
+    journal_record (JOURNAL_BOOT, esp_reset_reason (), 0);
+
+    // whatever survived the reset in RTC memory goes to flash now
+    journal_flush ();
+}
+
+void journal_record (enum journal_type_t type, uint8_t arg, uint32_t data) {
+    int64_t now = esp_timer_get_time ();
+
+    if (journal_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake (journal_mutex, portMAX_DELAY);
+
+    struct journal_entry *e = &rtc.entries[rtc.next_seq % JOURNAL_RTC_SIZE];
+    e->seq = rtc.next_seq++;
+    e->time_ms = now / 1000;
+    e->boot = rtc.boot;
+    e->type = type;
+    e->arg = arg;
+    e->data = data;
+    if ((type == JOURNAL_ALARM) || (type == JOURNAL_ALARM_CLEAR)) {
+        rtc.last_alarm = *e;
+    }
+    if (rtc.next_seq - 1 - rtc.flushed_seq == 1) {
+        oldest_unflushed = now;
+    }
+    rtc.check = rtc_check ();
+
+    if ((rtc.next_seq - 1 - rtc.flushed_seq >= JOURNAL_FLUSH_BATCH) ||
+        (type == JOURNAL_ALARM) || (type == JOURNAL_ALARM_CLEAR) || (type == JOURNAL_CONFIG)) {
+        flush_locked ();
+    }
+
+    xSemaphoreGive (journal_mutex);
+}
+
+void journal_flush (void) {
+    xSemaphoreTake (journal_mutex, portMAX_DELAY);
+    flush_locked ();
+    xSemaphoreGive (journal_mutex);
+}
+
+void journal_poll (void) {
+    if ((rtc.flushed_seq + 1 < rtc.next_seq) &&
+        ((esp_timer_get_time () - oldest_unflushed) / 1000 >= JOURNAL_FLUSH_MS)) {
+        journal_flush ();
+    }
+}
+
+bool journal_active_alarm (uint8_t *alarm_type, uint32_t *elapsed_ms) {
+    bool found = false;
+
+    xSemaphoreTake (journal_mutex, portMAX_DELAY);
+    struct journal_entry *a = &rtc.last_alarm;
+    if ((a->seq != 0) && (a->seq < boot_seq) && (a->type == JOURNAL_ALARM)) {
+        // we only know the previous boot ran at least until its last
+        // event, so this is a lower bound on the time cooled down
+        struct journal_entry *end = &rtc.entries[(boot_seq - 1) % JOURNAL_RTC_SIZE];
+        *alarm_type = a->arg;
+        *elapsed_ms = a->data;
+        if ((end->seq == boot_seq - 1) && (end->boot == a->boot)) {
+            *elapsed_ms += end->time_ms - a->time_ms;
+        }
+        found = true;
+    }
+    xSemaphoreGive (journal_mutex);
+    return found;
+}
+
+int journal_tail (struct journal_entry *entries, int n) {
+    int count = 0;
+
+    xSemaphoreTake (journal_mutex, portMAX_DELAY);
+    if (n > JOURNAL_RTC_SIZE) {
+        n = JOURNAL_RTC_SIZE;
+    }
+    if (n > rtc.next_seq - 1) {
+        n = rtc.next_seq - 1;
+    }
+    for (uint32_t seq = rtc.next_seq - n; seq < rtc.next_seq; seq++) {
+        struct journal_entry *e = &rtc.entries[seq % JOURNAL_RTC_SIZE];
+        if (e->seq == seq) {
+            entries[count++] = *e;
+        }
+    }
+    xSemaphoreGive (journal_mutex);
+    return count;
+}
+
+const char *journal_type_name (uint8_t type) {
+    return (type < JOURNAL_NUM_TYPES) ? type_names[type] : "unknown";
+}
+
+uint16_t journal_boot (void) {
+    return rtc.boot;
+}
@@ -0,0 +1,59 @@
+/*
+ * journal
+ *
+ * Compact binary event journal that survives resets: events go into a ring
+ * in RTC slow memory and are flushed in batches to the "journal" flash
+ * partition.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+enum journal_type_t {
+    JOURNAL_BOOT = 0,         // arg: esp_reset_reason()
+    JOURNAL_RELAY = 1,        // arg: relay state, data: relay source
+    JOURNAL_RUNNING = 2,      // arg: running state
+    JOURNAL_ALARM = 3,        // arg: alarm type, data: ms already cooled down
+    JOURNAL_ALARM_CLEAR = 4,
+    JOURNAL_WIFI_UP = 5,
+    JOURNAL_MQTT_UP = 6,
+    JOURNAL_CONFIG = 7,       // arg: 0 entering wificonfig mode, 1 changed live over MQTT,
+                              // 2 thresholds set by auto-calibration (data: threshold)
+    JOURNAL_MOTOR = 8,        // arg: motor state (unloaded, or off straight from inrush),
+                              // data: ms in the previous state
+    JOURNAL_ANOMALY = 9,      // arg: 0 no start, 1 low current, data: 1 detected, 0 cleared
+    JOURNAL_VALVE = 10,       // arg: valve position, data: travel ms on arrival, else 0
+    JOURNAL_OTA = 11,         // arg: ota_event_t, data: esp_err_t if failed, else bytes written
+    JOURNAL_NUM_TYPES
+};
+
+struct journal_entry {
+    uint32_t seq;
+    uint32_t time_ms;   // ms since boot
+    uint16_t boot;      // boot count
+    uint8_t type;
+    uint8_t arg;
+    uint32_t data;
+};
+
+// recover the journal from RTC memory or flash and log this boot
+extern void journal_init (void);
+
+extern void journal_record (enum journal_type_t type, uint8_t arg, uint32_t data);
+
+// write unflushed events to flash now
+extern void journal_flush (void);
+
+// flush if events have been waiting longer than the flush interval
+extern void journal_poll (void);
+
+// alarm that was active when the previous boot ended, if any;
+// elapsed_ms is how much of its cooldown had (at least) passed
+extern bool journal_active_alarm (uint8_t *alarm_type, uint32_t *elapsed_ms);
+
+// copy the newest n events (oldest first); returns number copied
+extern int journal_tail (struct journal_entry *entries, int n);
+
+extern const char *journal_type_name (uint8_t type);
+
+// boot count of the current boot
+extern uint16_t journal_boot (void);
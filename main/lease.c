@@ -0,0 +1,188 @@
+/*
+ * lease
+ *
+ * A fixed table of CONFIG_WATCHDOG_LEASES entries. Looking up a requestor
+ * is a linear scan, which for a few dozen short ids costs less than the
+ * MQTT message that asked for it; expiry is the deadline service's job,
+ * so nothing scans the table periodically. An expiry only tells the
+ * caller's notify function that leases have ended.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "deadline.h"
+#include "lease.h"
+
+#define NUM_LEASES CONFIG_WATCHDOG_LEASES
+
+extern const char *TAG;
+
+struct lease {
+    struct timerwheel_timer timer;      // first: the callback gets this
+    char id[LEASE_ID_LEN];              // "" -> slot unused
+    bool live;
+    uint32_t start_s;                   // when the current lease was granted
+    uint32_t last_s;                    // last grant or end, for reuse
+    uint32_t grants;
+    uint32_t held_s;                    // total over ended leases
+};
+
+static struct lease leases[NUM_LEASES];
+static int live_count = 0;
+static void (*notify) (void) = NULL;
+
+// a mutex rather than a critical section: the deadline service blocks
+static SemaphoreHandle_t lease_mutex = NULL;
+
+static uint32_t now_s (void) {
+    return esp_timer_get_time () / 1000000;
+}
+
+static void end_lease (struct lease *l, uint32_t now) {
+    l->live = false;
+    l->held_s += now - l->start_s;
+    l->last_s = now;
+    live_count--;
+}
+
+static void lease_expired (struct timerwheel_timer *timer) {
+    struct lease *l = (struct lease *) timer;
+    bool ended = false;
+
+    xSemaphoreTake (lease_mutex, portMAX_DELAY);
+    // renewed or released since the deadline passed?
+    if (l->live && !deadline_pending (&l->timer)) {
+        ESP_LOGI(TAG, "lease: %s timed out", l->id);
+        end_lease (l, now_s ());
+        ended = true;
+    }
+    xSemaphoreGive (lease_mutex);
+    if (ended && (notify != NULL)) {
+        notify ();
+    }
+}
+
+void lease_init (void (*expired) (void)) {
+    notify = expired;
+    lease_mutex = xSemaphoreCreateMutex ();
+}
+
+// the requestor's slot, or failing that an unused one, or the ended one
+// used least recently
+//
+static struct lease *find_slot (const char *id) {
+    struct lease *free_slot = NULL;
+
+    for (int i = 0; i < NUM_LEASES; i++) {
+        struct lease *l = &leases[i];
+        if (strcmp (l->id, id) == 0) {
+            return l;
+        }
+        if (l->live || ((free_slot != NULL) && (free_slot->id[0] == 0))) {
+            continue;
+        }
+        if ((free_slot == NULL) || (l->id[0] == 0) || (l->last_s < free_slot->last_s)) {
+            free_slot = l;
+        }
+    }
+    if (free_slot != NULL) {
+        memset (free_slot, 0, sizeof(*free_slot));
+        strlcpy (free_slot->id, id, sizeof(free_slot->id));
+    }
+    return free_slot;
+}
+
+bool lease_grant (const char *id, uint32_t timeout_s) {
+    uint32_t now = now_s ();
+    struct lease *l;
+
+    xSemaphoreTake (lease_mutex, portMAX_DELAY);
+    l = find_slot (id);
+    if (l != NULL) {
+        if (!l->live) {
+            l->live = true;
+            l->start_s = now;
+            live_count++;
+        }
+        l->grants++;
+        l->last_s = now;
+        deadline_after (&l->timer, lease_expired, timeout_s);
+    }
+    xSemaphoreGive (lease_mutex);
+
+    if (l == NULL) {
+        ESP_LOGE(TAG, "lease: table full, request from %s refused", id);
+    }
+    return (l != NULL);
+}
+
+bool lease_release (const char *id) {
+    uint32_t now = now_s ();
+    bool found = false;
+
+    xSemaphoreTake (lease_mutex, portMAX_DELAY);
+    for (int i = 0; i < NUM_LEASES; i++) {
+        struct lease *l = &leases[i];
+        if (l->live && (strcmp (l->id, id) == 0)) {
+            deadline_cancel (&l->timer);
+            end_lease (l, now);
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive (lease_mutex);
+    return found;
+}
+
+void lease_release_all (void) {
+    uint32_t now = now_s ();
+
+    xSemaphoreTake (lease_mutex, portMAX_DELAY);
+    for (int i = 0; i < NUM_LEASES; i++) {
+        struct lease *l = &leases[i];
+        if (l->live) {
+            deadline_cancel (&l->timer);
+            end_lease (l, now);
+        }
+    }
+    xSemaphoreGive (lease_mutex);
+}
+
+int lease_live (void) {
+    return live_count;
+}
+
+// {"live":n,"leases":[{"id":"..","live":1,"left_s":n,"grants":n,"held_s":n},...]}
+// held_s includes the current lease so far
+//
+int lease_json (char *buf, size_t len) {
+    struct lease copy[NUM_LEASES];
+    uint32_t now = now_s ();
+    int live;
+    int pos;
+
+    xSemaphoreTake (lease_mutex, portMAX_DELAY);
+    memcpy (copy, leases, sizeof(copy));
+    live = live_count;
+    xSemaphoreGive (lease_mutex);
+
+    pos = snprintf (buf, len, "{\"live\":%d,\"leases\":[", live);
+    for (int i = 0, n = 0; (i < NUM_LEASES) && (pos < len); i++) {
+        struct lease *l = &copy[i];
+        if (l->id[0] == 0) {
+            continue;
+        }
+        pos += snprintf (buf + pos, len - pos, "%s{\"id\":\"%s\",\"live\":%d,\"left_s\":%d,\"grants\":%u,\"held_s\":%u}",
+                         (n++ > 0) ? "," : "", l->id, l->live,
+                         l->live ? (int) (l->timer.expires - now) : 0,
+                         l->grants, l->held_s + (l->live ? now - l->start_s : 0));
+    }
+    if (pos < len) {
+        pos += snprintf (buf + pos, len - pos, "]}");
+    }
+    return pos;
+}
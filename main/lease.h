@@ -0,0 +1,32 @@
+/*
+ * lease
+ *
+ * Compressor requests from MQTT, one lease per requestor: each requestor
+ * holds or releases its own lease, each lease expires on its own, and the
+ * relay is wanted while any lease is live. Leases expire through the
+ * deadline service. The table keeps a requestor's usage after its
+ * lease ends, until the slot is needed for a new requestor.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LEASE_ID_LEN 24     // including the terminating 0
+
+// expired is called, from the deadline service, when leases time out
+extern void lease_init (void (*expired) (void));
+
+// grant or renew id's lease for timeout_s seconds; false if the table is
+// full of live leases
+extern bool lease_grant (const char *id, uint32_t timeout_s);
+
+// end id's lease; false if it had none
+extern bool lease_release (const char *id);
+
+// end all leases (an alarm cancels every request)
+extern void lease_release_all (void);
+
+extern int lease_live (void);
+
+// JSON of the lease holders and per-requestor usage
+extern int lease_json (char *buf, size_t len);
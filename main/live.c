@@ -0,0 +1,169 @@
+/*
+ * live
+ *
+ * A periodic esp_timer asks the web server's task to send a frame, but
+ * only if the last request has been dealt with, so requests never queue
+ * up: the frame is read when it's sent, and a client that is slow to
+ * take frames just gets fewer, newer ones. A client whose send fails is
+ * dropped. Nothing here touches the sampling ISR or the watchdog loops
+ * beyond reading what they have already stored.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#include "live.h"
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+
+#define LIVE_MAX_CLIENTS 4
+#define LIVE_PERIOD_US   (1000000 / CONFIG_WATCHDOG_LIVE_RATE)
+
+extern const char *TAG;
+
+static void (*read_frame) (struct live_frame *frame) = NULL;
+
+// clients and the server handle are only used in the server's task
+static int client_fds[LIVE_MAX_CLIENTS];
+static int client_count = 0;
+static httpd_handle_t server = NULL;
+
+static esp_timer_handle_t live_timer = NULL;
+static volatile bool send_queued = false;   // a send_frame is waiting to run
+static uint32_t frames_skipped = 0;         // ticks coalesced into a later frame
+
+static void drop_client (int i) {
+    ESP_LOGI(TAG, "live: client %d gone", client_fds[i]);
+    client_fds[i] = client_fds[--client_count];
+    if (client_count == 0) {
+        esp_timer_stop (live_timer);
+    }
+}
+
+// runs in the server's task, via httpd_queue_work
+//
+static void send_frame (void *arg) {
+    struct live_frame f;
+    char buf[160];
+
+    send_queued = false;
+    read_frame (&f);
+    int len = snprintf (buf, sizeof(buf),
+                        "{\"t\":%u,\"a\":[%d,%d,%d,%d],\"u\":%u,\"s\":%u,\"th\":%u,\"r\":%d,\"p\":%d,\"al\":%d}",
+                        (uint32_t) (esp_timer_get_time () / 1000),
+                        f.amplitude[0], f.amplitude[1], f.amplitude[2], f.amplitude[3], f.amps,
+                        f.sensor, f.thresh, f.running, f.relay, f.alarm_type);
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_TEXT,
+        .payload = (uint8_t *) buf,
+        .len = len,
+    };
+    for (int i = client_count - 1; i >= 0; i--) {
+        if ((httpd_ws_get_fd_info (server, client_fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET) ||
+            (httpd_ws_send_frame_async (server, client_fds[i], &frame) != ESP_OK)) {
+            drop_client (i);
+        }
+    }
+}
+
+static void live_timer_cb (void *arg) {
+    if (send_queued) {
+        frames_skipped++;
+        return;
+    }
+    send_queued = true;
+    if (httpd_queue_work (server, send_frame, NULL) != ESP_OK) {
+        send_queued = false;
+    }
+}
+
+static esp_err_t live_handler (httpd_req_t *req) {
+    uint8_t payload[16];
+    httpd_ws_frame_t frame = { .payload = payload };
+
+    if (req->method == HTTP_GET) {
+        // the handshake: a new client
+        int fd = httpd_req_to_sockfd (req);
+        if (client_count >= LIVE_MAX_CLIENTS) {
+            ESP_LOGW(TAG, "live: too many clients, refusing %d", fd);
+            return ESP_FAIL;
+        }
+        server = req->handle;
+        client_fds[client_count++] = fd;
+        ESP_LOGI(TAG, "live: client %d, %d connected", fd, client_count);
+        if (client_count == 1) {
+            esp_timer_start_periodic (live_timer, LIVE_PERIOD_US);
+        }
+        return ESP_OK;
+    }
+
+    // clients have nothing to say; read and drop whatever they send
+    if (httpd_ws_recv_frame (req, &frame, sizeof(payload)) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (frame.type == HTTPD_WS_TYPE_CLOSE) {
+        int fd = httpd_req_to_sockfd (req);
+        for (int i = 0; i < client_count; i++) {
+            if (client_fds[i] == fd) {
+                drop_client (i);
+                break;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+const httpd_uri_t live_uri = {
+    .uri          = "/live",
+    .method       = HTTP_GET,
+    .handler      = live_handler,
+    .user_ctx     = NULL,
+    .is_websocket = true,
+};
+
+void live_init (void (*read) (struct live_frame *frame)) {
+    read_frame = read;
+    const esp_timer_create_args_t timer_args = {
+        .callback = &live_timer_cb,
+        .name = "live",
+    };
+    ESP_ERROR_CHECK( esp_timer_create (&timer_args, &live_timer) );
+}
+
+int live_clients (void) {
+    return client_count;
+}
+
+uint32_t live_skipped (void) {
+    return frames_skipped;
+}
+
+#else
+
+// without WebSocket support in the web server, /live answers 404
+static esp_err_t live_handler (httpd_req_t *req) {
+    return httpd_resp_send_404 (req);
+}
+
+const httpd_uri_t live_uri = {
+    .uri       = "/live",
+    .method    = HTTP_GET,
+    .handler   = live_handler,
+    .user_ctx  = NULL
+};
+
+void live_init (void (*read) (struct live_frame *frame)) {
+}
+
+int live_clients (void) {
+    return 0;
+}
+
+uint32_t live_skipped (void) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * live
+ *
+ * Live sensor readings over a WebSocket at /live, for watching the
+ * amplitudes against the threshold while calibrating. Readings are sent
+ * CONFIG_WATCHDOG_LIVE_RATE times a second to every connected client as
+ * {"t":ms,"a":[a0,a1,a2,a3],"u":amps,"s":sensor,"th":thresh,"r":running,
+ * "p":relay,"al":alarm_type}.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_http_server.h"
+
+#define LIVE_NUM_SENSORS 4
+
+struct live_frame {
+    int amplitude[LIVE_NUM_SENSORS];    // filtered, as compared with thresh
+    uint8_t sensor;
+    uint16_t thresh;
+    bool running;
+    bool relay;
+    int alarm_type;
+    uint8_t amps;       // bit per sensor whose amplitude is in 10 mA, else ADC counts
+};
+
+// read fills in a frame; it is called from the web server's task, once
+// per frame sent, however many clients there are
+extern void live_init (void (*read) (struct live_frame *frame));
+
+extern const httpd_uri_t live_uri;
+
+extern int live_clients (void);
+
+// timer ticks that found the previous frame still unsent, and so were
+// folded into it
+extern uint32_t live_skipped (void);
@@ -24,11 +24,14 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
 #include "mqtt_client.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 
 #include "driver/gpio.h"
 #include "driver/periph_ctrl.h"
@@ -44,8 +47,23 @@
 
 #include <soc/sens_reg.h>
 #include <soc/sens_struct.h>
+#include <soc/gpio_struct.h>
 
 #include "wificonfig.h"
+#include "wifimgr.h"
+#include "outbox.h"
+#include "journal.h"
+#include "stats.h"
+#include "cyclehist.h"
+#include "motor.h"
+#include "valve.h"
+#include "lease.h"
+#include "deadline.h"
+#include "ota.h"
+#include "live.h"
+#include "filter.h"
+#include "calib.h"
+#include "current.h"
 
 // Timer constants
 #define TIMER_DIVIDER 80   // timer clock divider --> 1 MHz count rate
@@ -58,8 +76,6 @@ static const adc_channel_t channel1 = ADC_CHANNEL_5;
 static const adc_channel_t channel2 = ADC_CHANNEL_6;
 static const adc_channel_t channel3 = ADC_CHANNEL_7;
 
-#define RING_SIZE 32 // number of cycles to average
-
 
 // Board-specific constants
 //
@@ -86,16 +102,33 @@ const int CONNECTED_BIT = BIT0;
 static int relay_state = 0;    // Is relay on?
 static int on_by_button = 0;
 static int on_by_mqtt = 0;
-int64_t button_on_time = 0;
-int64_t mqtt_on_time = 0;
 
 static int running_state = 0;  // Is device using current above threshold?
 
 static int alarm_state = 0;  // Has watchdog detected an alarm condition?
-static int alarm_type = 0;   // x1: maxtime, 1x: duty-cycle, 0: none
+static int alarm_type = 0;   // ALARM_TYPE_* bits, 0: none
+
+#define ALARM_TYPE_MAXTIME     0x1
+#define ALARM_TYPE_DUTYCYCLE   0x2
+#define ALARM_TYPE_OVERCURRENT 0x4
+#define ALARM_TYPE_NOSTART     0x8
+#define ALARM_TYPE_LOWCURRENT  0x10
+#define ALARM_TYPE_WELDED      0x20
+#define ALARM_TYPE_OPEN        0x40
+#define ALARM_TYPE_VALVE       0x80
+#define NUM_ALARM_TYPES        8
+
+// subtopic for each alarm type bit
+static char *alarm_subtopics[NUM_ALARM_TYPES] = {
+    "ALARM-MAXTIME", "ALARM-DUTYCYCLE", "ALARM-OVERCURRENT", "ALARM-NOSTART", "ALARM-LOWCURRENT",
+    "ALARM-WELDED", "ALARM-OPEN", "ALARM-VALVE"
+};
 
-#define ALARM_TYPE_MAXTIME   0x1
-#define ALARM_TYPE_DUTYCYCLE 0x2
+// bits of watch_anom_alm: which motor anomalies raise an alarm
+#define ANOMALY_ALARM_NOSTART    0x1
+#define ANOMALY_ALARM_LOWCURRENT 0x2
+
+#define LOWCURRENT_TIME 30  // seconds unloaded before it's an anomaly
 
 enum relay_source_t {
     RELAY_BUTTON = 0,
@@ -103,6 +136,33 @@ enum relay_source_t {
     RELAY_ALARM = 2,
 };
 
+// Boot phases, timestamped with esp_timer_get_time() as they complete and
+// published on stat/<topic>/BOOT once MQTT first connects
+//
+enum boot_phase_t {
+    BOOT_PINS = 0,
+    BOOT_TIMER,
+    BOOT_CONFIG,
+    BOOT_LOOPS,
+    BOOT_WIFI_START,
+    BOOT_WIFI_UP,
+    BOOT_MQTT_START,
+    BOOT_MQTT_UP,
+    BOOT_NUM_PHASES
+};
+
+static const char *boot_phase_names[BOOT_NUM_PHASES] = {
+    "pins", "timer", "config", "loops", "wifi_start", "wifi_up", "mqtt_start", "mqtt_up"
+};
+
+static int64_t boot_times[BOOT_NUM_PHASES];
+
+static void boot_mark (enum boot_phase_t phase) {
+    if (boot_times[phase] == 0) {
+        boot_times[phase] = esp_timer_get_time ();
+    }
+}
+
 static void initialize_pins (void) {
     gpio_config_t io_conf;
 
@@ -159,6 +219,7 @@ static void initialize_pins (void) {
     printf ("initial read channel1: %d\n", adc1_get_raw(channel1));
     printf ("initial read channel2: %d\n", adc1_get_raw(channel2));
     printf ("initial read channel3: %d\n", adc1_get_raw(channel3));
+    current_init ();
 
 
     gpio_set_level(GPIO_OUTPUT_RELAY_POWER, 0);
@@ -166,8 +227,12 @@ static void initialize_pins (void) {
     gpio_set_level(GPIO_OUTPUT_ACCESS_LED, 0);
     gpio_set_level(GPIO_OUTPUT_SENSE_LED, 0);
 
+#ifndef CONFIG_WATCHDOG_FAST_START
     // Flash all LEDs on for 500ms
     //
+    // (skipped in fast-start mode: strobe_leds exercises the LEDs anyway
+    // and the delay only holds up everything else)
+    //
     gpio_set_level(GPIO_OUTPUT_CONNECTED_LED, 1);
     gpio_set_level(GPIO_OUTPUT_ACCESS_LED, 1);
     gpio_set_level(GPIO_OUTPUT_SENSE_LED, 1);
@@ -175,6 +240,7 @@ static void initialize_pins (void) {
     gpio_set_level(GPIO_OUTPUT_CONNECTED_LED, 0);
     gpio_set_level(GPIO_OUTPUT_ACCESS_LED, 0);
     gpio_set_level(GPIO_OUTPUT_SENSE_LED, 0);
+#endif
 }
 
 // "safe" code to read adc from interrupt handler
@@ -192,23 +258,60 @@ static int IRAM_ATTR local_adc1_read(int channel) {
     return adc_value;
 }
 
-int amplitude_ring0[RING_SIZE];
-int amplitude_ring1[RING_SIZE];
-int amplitude_ring2[RING_SIZE];
-int amplitude_ring3[RING_SIZE];
-int ring_pos = 0;
+// one reading: with CONFIG_WATCHDOG_OVERSAMPLE, the sum of a burst of
+// conversions decimated to CURRENT_FRAC_BITS below a count
+//
+static int IRAM_ATTR read_channel(int channel) {
+#if CURRENT_OVERSAMPLE_SHIFT > 0
+    int sum = 0;
+    for (int i = 0; i < CURRENT_OVERSAMPLE; i++) {
+        sum += local_adc1_read(channel);
+    }
+    return sum >> (CURRENT_OVERSAMPLE_SHIFT - CURRENT_FRAC_BITS);
+#else
+    return local_adc1_read(channel);
+#endif
+}
+
 int sample_count = 0;
 
 int channel0_max = 0;
-int channel0_min = 4096;
+int channel0_min = CURRENT_READING_MAX;
 int channel1_max = 0;
-int channel1_min = 4096;
+int channel1_min = CURRENT_READING_MAX;
 int channel2_max = 0;
-int channel2_min = 4096;
+int channel2_min = CURRENT_READING_MAX;
 int channel3_max = 0;
-int channel3_min = 4096;
+int channel3_min = CURRENT_READING_MAX;
+
+static int sensor_channel = 0;
 
-static int *sensor_ring;
+// Overcurrent fast trip, evaluated by the ISR on every sample. The span
+// (max - min) of the selected channel so far this cycle reaches the trip
+// level within a cycle of the overcurrent starting, and the ISR drops the
+// relay itself rather than waiting for a task. For inrush_samples after
+// the current starts (the span first reaching the running threshold from
+// an idle cycle) the trip is held off.
+//
+static int *trip_max = &channel0_max;
+static int *trip_min = &channel0_min;
+static volatile int trip_channel = 0;
+static volatile int trip_level = 0;         // 0 -> fast trip disabled
+static volatile int trip_run_level = 0;     // running threshold
+static volatile int inrush_samples = 0;
+static int inrush_left = 0;
+static bool trip_idle = true;               // last full cycle was below the running threshold
+
+static volatile bool trip_pending = false;  // tripped, not yet handled by watchdog_main_loop
+static volatile int64_t trip_time = 0;      // when the relay was dropped
+static volatile int trip_detect_us = 0;     // cycle start to trip
+static volatile int trip_isr_us = 0;        // ISR entry to relay write
+static volatile int trip_span = 0;
+
+// time spent in the ISR, for DIAG
+static volatile int isr_us_last = 0;
+static volatile int isr_us_avg = 0;         // EMA, << 4
+static volatile int isr_us_max = 0;
 
 /*
  * Timer group0 ISR handler
@@ -225,10 +328,11 @@ static int *sensor_ring;
 
 void IRAM_ATTR timer_group0_isr(void *para)
 {
-    int val0 = local_adc1_read(channel0);
-    int val1 = local_adc1_read(channel1);
-    int val2 = local_adc1_read(channel2);
-    int val3 = local_adc1_read(channel3);
+    int64_t isr_time = esp_timer_get_time();
+    int val0 = read_channel(channel0);
+    int val1 = read_channel(channel1);
+    int val2 = read_channel(channel2);
+    int val3 = read_channel(channel3);
 
     //int val0 = 0;
     //int val1 = 0;
@@ -255,28 +359,53 @@ void IRAM_ATTR timer_group0_isr(void *para)
     if (val3 < channel3_min)
         channel3_min = val3;
 
+    // fast trip: gpio_set_level isn't safe here, so clear the relay
+    // output through the GPIO register directly
+    //
+    int span = current_amplitude (trip_channel, *trip_max, *trip_min);
+    if (inrush_left > 0) {
+        inrush_left--;
+    }
+    if (trip_idle && (span >= trip_run_level)) {
+        trip_idle = false;
+        inrush_left = inrush_samples;
+    } else if ((trip_level > 0) && !trip_pending && (inrush_left == 0) && (span >= trip_level)) {
+        GPIO.out_w1tc = (1 << GPIO_OUTPUT_RELAY_POWER);
+        trip_time = esp_timer_get_time();
+        trip_isr_us = trip_time - isr_time;
+        trip_detect_us = (sample_count + 1) * TIMER_INTERVAL;
+        trip_span = span;
+        trip_pending = true;
+    }
+
     sample_count++;
     if (sample_count >= SAMPLES_PER_CYCLE) {
         sample_count = 0;
-        amplitude_ring0[ring_pos] = channel0_max - channel0_min;
-        amplitude_ring1[ring_pos] = channel1_max - channel1_min;
-        amplitude_ring2[ring_pos] = channel2_max - channel2_min;
-        amplitude_ring3[ring_pos] = channel3_max - channel3_min;
+        int amplitude[FILTER_NUM_CHANNELS] = {
+            current_amplitude (0, channel0_max, channel0_min),
+            current_amplitude (1, channel1_max, channel1_min),
+            current_amplitude (2, channel2_max, channel2_min),
+            current_amplitude (3, channel3_max, channel3_min),
+        };
+        trip_idle = (amplitude[trip_channel] < trip_run_level);
+        motor_cycle (amplitude[trip_channel]);
+        filter_cycle (amplitude);
         channel0_max = 0;
         channel1_max = 0;
         channel2_max = 0;
         channel3_max = 0;
-        channel0_min = 4096;
-        channel1_min = 4096;
-        channel2_min = 4096;
-        channel3_min = 4096;
-
-        ring_pos++;
-        if (ring_pos >= RING_SIZE) {
-            ring_pos = 0;
-        }
+        channel0_min = CURRENT_READING_MAX;
+        channel1_min = CURRENT_READING_MAX;
+        channel2_min = CURRENT_READING_MAX;
+        channel3_min = CURRENT_READING_MAX;
     }
 
+    int isr_us = esp_timer_get_time() - isr_time;
+    isr_us_last = isr_us;
+    isr_us_avg += ((isr_us << 4) - isr_us_avg) >> 4;
+    if (isr_us > isr_us_max)
+        isr_us_max = isr_us;
+
     timer_group_intr_clr_in_isr(0, 0);
     
     /* After the alarm has been triggered
@@ -285,22 +414,8 @@ void IRAM_ATTR timer_group0_isr(void *para)
 
 }
 
-// initialize amplitude rings
-static void initialize_rings (void)
-{
-    int i;
-    for (i=0; i<RING_SIZE; i++) {
-        amplitude_ring0[i] = 0;
-        amplitude_ring1[i] = 0;
-        amplitude_ring2[i] = 0;
-        amplitude_ring3[i] = 0;
-    }
-}
-
 static void initialize_timer (void)
 {
-    initialize_rings();
-
     timer_config_t config;
     config.divider = TIMER_DIVIDER;
     config.counter_dir = TIMER_COUNT_UP;
@@ -326,19 +441,43 @@ static void initialize_timer (void)
     timer_start(0, 0);
 }
 
-static int get_average_amplitude (int* ring) {
-    int i;
-    int sum = 0;
-    for (i=0; i<RING_SIZE; i++)
-        sum += ring[i];
-    return (sum / RING_SIZE);
+// (re)configure the fast trip from the watchdog configuration
+//
+static void initialize_fast_trip (void) {
+    switch (wificonfig_watchdog_active->sensor) {
+        case 1:
+            trip_max = &channel1_max;
+            trip_min = &channel1_min;
+            trip_channel = 1;
+            break;
+        case 2:
+            trip_max = &channel2_max;
+            trip_min = &channel2_min;
+            trip_channel = 2;
+            break;
+        case 3:
+            trip_max = &channel3_max;
+            trip_min = &channel3_min;
+            trip_channel = 3;
+            break;
+        default:
+            trip_max = &channel0_max;
+            trip_min = &channel0_min;
+            trip_channel = 0;
+            break;
+    }
+    trip_run_level = wificonfig_watchdog_active->thresh;
+    inrush_samples = wificonfig_watchdog_active->inrush * 1000 / TIMER_INTERVAL;
+    trip_level = wificonfig_watchdog_active->trip;
+
+    motor_configure (wificonfig_watchdog_active->thresh, wificonfig_watchdog_active->unload,
+                     wificonfig_watchdog_active->inrush * 1000 / (TIMER_INTERVAL * SAMPLES_PER_CYCLE));
 }
 
 void read_sensors (int *array) {
-    array[0] = get_average_amplitude (amplitude_ring0);
-    array[1] = get_average_amplitude (amplitude_ring1);
-    array[2] = get_average_amplitude (amplitude_ring2);
-    array[3] = get_average_amplitude (amplitude_ring3);
+    for (int i = 0; i < FILTER_NUM_CHANNELS; i++) {
+        array[i] = filter_output (i);
+    }
 }
 
 static void strobe_leds (void *pvParameters) {
@@ -366,6 +505,7 @@ static void check_gpio0 (void *pvParameters) {
             if (new_level == 1) {
                 int64_t curr_time = esp_timer_get_time ();
                 if ((curr_time - pressed_time) > 3000000) {
+                    journal_record (JOURNAL_CONFIG, 0, 0);
                     trigger_wificonfig();
                 }
             } else {
@@ -377,79 +517,24 @@ static void check_gpio0 (void *pvParameters) {
     }
 }
 
-// list of access points to try
-//
-struct ap_entry {
-    char *ssid;
-    char *password;
-};
-struct ap_entry *ap_list = NULL;
-int ap_count = 0;
-int ap_idx = 0;
-
-// load AP credentials into list from wifi configuration structure
-static void load_aps (void) {
-    // first, find number of APs
-    if (strlen(wificonfig_vals_wifi.ap1_ssid) > 0) ap_count++;
-    if (strlen(wificonfig_vals_wifi.ap2_ssid) > 0) ap_count++;
-    if (strlen(wificonfig_vals_wifi.ap3_ssid) > 0) ap_count++;
-    if (strlen(wificonfig_vals_wifi.ap4_ssid) > 0) ap_count++;
-
-    if (ap_count > 0)
-        ap_list = malloc (sizeof(struct ap_entry) * ap_count);
-
-    ap_idx = 0;
-    if (strlen(wificonfig_vals_wifi.ap1_ssid) > 0) {
-       ap_list[ap_idx].ssid = wificonfig_vals_wifi.ap1_ssid;
-       ap_list[ap_idx++].password = wificonfig_vals_wifi.ap1_pswd;
-    }
-    if (strlen(wificonfig_vals_wifi.ap2_ssid) > 0) {
-       ap_list[ap_idx].ssid = wificonfig_vals_wifi.ap2_ssid;
-       ap_list[ap_idx++].password = wificonfig_vals_wifi.ap2_pswd;
-    }
-    if (strlen(wificonfig_vals_wifi.ap3_ssid) > 0) {
-       ap_list[ap_idx].ssid = wificonfig_vals_wifi.ap3_ssid;
-       ap_list[ap_idx++].password = wificonfig_vals_wifi.ap3_pswd;
-    }
-    if (strlen(wificonfig_vals_wifi.ap4_ssid) > 0) {
-       ap_list[ap_idx].ssid = wificonfig_vals_wifi.ap4_ssid;
-       ap_list[ap_idx++].password = wificonfig_vals_wifi.ap4_pswd;
-    }
-}
-
 static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
     ESP_LOGI(TAG, "event_handler: Event dispatched from event loop base=%s, event_id=%d", event_base, event_id);
 
+    // choosing and (re)connecting to an AP is handled by wifimgr
+
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         tcpip_adapter_set_hostname(TCPIP_ADAPTER_IF_STA, wificonfig_vals_wifi.hostname);
-        esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         ESP_LOGI(TAG, "Got disconnected");
-        /* This is a workaround as ESP32 WiFi libs don't currently
-           auto-reassociate. */
         xEventGroupClearBits(wifi_event_group, CONNECTED_BIT);
-
-        // connect to next AP on list
-        ap_idx++;
-        if (ap_idx >= ap_count) {
-            ap_idx = 0;
-        }
-        wifi_config_t wifi_config = {
-            .sta = {
-                .ssid = "",
-                .password = "",
-            },
-        };
-        strncpy((char *)wifi_config.sta.ssid, ap_list[ap_idx].ssid, 32);
-        strncpy((char *)wifi_config.sta.password, ap_list[ap_idx].password, 64);
-
-        ESP_LOGI(TAG, "Setting WiFi configuration SSID %s...", wifi_config.sta.ssid);
-        ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
-        ESP_ERROR_CHECK( esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
-        ESP_ERROR_CHECK( esp_wifi_connect() );
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        boot_mark (BOOT_WIFI_UP);
+        journal_record (JOURNAL_WIFI_UP, 0, 0);
         xEventGroupSetBits(wifi_event_group, CONNECTED_BIT);
+        if (strcmp (wificonfig_vals_mqtt.host, "") == 0) {
+            ota_health (OTA_HEALTH_NETWORK);
+        }
     }
 }
 
@@ -457,7 +542,6 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
 static void initialize_wifi (void) {
     //tcpip_adapter_init();
     esp_netif_init();
-    wifi_event_group = xEventGroupCreate();
 
     esp_netif_create_default_wifi_sta();
 
@@ -467,96 +551,490 @@ static void initialize_wifi (void) {
     ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
 
+    wifimgr_start();
+
     ESP_ERROR_CHECK( esp_wifi_set_ps(WIFI_PS_NONE) );
     ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_RAM) );
 
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = "",
-            .password = "",
-        },
-    };
-
-    ap_idx = 0;
-    strncpy((char *)wifi_config.sta.ssid, (char *)ap_list[ap_idx].ssid, 32);
-    strncpy((char *)wifi_config.sta.password, (char *)ap_list[ap_idx].password, 64);
-
-    ESP_LOGI(TAG, "Setting WiFi configuration SSID '%s'...", wifi_config.sta.ssid);
     ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK( esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
     ESP_ERROR_CHECK( esp_wifi_start() );
+    boot_mark (BOOT_WIFI_START);
 }
 
 
 static esp_mqtt_client_handle_t mqtt_client;
 static int mqtt_connected = false;
+static TaskHandle_t update_task = NULL;
 
-static void publish_status (char *subtopic, int val) {
+static int publish_string (char *subtopic, char *str) {
     if ((mqtt_client == NULL) || !mqtt_connected) {
-        return;
+        return -1;
     }
     char topic[128];
     sprintf (topic, "stat/%s/%s", wificonfig_vals_mqtt.topic, subtopic);
-    int msg_id = esp_mqtt_client_publish(mqtt_client, topic, val ? "ON" : "OFF", 0, 1, 0);
+    int msg_id = esp_mqtt_client_publish(mqtt_client, topic, str, 0, 1, 0);
     ESP_LOGI(TAG, "publish successful, msg_id=%d", msg_id);
+    return msg_id;
+}
+
+static void publish_status (char *subtopic, int val) {
+    publish_string (subtopic, val ? "ON" : "OFF");
+}
+
+// Publish a state transition. While MQTT is down the transition is kept
+// in the outbox instead, to be replayed on stat/<topic>/EVENTS once we
+// reconnect. subtopic must be a string literal.
+//
+static void publish_event (char *subtopic, int val) {
+    if (strcmp (wificonfig_vals_mqtt.host, "") == 0) {
+        return;
+    }
+    if ((mqtt_client == NULL) || !mqtt_connected) {
+        outbox_record (subtopic, val);
+        return;
+    }
+    publish_status (subtopic, val);
+}
+
+// Like publish_event, for a state published by name; the outbox keeps
+// the number.
+//
+static void publish_event_name (char *subtopic, int val, const char *name) {
+    if (strcmp (wificonfig_vals_mqtt.host, "") == 0) {
+        return;
+    }
+    if ((mqtt_client == NULL) || !mqtt_connected) {
+        outbox_record (subtopic, val);
+        return;
+    }
+    publish_string (subtopic, (char *) name);
+}
+
+// Replay transitions recorded while disconnected, oldest first, in
+// batches: {"now":ms,"overflows":n,"events":[[seq,ms,subtopic,val],...]}
+// Each event carries its own sequence number and esp_timer time so
+// ordering is visible to the receiver.
+//
+#define OUTBOX_BATCH 8
+
+static void replay_outbox (void) {
+    struct outbox_event events[OUTBOX_BATCH];
+    char buf[512];
+    int n;
+
+    while ((n = outbox_peek (events, OUTBOX_BATCH)) > 0) {
+        int len = sprintf (buf, "{\"now\":%u,\"overflows\":%u,\"events\":[",
+                           (uint32_t) (esp_timer_get_time () / 1000), outbox_overflows ());
+        for (int i = 0; i < n; i++) {
+            len += sprintf (buf + len, "%s[%u,%u,\"%s\",%d]", (i > 0) ? "," : "",
+                            events[i].seq, events[i].time_ms, events[i].subtopic, events[i].val);
+        }
+        sprintf (buf + len, "]}");
+        if (publish_string ("EVENTS", buf) < 0) {
+            break;  // try again on next connect
+        }
+        outbox_drop_through (events[n-1].seq);
+    }
+}
+
+// publish diagnostic counters as a small JSON object
+//
+static void publish_diag (void) {
+    char buf[512];
+    nvs_stats_t nvs_stats;
+    uint32_t filter_last, filter_max;
+
+    if (wificonfig_get_nvs_stats (&nvs_stats) != ESP_OK) {
+        memset (&nvs_stats, 0, sizeof(nvs_stats));
+    }
+    filter_cost (&filter_last, &filter_max);
+    // ms until the next deadline, -1 if none
+    int64_t next = deadline_next ();
+    if (next != 0) {
+        next = (next > esp_timer_get_time ()) ? (next - esp_timer_get_time ()) / 1000 : 0;
+    } else {
+        next = -1;
+    }
+    sprintf (buf, "{\"nvs_used\":%u,\"nvs_free\":%u,\"nvs_total\":%u,"
+                  "\"save_keys\":%u,\"save_entries\":%u,\"save_bytes\":%u,"
+                  "\"deadlines\":%d,\"next_deadline_ms\":%lld,"
+                  "\"live_clients\":%d,\"live_skipped\":%u,"
+                  "\"filter_cycles\":%u,\"filter_max_cycles\":%u,\"filter_delay\":%d,"
+                  "\"adc_cal\":\"%s\",\"oversample\":%d,\"adc_hz\":%d,\"reading_bits\":%d,"
+                  "\"isr_us\":%d,\"isr_avg_us\":%d,\"isr_max_us\":%d,\"isr_load_pct\":%d}",
+             nvs_stats.used_entries, nvs_stats.free_entries, nvs_stats.total_entries,
+             wificonfig_last_save.keys, wificonfig_last_save.entries, wificonfig_last_save.bytes,
+             deadline_count (), next, live_clients (), live_skipped (),
+             filter_last, filter_max, filter_delay (), current_cal_name (),
+             CURRENT_OVERSAMPLE, CURRENT_OVERSAMPLE * 1000000 / TIMER_INTERVAL, 12 + CURRENT_FRAC_BITS,
+             isr_us_last, (isr_us_avg + 8) >> 4, isr_us_max, ((isr_us_avg >> 4) * 100) / TIMER_INTERVAL);
+    publish_string ("DIAG", buf);
+}
+
+// publish WiFi connection statistics
+//
+static void publish_wifi (void) {
+    char buf[512];
+    if (wifimgr_stats_json (buf, sizeof(buf)) < 0) {
+        ESP_LOGE(TAG, "wifi stats too long to publish");
+        return;
+    }
+    publish_string ("WIFI", buf);
+}
+
+// publish boot phase timestamps (ms since reset) as a JSON object
+//
+static void publish_boot (void) {
+    char buf[320];
+    int len;
+
+#ifdef CONFIG_WATCHDOG_FAST_START
+    len = sprintf (buf, "{\"fast_start\":1");
+#else
+    len = sprintf (buf, "{\"fast_start\":0");
+#endif
+    for (int i = 0; i < BOOT_NUM_PHASES; i++) {
+        len += sprintf (buf + len, ",\"%s\":%lld", boot_phase_names[i], boot_times[i] / 1000);
+    }
+    sprintf (buf + len, ",\"version\":\"%s\"}", esp_ota_get_app_description ()->version);
+    publish_string ("BOOT", buf);
+}
+
+// publish details and latency of the last overcurrent fast trip
+//
+static void publish_trip (int notify_ms) {
+    static int trips = 0;
+    static int worst_detect_us = 0;
+    static int worst_notify_ms = 0;
+    char buf[256];
+
+    trips++;
+    if (trip_detect_us > worst_detect_us) worst_detect_us = trip_detect_us;
+    if (notify_ms > worst_notify_ms) worst_notify_ms = notify_ms;
+    sprintf (buf, "{\"trips\":%d,\"span\":%d,\"level\":%d,\"detect_us\":%d,\"relay_us\":%d,"
+                  "\"notify_ms\":%d,\"worst_detect_us\":%d,\"worst_notify_ms\":%d}",
+             trips, trip_span, trip_level, trip_detect_us, trip_isr_us,
+             notify_ms, worst_detect_us, worst_notify_ms);
+    publish_string ("TRIP", buf);
+}
+
+// publish the run/off/starts-per-hour histograms
+//
+static void publish_hist (void) {
+    char buf[512];
+    cyclehist_json (buf, sizeof(buf));
+    publish_string ("HIST", buf);
+}
+
+// format the newest n journal events as a JSON array of
+// [seq,boot,ms,"type",arg,data]; caller frees the result
+//
+#define JOURNAL_JSON_ENTRY 64
+static char *journal_json (int n) {
+    struct journal_entry *entries = malloc (n * sizeof(struct journal_entry));
+    char *buf = malloc (n * JOURNAL_JSON_ENTRY + 3);
+    if ((entries == NULL) || (buf == NULL)) {
+        free (entries);
+        free (buf);
+        return NULL;
+    }
+
+    n = journal_tail (entries, n);
+    int len = sprintf (buf, "[");
+    for (int i = 0; i < n; i++) {
+        len += sprintf (buf + len, "%s[%u,%u,%u,\"%s\",%u,%u]", (i > 0) ? "," : "",
+                        entries[i].seq, entries[i].boot, entries[i].time_ms,
+                        journal_type_name (entries[i].type), entries[i].arg, entries[i].data);
+    }
+    sprintf (buf + len, "]");
+    free (entries);
+    return buf;
+}
+
+// parse an event count, defaulting to 16 and capped at 64
+//
+static int journal_count (const char *str, int len) {
+    int n = 0;
+    for (int i = 0; (i < len) && (str[i] >= '0') && (str[i] <= '9'); i++) {
+        n = n * 10 + (str[i] - '0');
+        if (n > 64) {
+            return 64;
+        }
+    }
+    return (n > 0) ? n : 16;
+}
+
+// publish the MQTT lease holders and per-requestor usage
+//
+#define LEASES_JSON_LEN (64 + 96 * CONFIG_WATCHDOG_LEASES)
+
+// auto-calibration estimates; about 110 bytes a channel
+//
+#define CALIB_JSON_LEN (32 + 128 * CALIB_NUM_CHANNELS)
+
+static void publish_calib (void) {
+    char *buf = malloc (CALIB_JSON_LEN);
+    if (buf != NULL) {
+        if (calib_json (buf, CALIB_JSON_LEN) >= 0) {
+            publish_string ("CALIB", buf);
+        }
+        free (buf);
+    }
+}
+
+static void publish_leases (void) {
+    char *buf = malloc (LEASES_JSON_LEN);
+    if (buf != NULL) {
+        lease_json (buf, LEASES_JSON_LEN);
+        publish_string ("LEASES", buf);
+        free (buf);
+    }
+}
+
+static void publish_journal (int n) {
+    char *buf = journal_json (n);
+    if (buf != NULL) {
+        publish_string ("JOURNAL", buf);
+        free (buf);
+    }
+}
+
+// GET /journal?n=N returns the same JSON as the MQTT JOURNAL command
+//
+static esp_err_t journal_get_handler (httpd_req_t *req) {
+    char query[16], val[8];
+    int n = 16;
+
+    if ((httpd_req_get_url_query_str (req, query, sizeof(query)) == ESP_OK) &&
+        (httpd_query_key_value (query, "n", val, sizeof(val)) == ESP_OK)) {
+        n = journal_count (val, strlen (val));
+    }
+    char *buf = journal_json (n);
+    if (buf == NULL) {
+        httpd_resp_send_500 (req);
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type (req, "application/json");
+    httpd_resp_send (req, buf, HTTPD_RESP_USE_STRLEN);
+    free (buf);
+    return ESP_OK;
+}
+
+static const httpd_uri_t journal_uri = {
+    .uri       = "/journal",
+    .method    = HTTP_GET,
+    .handler   = journal_get_handler,
+    .user_ctx  = NULL
+};
+
+// GET /stats[?format=bin] streams the hourly statistics (CSV by default)
+//
+static esp_err_t stats_get_handler (httpd_req_t *req) {
+    char query[32], val[8];
+    bool binary = false;
+
+    if ((httpd_req_get_url_query_str (req, query, sizeof(query)) == ESP_OK) &&
+        (httpd_query_key_value (query, "format", val, sizeof(val)) == ESP_OK)) {
+        binary = (strcmp (val, "bin") == 0);
+    }
+    return stats_send (req, binary);
+}
+
+static const httpd_uri_t stats_uri = {
+    .uri       = "/stats",
+    .method    = HTTP_GET,
+    .handler   = stats_get_handler,
+    .user_ctx  = NULL
+};
+
+// Relay integrity: each relay transition (and the motor starting while
+// the relay is off) starts a deadline. Once the grace period is up the
+// main loop checks that the measured current agrees with the relay:
+// - relay off but the motor running: welded contact
+// - relay on with no current, although the motor was running when the
+//   relay last went off (so the pressure switch is still calling for
+//   air): open contact or tripped breaker
+//
+#define RELAY_GRACE_S 3
+
+static bool relay_expect_start = false;
+
+// Watchdog timeouts run on the deadline service; when one expires it
+// sets its bit, which wakes the main loop to deal with it
+//
+#define DEADLINE_COOLDOWN 0x1
+#define DEADLINE_BUTTON   0x2
+#define DEADLINE_MAXTIME  0x4
+#define DEADLINE_LEASE    0x8
+#define DEADLINE_RELAY    0x10
+#define DEADLINE_RELAY_CHECK 0x20
+#define DEADLINE_VALVE    0x40      // not a deadline: the valve is stuck or faulty
+#define DEADLINE_POWER    0x80      // nor this: the MQTT leases changed
+#define DEADLINE_DUTYCYCLE 0x100    // nor this: the duty cycle was exceeded
+#define DEADLINE_ALL      0x1ff
+
+static EventGroupHandle_t deadline_events;
+static struct timerwheel_timer cooldown_deadline;
+static struct timerwheel_timer button_deadline;
+static struct timerwheel_timer maxtime_deadline;
+static struct timerwheel_timer relay_deadline;
+static struct timerwheel_timer relay_check_deadline;
+
+static void deadline_expired (struct timerwheel_timer *deadline) {
+    EventBits_t bit = (deadline == &cooldown_deadline) ? DEADLINE_COOLDOWN :
+                      (deadline == &button_deadline)   ? DEADLINE_BUTTON :
+                      (deadline == &maxtime_deadline)  ? DEADLINE_MAXTIME :
+                      (deadline == &relay_check_deadline) ? DEADLINE_RELAY_CHECK : DEADLINE_RELAY;
+    xEventGroupSetBits (deadline_events, bit);
+}
+
+static void relay_check_arm (void) {
+    deadline_after (&relay_check_deadline, deadline_expired, RELAY_GRACE_S);
+}
+
+static void lease_expired (void) {
+    xEventGroupSetBits (deadline_events, DEADLINE_LEASE);
+}
+
+// Anti-short-cycle: a relay transition asked for by a button or MQTT
+// waits until the relay has been in its current state for the minimum
+// on/off time, and an MQTT request also waits out the coalescing window,
+// so ON/OFF churn from automation that settles back within the window
+// never reaches the relay. A button press doesn't wait for MQTT
+// coalescing. Alarms switch off immediately. Only watchdog_main_loop
+// changes the relay, so none of this needs a lock.
+//
+static bool relay_pending = false;
+static int64_t relay_pending_due = 0;
+static enum relay_source_t relay_pending_src = RELAY_MQTT;
+static const char *relay_pending_reason = "";
+static int64_t relay_change_time = 0;   // boot counts as a change: power was just cut
+static uint32_t relay_deferred = 0;     // transitions deferred
+static uint32_t relay_coalesced = 0;    // deferred transitions cancelled by a later request
+
+static void publish_deferred (void) {
+    char buf[160];
+    int wait_ms = 0;
+
+    if (relay_pending) {
+        wait_ms = (relay_pending_due - esp_timer_get_time ()) / 1000;
+    }
+    sprintf (buf, "{\"pending\":\"%s\",\"reason\":\"%s\",\"wait_ms\":%d,\"deferred\":%u,\"coalesced\":%u}",
+             relay_pending ? (relay_state ? "OFF" : "ON") : "NONE", relay_pending ? relay_pending_reason : "",
+             (wait_ms > 0) ? wait_ms : 0, relay_deferred, relay_coalesced);
+    publish_string ("DEFERRED", buf);
+}
+
+// bring the relay in line with the requests, or defer the transition
+//
+static void update_relay (enum relay_source_t src) {
+    int want = !alarm_state && (on_by_button || on_by_mqtt);
+    int64_t now = esp_timer_get_time ();
+
+    if (want == relay_state) {
+        if (relay_pending) {
+            ESP_LOGI(TAG, "Deferred relay change cancelled");
+            relay_pending = false;
+            deadline_cancel (&relay_deadline);
+            relay_coalesced++;
+            publish_deferred ();
+        }
+        return;
+    }
+
+    if (relay_pending && !alarm_state && (src != RELAY_BUTTON)) {
+        if (now < relay_pending_due) {
+            return;
+        }
+        src = relay_pending_src;
+        relay_pending = false;
+        publish_deferred ();
+    } else if (!alarm_state) {
+        bool was_pending = relay_pending;
+        int64_t due = now;
+        if (relay_pending) {
+            relay_pending = false;
+            deadline_cancel (&relay_deadline);
+        }
+        int64_t min_us = (int64_t) (relay_state ? wificonfig_watchdog_active->min_on : wificonfig_watchdog_active->min_off) * 1000000;
+        if (src == RELAY_MQTT) {
+            due = now + (int64_t) wificonfig_watchdog_active->coalesce * 1000000;
+            relay_pending_reason = "coalesce";
+        }
+        if (relay_change_time + min_us > due) {
+            due = relay_change_time + min_us;
+            relay_pending_reason = relay_state ? "min_on" : "min_off";
+        }
+        if (due > now) {
+            ESP_LOGI(TAG, "Relay change deferred %lld ms (%s)", (due - now) / 1000, relay_pending_reason);
+            relay_pending = true;
+            relay_pending_due = due;
+            relay_pending_src = src;
+            if (!was_pending) {
+                relay_deferred++;
+            }
+            deadline_at (&relay_deadline, deadline_expired, due);
+            publish_deferred ();
+            return;
+        }
+        if (was_pending) {
+            publish_deferred ();
+        }
+    } else if (relay_pending) {
+        relay_pending = false;
+        deadline_cancel (&relay_deadline);
+    }
+
+    // the ISR has tripped the relay; stay off until the alarm is raised
+    if (trip_pending && want) {
+        return;
+    }
+    ESP_LOGI(TAG, "%sTurning relay %s", alarm_state ? "ALARM: " : "", want ? "on" : "off");
+    gpio_set_level(GPIO_OUTPUT_RELAY_POWER, want);
+    relay_state = want;
+    relay_change_time = now;
+
+    if (!relay_state) {
+        relay_expect_start = (motor_state () != MOTOR_OFF);
+    }
+    relay_check_arm ();
+    valve_expect (relay_state);
+    journal_record (JOURNAL_RELAY, relay_state, src);
+    publish_event ("POWER", relay_state);
 }
 
 static void switch_relay (int val, enum relay_source_t src) {
-    bool send_msg = false;
+    // the ISR has tripped the relay; stay off until the alarm is raised
+    if (trip_pending && (val != 0)) {
+        return;
+    }
     switch (src) {
         case RELAY_BUTTON:
             if (val == 0) {
                 on_by_button = 0;
-                if (!alarm_state && (on_by_mqtt == 0)) {
-                    ESP_LOGI(TAG, "Turning relay off");
-                    gpio_set_level(GPIO_OUTPUT_RELAY_POWER, 0);
-                    relay_state = 0;
-                    send_msg = true;
-                }
+                deadline_cancel (&button_deadline);
             } else if (!alarm_state) {
                 on_by_button = 1;
-                button_on_time = esp_timer_get_time ();
-                if (!relay_state) {
-                    ESP_LOGI(TAG, "Turning relay on");
-                    gpio_set_level(GPIO_OUTPUT_RELAY_POWER, 1);
-                    relay_state = 1;
-                    send_msg = true;
-                }
+                deadline_after (&button_deadline, deadline_expired, wificonfig_watchdog_active->button_to_s);
             }
             break;
 
         case RELAY_MQTT:
+            // val: whether any MQTT lease is live
             if (val == 0) {
                 on_by_mqtt = 0;
-                if (!alarm_state && (on_by_button == 0)) {
-                    ESP_LOGI(TAG, "Turning relay off");
-                    gpio_set_level(GPIO_OUTPUT_RELAY_POWER, 0);
-                    relay_state = 0;
-                    send_msg = true;
-                }
             } else if (!alarm_state) {
                 on_by_mqtt = 1;
-                mqtt_on_time = esp_timer_get_time ();
-                if (!relay_state) {
-                    ESP_LOGI(TAG, "Turning relay on");
-                    gpio_set_level(GPIO_OUTPUT_RELAY_POWER, 1);
-                    relay_state = 1;
-                    send_msg = true;
-                }
             }
             break;
 
         case RELAY_ALARM:
             if (val == 0) {
-                if (relay_state) {
-                    ESP_LOGI(TAG, "ALARM: Turning relay off");
-                    gpio_set_level(GPIO_OUTPUT_RELAY_POWER, 0);
-                    relay_state = 0;
-                    send_msg = true;
-                 }
-                 alarm_state = 1;
-                 on_by_mqtt = 0;
-                 on_by_button = 0;
+                alarm_state = 1;
+                lease_release_all ();
+                on_by_mqtt = 0;
+                on_by_button = 0;
+                deadline_cancel (&button_deadline);
             }
             break;
 
@@ -564,17 +1042,79 @@ static void switch_relay (int val, enum relay_source_t src) {
             break;
     }
 
-    if (send_msg) {
-        publish_status ("POWER", relay_state);
+    update_relay (src);
+}
+
+// does this event's topic match cmnd/<topic>/<cmnd>?
+//
+static int is_cmnd_topic (esp_mqtt_event_handle_t event, char *cmnd) {
+    char full_topic[128];
+    sprintf (full_topic, "cmnd/%s/%s", wificonfig_vals_mqtt.topic, cmnd);
+    return ((event->topic_len == strlen(full_topic)) &&
+            (strncmp (event->topic, full_topic, event->topic_len) == 0));
+}
+
+// Power requests, one lease per requestor. The requestor is named by the
+// topic, cmnd/<topic>/POWER/<requestor>, or the payload, "ON <requestor>"
+// on cmnd/<topic>/POWER; plain ON/OFF there is the requestor "mqtt".
+//
+static int is_power_topic (esp_mqtt_event_handle_t event, char *id, int id_len) {
+    char prefix[128];
+    int len = sprintf (prefix, "cmnd/%s/POWER", wificonfig_vals_mqtt.topic);
+
+    if ((event->topic_len < len) || (strncmp (event->topic, prefix, len) != 0)) {
+        return 0;
+    }
+    if (event->topic_len == len) {
+        strcpy (id, "mqtt");
+        return 1;
     }
+    if ((event->topic[len] != '/') || (event->topic_len == len + 1)) {
+        return 0;
+    }
+    len++;
+    snprintf (id, id_len, "%.*s", event->topic_len - len, event->topic + len);
+    return 2;
+}
+
+static void power_request (esp_mqtt_event_handle_t event, char *id, bool id_from_topic) {
+    int cmd_len = event->data_len;
+    char *space = memchr (event->data, ' ', event->data_len);
 
+    if (space != NULL) {
+        cmd_len = space - event->data;
+        if (!id_from_topic && (event->data_len > cmd_len + 1)) {
+            snprintf (id, LEASE_ID_LEN, "%.*s", event->data_len - cmd_len - 1, space + 1);
+        }
+    }
+    if ((cmd_len == 2) && (strncmp (event->data, "ON", 2) == 0)) {
+        // requests made during an alarm are ignored, as before leases
+        if (!alarm_state) {
+            lease_grant (id, wificonfig_watchdog_active->mqtt_to_s);
+        }
+    } else {
+        lease_release (id);
+    }
+    // the main loop brings the relay into line
+    xEventGroupSetBits (deadline_events, DEADLINE_POWER);
+    publish_leases ();
 }
 
+static void config_data (esp_mqtt_event_handle_t event);
+static void config_abandon (void);
+static void ota_request (const char *url, int url_len);
+
+// set from other tasks; calib is only touched from the main loop
+static volatile bool calib_reset_requested = false;
+static volatile bool calib_reset_publish = false;   // and answer on stat/<topic>/CALIB
+
 static void mqtt_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
     ESP_LOGI(TAG, "mqtt_event_handler: Event dispatched from event loop base=%s, event_id=%d", event_base, event_id);
 
     esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t) event_data;
     int msg_id;
+    int power;
+    char requestor[LEASE_ID_LEN];
 
     char full_topic[128];
 
@@ -582,14 +1122,52 @@ static void mqtt_event_handler(void* arg, esp_event_base_t event_base, int32_t e
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
             mqtt_connected = true;
+            if (boot_times[BOOT_MQTT_UP] == 0) {
+                boot_mark (BOOT_MQTT_UP);
+                publish_boot ();
+            }
+            journal_record (JOURNAL_MQTT_UP, 0, 0);
+            ota_health (OTA_HEALTH_NETWORK);
+            publish_wifi ();
+
+            // current state first, so it wins over anything replayed
+            publish_status ("POWER",   relay_state);
+            publish_status ("RUNNING", running_state);
+            publish_status ("ALARM",   alarm_type);
+            replay_outbox ();
             sprintf (full_topic, "cmnd/%s/POWER", wificonfig_vals_mqtt.topic);
             msg_id = esp_mqtt_client_subscribe (mqtt_client, full_topic, 1);
             ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            sprintf (full_topic, "cmnd/%s/POWER/+", wificonfig_vals_mqtt.topic);
+            msg_id = esp_mqtt_client_subscribe (mqtt_client, full_topic, 1);
+            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            sprintf (full_topic, "cmnd/%s/LEASES", wificonfig_vals_mqtt.topic);
+            msg_id = esp_mqtt_client_subscribe (mqtt_client, full_topic, 1);
+            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            sprintf (full_topic, "cmnd/%s/DIAG", wificonfig_vals_mqtt.topic);
+            msg_id = esp_mqtt_client_subscribe (mqtt_client, full_topic, 1);
+            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            sprintf (full_topic, "cmnd/%s/JOURNAL", wificonfig_vals_mqtt.topic);
+            msg_id = esp_mqtt_client_subscribe (mqtt_client, full_topic, 1);
+            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            sprintf (full_topic, "cmnd/%s/HIST", wificonfig_vals_mqtt.topic);
+            msg_id = esp_mqtt_client_subscribe (mqtt_client, full_topic, 1);
+            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            sprintf (full_topic, "cmnd/%s/CALIB", wificonfig_vals_mqtt.topic);
+            msg_id = esp_mqtt_client_subscribe (mqtt_client, full_topic, 1);
+            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            sprintf (full_topic, "cmnd/%s/CONFIG", wificonfig_vals_mqtt.topic);
+            msg_id = esp_mqtt_client_subscribe (mqtt_client, full_topic, 1);
+            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            sprintf (full_topic, "cmnd/%s/OTA", wificonfig_vals_mqtt.topic);
+            msg_id = esp_mqtt_client_subscribe (mqtt_client, full_topic, 1);
+            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
             break;
 
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
             mqtt_connected = false;
+            config_abandon ();
             break;
 
         case MQTT_EVENT_SUBSCRIBED:
@@ -600,12 +1178,31 @@ static void mqtt_event_handler(void* arg, esp_event_base_t event_base, int32_t e
             ESP_LOGI(TAG, "MQTT_EVENT_DATA");
             ESP_LOGI(TAG, "TOPIC=%.*s", event->topic_len, event->topic);
             ESP_LOGI(TAG, "DATA=%.*s", event->data_len, event->data);
-            if (event->data_len > 0) {
-                if (strncmp (event->data, "ON", event->data_len) == 0) {
-                    switch_relay (1, RELAY_MQTT);
+            // only the first piece of a long message has the topic
+            if ((event->current_data_offset > 0) || is_cmnd_topic (event, "CONFIG")) {
+                config_data (event);
+            } else if (is_cmnd_topic (event, "DIAG")) {
+                publish_diag ();
+            } else if (is_cmnd_topic (event, "HIST")) {
+                publish_hist ();
+                if ((event->data_len == 5) && (strncmp (event->data, "RESET", 5) == 0)) {
+                    cyclehist_reset ();
+                }
+            } else if (is_cmnd_topic (event, "JOURNAL")) {
+                publish_journal (journal_count (event->data, event->data_len));
+            } else if (is_cmnd_topic (event, "CALIB")) {
+                if ((event->data_len == 5) && (strncmp (event->data, "RESET", 5) == 0)) {
+                    calib_reset_publish = true;
+                    calib_reset_requested = true;
                 } else {
-                    switch_relay (0, RELAY_MQTT);
+                    publish_calib ();
                 }
+            } else if (is_cmnd_topic (event, "LEASES")) {
+                publish_leases ();
+            } else if (is_cmnd_topic (event, "OTA")) {
+                ota_request (event->data, event->data_len);
+            } else if (((power = is_power_topic (event, requestor, sizeof(requestor))) != 0) && (event->data_len > 0)) {
+                power_request (event, requestor, (power == 2));
             }
             break;
 
@@ -638,13 +1235,12 @@ static void initialize_mqtt () {
 
     // wait for Wifi connection
     ESP_LOGI(TAG, "initialize_mqtt: Waiting for wifi to go up");
-    while ((xEventGroupGetBits (wifi_event_group) & CONNECTED_BIT) == 0) {
-        vTaskDelay(100 / portTICK_RATE_MS);
-    }
+    xEventGroupWaitBits (wifi_event_group, CONNECTED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
     ESP_LOGI(TAG, "initialize_mqtt: Wifi is up");
 
-
+#ifndef CONFIG_WATCHDOG_FAST_START
     vTaskDelay(1000 / portTICK_RATE_MS);
+#endif
     //ESP_LOGI(TAG, "initialize_mqtt: Calling esp_mqtt_client_init");
     mqtt_client = esp_mqtt_client_init (&mqtt_cfg);
     if (mqtt_client != NULL) {
@@ -654,20 +1250,339 @@ static void initialize_mqtt () {
         if (esp_mqtt_client_start (mqtt_client) != ESP_OK) {
             ESP_LOGE(TAG, "initialize_mqtt: Unable to start MQTT client");
         }
+        boot_mark (BOOT_MQTT_START);
     } else {
         ESP_LOGE(TAG, "initialize_mqtt: Unable to initialize MQTT client");
     }
 }
 
-int64_t alarm_time = 0;
 int ran_this_minute = 0;
+static int64_t run_start_time = 0;  // when the current run started
+static volatile bool maxtime_changed = false;
+static volatile int duty_sum = 0;   // minutes run in the duty cycle window
+
+// How close each alarm is, assuming the compressor keeps running from
+// now on. For the duty cycle this is the worst case: minutes that age out
+// of the window could only push the alarm further off.
+//
+struct forecast {
+    int maxtime_s;      // seconds until a MAXTIME alarm
+    int maxtime_pct;    // percentage of the MAXTIME budget used
+    int duty_s;         // seconds until a DUTYCYCLE alarm (at most)
+    int duty_pct;       // percentage of the duty cycle budget used
+};
+
+static void get_forecast (struct forecast *f) {
+    int budget_s = wificonfig_watchdog_active->maxtime_s;
+    int used_s = running_state ? (esp_timer_get_time () - run_start_time) / 1000000 : 0;
+    f->maxtime_pct = used_s * 100 / budget_s;
+    f->maxtime_s = (used_s < budget_s) ? (budget_s - used_s) : 0;
+
+    // the alarm trips once more than dutycycle% of the window has run
+    int budget_min = wificonfig_watchdog_active->dutycycle * wificonfig_watchdog_active->window / 100 + 1;
+    int used_min = duty_sum;
+    f->duty_pct = used_min * 100 / budget_min;
+    f->duty_s = (used_min < budget_min) ? (budget_min - used_min) * 60 : 0;
+}
+
+static void publish_forecast (void) {
+    char buf[128];
+    struct forecast f;
+
+    get_forecast (&f);
+    sprintf (buf, "{\"maxtime_s\":%d,\"maxtime_pct\":%d,\"duty_s\":%d,\"duty_pct\":%d}",
+             f.maxtime_s, f.maxtime_pct, f.duty_s, f.duty_pct);
+    publish_string ("FORECAST", buf);
+}
+
+// highest configured pre-alarm level that pct has reached, or 0
+//
+static int prealarm_level (int pct) {
+    int level = 0;
+    if ((wificonfig_watchdog_active->prewarn1 > 0) && (pct >= wificonfig_watchdog_active->prewarn1)) {
+        level = wificonfig_watchdog_active->prewarn1;
+    }
+    if ((wificonfig_watchdog_active->prewarn2 > level) && (pct >= wificonfig_watchdog_active->prewarn2)) {
+        level = wificonfig_watchdog_active->prewarn2;
+    }
+    return level;
+}
+
+// publish PREALARM-* whenever a budget crosses a warning level, either way;
+// the value is the level reached, so a step from 80 to 90 can be told apart
+//
+static void check_prealarms (void) {
+    static int maxtime_level = 0;
+    static int duty_level = 0;
+    struct forecast f;
+    char num[12];
+    int level;
+
+    get_forecast (&f);
+
+    level = (alarm_type & ALARM_TYPE_MAXTIME) ? 0 : prealarm_level (f.maxtime_pct);
+    if (level != maxtime_level) {
+        ESP_LOGI (TAG, "MAXTIME pre-alarm %d%%, %d s left", level, f.maxtime_s);
+        sprintf (num, "%d", level);
+        publish_event_name ("PREALARM-MAXTIME", level, num);
+        maxtime_level = level;
+    }
+
+    level = (alarm_type & ALARM_TYPE_DUTYCYCLE) ? 0 : prealarm_level (f.duty_pct);
+    if (level != duty_level) {
+        ESP_LOGI (TAG, "Duty cycle pre-alarm %d%%, %d s left", level, f.duty_s);
+        sprintf (num, "%d", level);
+        publish_event_name ("PREALARM-DUTYCYCLE", level, num);
+        duty_level = level;
+    }
+}
+// turn the relay off and raise an alarm; type is one ALARM_TYPE_* bit
+//
+static void raise_alarm (int type) {
+    alarm_type |= type;
+    deadline_after (&cooldown_deadline, deadline_expired, wificonfig_watchdog_active->cooldown_s);
+    switch_relay (0, RELAY_ALARM);
+    journal_record (JOURNAL_ALARM, alarm_type, 0);
+    stats_alarm ();
+    publish_event ("ALARM", alarm_type);
+    publish_event (alarm_subtopics[__builtin_ctz (type)], 1);
+}
+
+static void relay_check (void) {
+    bool current = (motor_state () != MOTOR_OFF);
+
+    if (!relay_state && current && ((alarm_type & ALARM_TYPE_WELDED) == 0)) {
+        ESP_LOGE (TAG, "Relay check: current flowing with relay off, contact welded?");
+        raise_alarm (ALARM_TYPE_WELDED);
+    } else if (relay_state && !current && relay_expect_start && ((alarm_type & ALARM_TYPE_OPEN) == 0)) {
+        ESP_LOGE (TAG, "Relay check: relay on but no current, contact open or breaker tripped?");
+        raise_alarm (ALARM_TYPE_OPEN);
+    }
+}
+
+// Valve feedback: publish position changes and travel times; a valve
+// that never reaches its position is an alarm
+//
+static void valve_event_handler (void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+    struct valve_event_data *v = (struct valve_event_data *) event_data;
+    char buf[128];
+
+    switch (event_id) {
+        case VALVE_EVENT_POSITION:
+            journal_record (JOURNAL_VALVE, v->position, 0);
+            publish_event_name ("VALVE", v->position, valve_position_name (v->position));
+            if (v->position == VALVE_FAULT) {
+                ESP_LOGE (TAG, "Valve fault: both position switches closed");
+                xEventGroupSetBits (deadline_events, DEADLINE_VALVE);
+            }
+            break;
+
+        case VALVE_EVENT_ARRIVED:
+            journal_record (JOURNAL_VALVE, v->position, v->travel_ms);
+            sprintf (buf, "{\"position\":\"%s\",\"travel_ms\":%u,\"avg_ms\":%u}",
+                     valve_position_name (v->position), v->travel_ms, v->avg_travel_ms);
+            publish_string ("VALVE-TRAVEL", buf);
+            break;
+
+        case VALVE_EVENT_STUCK:
+            ESP_LOGE (TAG, "Valve stuck %s, should be %s",
+                      valve_position_name (v->position), valve_position_name (v->target));
+            xEventGroupSetBits (deadline_events, DEADLINE_VALVE);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void initialize_valve (void) {
+#ifdef CONFIG_WATCHDOG_VALVE_FEEDBACK
+    ESP_ERROR_CHECK( esp_event_handler_register (VALVE_EVENT, ESP_EVENT_ANY_ID, &valve_event_handler, NULL) );
+    valve_init (relay_state);
+#endif
+}
+
+// Firmware updates: record and publish how they went
+//
+static void ota_event_handler (void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+    struct ota_event_data *o = (struct ota_event_data *) event_data;
+    char buf[128];
+
+    journal_record (JOURNAL_OTA, event_id, (event_id == OTA_EVENT_FAILED) ? o->err : o->bytes);
+    if (event_id == OTA_EVENT_FAILED) {
+        sprintf (buf, "{\"state\":\"%s\",\"error\":\"%s\",\"bytes\":%u}",
+                 ota_state_name (event_id), esp_err_to_name (o->err), o->bytes);
+    } else {
+        sprintf (buf, "{\"state\":\"%s\",\"version\":\"%s\",\"bytes\":%u}",
+                 ota_state_name (event_id), o->version, o->bytes);
+    }
+    publish_string ("OTA", buf);
+}
+
+// cmnd/<topic>/OTA: fetch new firmware from the URL given, or the
+// configured one
+//
+static void ota_request (const char *url, int url_len) {
+    esp_err_t err = ota_pull (url, url_len);
+    char buf[96];
+
+    if (err != ESP_OK) {
+        sprintf (buf, "{\"state\":\"failed\",\"error\":\"%s\",\"bytes\":0}",
+                 (err == ESP_ERR_INVALID_STATE) ? "busy" : esp_err_to_name (err));
+        publish_string ("OTA", buf);
+    }
+}
+
+static void initialize_ota (void) {
+    ESP_ERROR_CHECK( esp_event_handler_register (OTA_EVENT, ESP_EVENT_ANY_ID, &ota_event_handler, NULL) );
+    ota_init ();
+}
+
+// Live view: what a /live client sees, read when each frame is sent
+//
+static void live_read (struct live_frame *frame) {
+    read_sensors (frame->amplitude);
+    frame->sensor = wificonfig_watchdog_active->sensor;
+    frame->thresh = wificonfig_watchdog_active->thresh;
+    frame->running = running_state;
+    frame->relay = relay_state;
+    frame->alarm_type = alarm_type;
+    frame->amps = 0;
+    for (int i = 0; i < LIVE_NUM_SENSORS; i++) {
+        frame->amps |= current_in_amps (i) << i;
+    }
+}
+
+// Publish motor state changes and check for motor anomalies:
+// - no start: relay on for the no-start time without the motor starting
+// - low current: running unloaded for LOWCURRENT_TIME
+//
+static void check_motor (int64_t curr_time) {
+    static enum motor_state_t last_state = MOTOR_OFF;
+    static int64_t state_time = 0;
+    static int last_relay = 0;
+    static int64_t relay_time = 0;
+    static bool started = false;        // motor has started since the relay went on
+    static bool nostart = false;
+    static bool lowcurrent = false;
+
+    enum motor_state_t state = motor_state ();
+    if (state != last_state) {
+        if (!relay_state && (last_state == MOTOR_OFF)) {
+            relay_check_arm ();
+        }
+        publish_event_name ("MOTOR", state, motor_state_name (state));
+        // every cycle goes off, inrush, loaded, off, and the running edges
+        // are journalled already; keep only what says something is wrong
+        if ((state == MOTOR_UNLOADED) || ((last_state == MOTOR_INRUSH) && (state == MOTOR_OFF))) {
+            journal_record (JOURNAL_MOTOR, state, (curr_time - state_time) / 1000);
+        }
+        last_state = state;
+        state_time = curr_time;
+    }
+
+    if (relay_state != last_relay) {
+        relay_time = curr_time;
+        started = false;
+        last_relay = relay_state;
+    }
+    if (state != MOTOR_OFF) {
+        started = true;
+    }
+
+    bool new_nostart = (wificonfig_watchdog_active->nostart > 0) && relay_state && !started &&
+                       ((curr_time - relay_time) / 1000000 >= wificonfig_watchdog_active->nostart);
+    if (new_nostart != nostart) {
+        ESP_LOGI (TAG, "Motor anomaly: no start %s", new_nostart ? "detected" : "cleared");
+        journal_record (JOURNAL_ANOMALY, 0, new_nostart);
+        publish_event ("ANOMALY-NOSTART", new_nostart);
+        nostart = new_nostart;
+        if (nostart && (wificonfig_watchdog_active->anom_alarm & ANOMALY_ALARM_NOSTART)) {
+            raise_alarm (ALARM_TYPE_NOSTART);
+        }
+    }
+
+    bool new_lowcurrent = (state == MOTOR_UNLOADED) && ((curr_time - state_time) / 1000000 >= LOWCURRENT_TIME);
+    if (new_lowcurrent != lowcurrent) {
+        ESP_LOGI (TAG, "Motor anomaly: low current %s", new_lowcurrent ? "detected" : "cleared");
+        journal_record (JOURNAL_ANOMALY, 1, new_lowcurrent);
+        publish_event ("ANOMALY-LOWCURRENT", new_lowcurrent);
+        lowcurrent = new_lowcurrent;
+        if (lowcurrent && (wificonfig_watchdog_active->anom_alarm & ANOMALY_ALARM_LOWCURRENT)) {
+            raise_alarm (ALARM_TYPE_LOWCURRENT);
+        }
+    }
+}
+
+// Auto-calibration: feed it the filtered readings, publish its estimates
+// when it first has a proposal, and in apply mode use the proposal for the
+// selected sensor whenever it differs from the configured threshold by
+// more than CALIB_APPLY_PCT. Applied values aren't saved, so a restart
+// goes back to the saved thresholds until it has learned again.
+//
+#define CALIB_APPLY_PCT 10
+#define CALIB_CHECK_US  (60 * 1000000LL)
+
+static void check_calibration (int64_t curr_time) {
+    static int64_t last_sample = 0;
+    static int64_t last_check = 0;
+    static bool proposed = false;
+    int amplitude[CALIB_NUM_CHANNELS];
+    int thresh, thresh_off;
+
+    if (calib_reset_requested) {
+        calib_reset_requested = false;
+        calib_reset ();
+        if (calib_reset_publish) {
+            calib_reset_publish = false;
+            publish_calib ();
+        }
+    }
+    if (wificonfig_watchdog_active->autocal == CALIB_OFF) {
+        return;
+    }
+    if (curr_time - last_sample >= 1000000 / CALIB_SAMPLE_HZ) {
+        last_sample = curr_time;
+        read_sensors (amplitude);
+        calib_sample (relay_state, amplitude);
+    }
+    if (curr_time - last_check < CALIB_CHECK_US) {
+        return;
+    }
+    last_check = curr_time;
+
+    bool have = calib_proposal (sensor_channel, &thresh, &thresh_off);
+    if (have && !proposed) {
+        publish_calib ();
+    }
+    proposed = have;
+    if (!have || (wificonfig_watchdog_active->autocal != CALIB_APPLY) ||
+        (abs (thresh - wificonfig_watchdog_active->thresh) * 100 <= wificonfig_watchdog_active->thresh * CALIB_APPLY_PCT)) {
+        return;
+    }
+
+    // the staging buffer is busy while a change is being made over MQTT;
+    // try again next time
+    struct wificonfig_watchdog *stage = wificonfig_watchdog_stage ();
+    if (stage == NULL) {
+        return;
+    }
+    ESP_LOGI(TAG, "calib: threshold %u -> %d, stop threshold %u -> %d",
+             wificonfig_watchdog_active->thresh, thresh, wificonfig_watchdog_active->thresh_off, thresh_off);
+    stage->thresh = thresh;
+    stage->thresh_off = thresh_off;
+    wificonfig_commit (stage, NULL, NULL);
+    journal_record (JOURNAL_CONFIG, 2, thresh);
+    publish_calib ();
+}
+
 static void watchdog_main_loop (void *pvParameters) {
     int last_on_val = 1;
     int last_off_val = 1;
     int last_running = 0;
-    int64_t start_time = 0;
     int conn_flashing = 0;
     int access_flashing = 0;
+    EventBits_t due = 0;    // deadlines that have expired
 
     while (1) {
 
@@ -675,13 +1590,29 @@ static void watchdog_main_loop (void *pvParameters) {
 
         // see if alarm has timed out (cooldown)
         //
-        if (alarm_state && ((curr_time - alarm_time)/60000000 >= (wificonfig_vals_watchdog.cooldown))) {
+        if ((due & DEADLINE_COOLDOWN) && alarm_state) {
             alarm_state = 0;
             alarm_type = 0;
             ESP_LOGI (TAG, "Alarm cooldown time has passed");
-            publish_status ("ALARM", 0);
-            publish_status ("ALARM-MAXTIME", 0);
-            publish_status ("ALARM-DUTYCYCLE", 0);
+            journal_record (JOURNAL_ALARM_CLEAR, 0, 0);
+            publish_event ("ALARM", 0);
+            for (int i = 0; i < NUM_ALARM_TYPES; i++) {
+                publish_event (alarm_subtopics[i], 0);
+            }
+            // a welded relay is still welded: check again
+            relay_check_arm ();
+        }
+
+        // the ISR has already dropped the relay on an overcurrent trip;
+        // raise the alarm to match
+        //
+        if (trip_pending) {
+            int notify_ms = (curr_time - trip_time) / 1000;
+            ESP_LOGI (TAG, "OVERCURRENT fast trip! span %d, detected after %d us, relay off %d us later",
+                      trip_span, trip_detect_us, trip_isr_us);
+            trip_pending = false;
+            raise_alarm (ALARM_TYPE_OVERCURRENT);
+            publish_trip (notify_ms);
         }
 
         // Check status of buttons
@@ -702,54 +1633,104 @@ static void watchdog_main_loop (void *pvParameters) {
         }
 
         // see if last "ON" button has timed out
-        if (on_by_button && ((curr_time - button_on_time)/60000000 >= wificonfig_vals_watchdog.button_to)) {
+        if ((due & DEADLINE_BUTTON) && on_by_button) {
             ESP_LOGI(TAG, "ON-button timeout reached");
             switch_relay (0, RELAY_BUTTON);
         }
 
-        // see if last "ON" mqtt has timed out
-        if (on_by_mqtt && ((curr_time - mqtt_on_time)/60000000 >= wificonfig_vals_watchdog.mqtt_to)) {
-            ESP_LOGI(TAG, "ON-mqtt timeout reached");
-            switch_relay (0, RELAY_MQTT);
+        // an MQTT request granted or released a lease
+        if (due & DEADLINE_POWER) {
+            switch_relay (lease_live () > 0, RELAY_MQTT);
+        }
+
+        // see if any MQTT leases have timed out
+        if (due & DEADLINE_LEASE) {
+            ESP_LOGI(TAG, "ON-mqtt timeout reached, %d leases left", lease_live ());
+            if (on_by_mqtt && (lease_live () == 0)) {
+                switch_relay (0, RELAY_MQTT);
+            }
+            publish_leases ();
         }
 
         last_on_val = new_on_val;
         last_off_val = new_off_val;
 
+        // carry out a deferred relay change once it's due
+        if ((due & DEADLINE_RELAY) && relay_pending) {
+            update_relay (relay_pending_src);
+        }
+
+        // the relay has had its grace period: does the current agree?
+        if (due & DEADLINE_RELAY_CHECK) {
+            relay_check ();
+        }
+
+        // dutycycle_loop found the duty cycle exceeded
+        if ((due & DEADLINE_DUTYCYCLE) && ((alarm_type & ALARM_TYPE_DUTYCYCLE) == 0)) {
+            raise_alarm (ALARM_TYPE_DUTYCYCLE);
+        }
+
+        // the valve event handler found it stuck or faulty
+        if ((due & DEADLINE_VALVE) && ((alarm_type & ALARM_TYPE_VALVE) == 0)) {
+            raise_alarm (ALARM_TYPE_VALVE);
+        }
+
 
         // Check current sensor
         //
-        running_state = (get_average_amplitude(sensor_ring) >= wificonfig_vals_watchdog.thresh);
+        int amplitude = filter_output (sensor_channel);
+        running_state = filter_running (running_state, amplitude, wificonfig_watchdog_active->thresh,
+                                        wificonfig_watchdog_active->thresh_off);
+        stats_sample (running_state, amplitude);
+        ota_health (OTA_HEALTH_LOOPS);
         gpio_set_level(GPIO_OUTPUT_SENSE_LED, running_state);
         if (running_state != last_running) {
             if (running_state) {
-                start_time = curr_time;
+                run_start_time = curr_time;
+                deadline_after (&maxtime_deadline, deadline_expired, wificonfig_watchdog_active->maxtime_s);
+            } else {
+                deadline_cancel (&maxtime_deadline);
             }
-            publish_status ("RUNNING", running_state);
+            cyclehist_edge (running_state);
+            journal_record (JOURNAL_RUNNING, running_state, 0);
+            publish_event ("RUNNING", running_state);
         }
         last_running = running_state;
 
+        // a new maxtime applies to the run in progress
+        if (maxtime_changed) {
+            maxtime_changed = false;
+            if (running_state) {
+                deadline_at (&maxtime_deadline, deadline_expired,
+                             run_start_time + wificonfig_watchdog_active->maxtime_s * 1000000LL);
+            }
+        }
+
         // See if we've blown MAXTIME requirement
         //
-        if (((alarm_type & ALARM_TYPE_MAXTIME) == 0) && running_state && ((curr_time - start_time)/60000000 >= wificonfig_vals_watchdog.maxtime)) {
+        if ((due & DEADLINE_MAXTIME) && ((alarm_type & ALARM_TYPE_MAXTIME) == 0) && running_state) {
             ESP_LOGI (TAG, "MAXTIME alarm condition!");
-            alarm_time = curr_time;
-            alarm_type |= ALARM_TYPE_MAXTIME;
-            switch_relay (0, RELAY_ALARM);
-            publish_status ("ALARM", alarm_type);
-            publish_status ("ALARM-MAXTIME", 1);
+            raise_alarm (ALARM_TYPE_MAXTIME);
         }
 
         // record running state for duty cycle check
         if (running_state)
             ran_this_minute = 1;
 
+        check_prealarms ();
+        check_motor (curr_time);
+        check_calibration (curr_time);
+
         // take care of "connected" led
         // - off if not connected
         // - on if connected
         // - flashing if MQTT error
+        // - blipping (short flash every 0.8s) in config mode
         
-        if ((xEventGroupGetBits (wifi_event_group) & CONNECTED_BIT) == 0) {
+        if (wificonfig_active ()) {
+            gpio_set_level(GPIO_OUTPUT_CONNECTED_LED, (conn_flashing == 0));
+            conn_flashing = (conn_flashing + 1) % 8;
+        } else if ((xEventGroupGetBits (wifi_event_group) & CONNECTED_BIT) == 0) {
             gpio_set_level(GPIO_OUTPUT_CONNECTED_LED, 0);
         } else if ((mqtt_client != NULL) & mqtt_connected) {
             gpio_set_level(GPIO_OUTPUT_CONNECTED_LED, 1);
@@ -761,18 +1742,82 @@ static void watchdog_main_loop (void *pvParameters) {
         // take care of "access" led
         // - off if relay is off
         // - on if relay is on
-        // - flashing if in alarm: number of flashes indicates alarm type
+        // - flashing if in alarm: number of flashes is the alarm type value,
+        //   or 8 for the motor, relay and valve fault alarms (see MQTT for details)
         
         if (!alarm_state) {
             gpio_set_level(GPIO_OUTPUT_ACCESS_LED, relay_state);
         } else {
+            int flashes = (alarm_type < 8) ? alarm_type : 8;
             int i = access_flashing >> 1;
-            gpio_set_level(GPIO_OUTPUT_ACCESS_LED, ((i == 0) || ((i == 2) && (alarm_type > 1)) || ((i == 4) && (alarm_type > 2))));
-            access_flashing = (access_flashing + 1) % (alarm_type*4 + 4);
+            gpio_set_level(GPIO_OUTPUT_ACCESS_LED, (((i % 2) == 0) && ((i / 2) < flashes)));
+            access_flashing = (access_flashing + 1) % (flashes*4 + 4);
         }
 
-        vTaskDelay(100 / portTICK_RATE_MS);
+        due = xEventGroupWaitBits (deadline_events, DEADLINE_ALL, pdTRUE, pdFALSE, 100 / portTICK_RATE_MS);
+    }
+}
+
+// The duty cycle window: one entry per minute, 1 if the compressor ran.
+// duty_pnt is the oldest minute, the next to be replaced. The window can
+// be resized while running, so it is only touched with duty_lock held.
+//
+static SemaphoreHandle_t duty_lock;
+static int8_t *duty_ring;
+static int duty_window = 0;
+static int duty_pnt = 0;
+
+static void initialize_duty_window (void) {
+    duty_lock = xSemaphoreCreateMutex ();
+    duty_window = wificonfig_watchdog_active->window;
+    duty_ring = calloc (duty_window, sizeof (int8_t));
+}
+
+// reverse ring[from..to-1]
+//
+static void duty_reverse (int from, int to) {
+    for (to--; from < to; from++, to--) {
+        int8_t t = duty_ring[from];
+        duty_ring[from] = duty_ring[to];
+        duty_ring[to] = t;
+    }
+}
+
+// Change the window length in place, keeping as much of the history as
+// fits. The ring is first rotated so the oldest minute comes first; then
+// shrinking drops the oldest minutes and growing adds idle ones before them.
+//
+static void duty_resize (int window) {
+    xSemaphoreTake (duty_lock, portMAX_DELAY);
+    duty_reverse (0, duty_pnt);
+    duty_reverse (duty_pnt, duty_window);
+    duty_reverse (0, duty_window);
+    duty_pnt = 0;
+
+    if (window < duty_window) {
+        int drop = duty_window - window;
+        for (int i = 0; i < drop; i++) {
+            duty_sum -= duty_ring[i];
+        }
+        memmove (duty_ring, duty_ring + drop, window);
+        int8_t *shrunk = realloc (duty_ring, window);
+        if (shrunk != NULL) {
+            duty_ring = shrunk;
+        }
+        duty_window = window;
+    } else if (window > duty_window) {
+        int8_t *grown = realloc (duty_ring, window);
+        if (grown != NULL) {
+            memmove (grown + (window - duty_window), grown, duty_window);
+            memset (grown, 0, window - duty_window);
+            duty_ring = grown;
+            duty_window = window;
+        } else {
+            ESP_LOGE (TAG, "No memory to grow the duty cycle window to %d minutes", window);
+        }
     }
+    xSemaphoreGive (duty_lock);
+    ESP_LOGI (TAG, "Duty cycle window now %d minutes, %d run", duty_window, duty_sum);
 }
 
 // See if we've blown duty cycle requirement
@@ -780,38 +1825,33 @@ static void watchdog_main_loop (void *pvParameters) {
 //
 static void dutycycle_loop (void *pvParameters) {
 
-    int window = wificonfig_vals_watchdog.window;
-    int8_t *duty_ring = malloc (window * sizeof (int8_t));
-    int duty_pnt = 0;
-
-    for (int i = 0; i<window; i++)
-        duty_ring[i] = 0;
-
     while (1) {
         vTaskDelay(60000/ portTICK_RATE_MS); // wait one minute
 
-        // record running/not running in ring
+        // record running/not running in ring, keeping a running
+        // total so the check doesn't have to rescan the window
         //
+        xSemaphoreTake (duty_lock, portMAX_DELAY);
         if (ran_this_minute)
             ESP_LOGI (TAG, "Running at minute %d", duty_pnt);
+        duty_sum += ran_this_minute - duty_ring[duty_pnt];
         duty_ring[duty_pnt++] = ran_this_minute;
-        if (duty_pnt > window)
+        if (duty_pnt >= duty_window)
             duty_pnt = 0;
         ran_this_minute = 0;
+        int window = duty_window;
+        xSemaphoreGive (duty_lock);
 
         // make dutycycle check
-        int sum = 0;
-        for (int i=0; i<window; i++) {
-            sum += duty_ring[i];
-            if (((alarm_type & ALARM_TYPE_DUTYCYCLE) == 0) && running_state && (sum > (wificonfig_vals_watchdog.dutycycle * window / 100))) {
-                ESP_LOGI (TAG, "Duty cycle alarm condition!");
-                alarm_time = esp_timer_get_time();
-                alarm_type |= ALARM_TYPE_DUTYCYCLE;
-                switch_relay (0, RELAY_ALARM);
-                publish_status ("ALARM", alarm_type);
-                publish_status ("ALARM-DUTYCYCLE", 1);
-            }
+        if (((alarm_type & ALARM_TYPE_DUTYCYCLE) == 0) && running_state && (duty_sum > (wificonfig_watchdog_active->dutycycle * window / 100))) {
+            ESP_LOGI (TAG, "Duty cycle alarm condition!");
+            xEventGroupSetBits (deadline_events, DEADLINE_DUTYCYCLE);
         }
+
+        publish_forecast ();
+        journal_poll ();
+        stats_poll ();
+        cyclehist_poll ();
     }
 }
 
@@ -825,6 +1865,7 @@ static void update_loop (void *pvParameters) {
             publish_status ("POWER",   relay_state);
             publish_status ("RUNNING", running_state);
             publish_status ("ALARM",   alarm_type);
+            publish_hist ();
             vTaskDelay((60000 * wificonfig_vals_mqtt.update) / portTICK_RATE_MS);
         } else {
          // paranoia (should never get here)
@@ -834,53 +1875,258 @@ static void update_loop (void *pvParameters) {
 }
 
 
+#ifdef CONFIG_WATCHDOG_FAST_START
+// bring up MQTT without holding up app_main
+//
+static void mqtt_start_task (void *pvParameters) {
+    initialize_mqtt();
+    if ((mqtt_client != NULL) && (wificonfig_vals_mqtt.update != 0)) {
+        xTaskCreate(&update_loop, "update_loop", 4096, NULL, 5, &update_task);
+    }
+    vTaskDelete (NULL);
+}
+#endif
+
+// CT ratio and burden of each sensor, from the watchdog configuration
+//
+static void configure_current (void) {
+    current_configure (0, wificonfig_watchdog_active->ct_ratio0, wificonfig_watchdog_active->ct_burden0);
+    current_configure (1, wificonfig_watchdog_active->ct_ratio1, wificonfig_watchdog_active->ct_burden1);
+    current_configure (2, wificonfig_watchdog_active->ct_ratio2, wificonfig_watchdog_active->ct_burden2);
+    current_configure (3, wificonfig_watchdog_active->ct_ratio3, wificonfig_watchdog_active->ct_burden3);
+}
+
+// point to sensor in use
+//
+static void select_sensor (void) {
+    if (wificonfig_watchdog_active->sensor < FILTER_NUM_CHANNELS) {
+        sensor_channel = wificonfig_watchdog_active->sensor;
+    }
+}
+
+// Live configuration: a JSON document on cmnd/<topic>/CONFIG (see the
+// user manual) changes the MQTT and watchdog values without a restart
+// (WiFi values take effect at the next one).
+// The result is published on stat/<topic>/CONFIG; an empty message just
+// publishes the current values.
+//
+static struct wificonfig_json config_doc;
+static bool config_streaming = false;
+static char config_result[1280];
+
+// Reconnect with new MQTT settings. The client can't be stopped from its
+// own event handler, so this runs as a task of its own.
+//
+static void mqtt_restart_task (void *pvParameters) {
+    char uri[128];
+
+    // give the CONFIG result a moment to go out
+    vTaskDelay(1000 / portTICK_RATE_MS);
+    if (mqtt_client == NULL) {
+        initialize_mqtt ();
+    } else {
+        esp_mqtt_client_stop (mqtt_client);
+        mqtt_connected = false;
+        if (strcmp (wificonfig_vals_mqtt.host, "") != 0) {
+            sprintf (uri, "mqtt://%s", wificonfig_vals_mqtt.host);
+            esp_mqtt_client_config_t mqtt_cfg = {
+                .uri = uri,
+                .port = wificonfig_vals_mqtt.port,
+                .client_id = wificonfig_vals_mqtt.client,
+                .username = wificonfig_vals_mqtt.user,
+                .password = wificonfig_vals_mqtt.pswd,
+            };
+            ESP_LOGI(TAG, "Restarting MQTT with new settings");
+            esp_mqtt_set_config (mqtt_client, &mqtt_cfg);
+            if (esp_mqtt_client_start (mqtt_client) != ESP_OK) {
+                ESP_LOGE(TAG, "Unable to restart MQTT client");
+            }
+        }
+    }
+    if ((mqtt_client != NULL) && (wificonfig_vals_mqtt.update != 0) && (update_task == NULL)) {
+        xTaskCreate(&update_loop, "update_loop", 4096, NULL, 5, &update_task);
+    }
+    vTaskDelete (NULL);
+}
+
+// Put values that just became active into effect, whether they came
+// over MQTT or from the config pages
+//
+static void config_committed (const struct wificonfig_watchdog *old, const struct wificonfig_vals_mqtt *old_mqtt) {
+    if ((old->sensor != wificonfig_watchdog_active->sensor) ||
+        (old->thresh != wificonfig_watchdog_active->thresh) ||
+        (old->trip != wificonfig_watchdog_active->trip) ||
+        (old->inrush != wificonfig_watchdog_active->inrush) ||
+        (old->unload != wificonfig_watchdog_active->unload)) {
+        select_sensor ();
+        initialize_fast_trip ();
+    }
+    if ((old->ct_ratio0 != wificonfig_watchdog_active->ct_ratio0) ||
+        (old->ct_ratio1 != wificonfig_watchdog_active->ct_ratio1) ||
+        (old->ct_ratio2 != wificonfig_watchdog_active->ct_ratio2) ||
+        (old->ct_ratio3 != wificonfig_watchdog_active->ct_ratio3) ||
+        (old->ct_burden0 != wificonfig_watchdog_active->ct_burden0) ||
+        (old->ct_burden1 != wificonfig_watchdog_active->ct_burden1) ||
+        (old->ct_burden2 != wificonfig_watchdog_active->ct_burden2) ||
+        (old->ct_burden3 != wificonfig_watchdog_active->ct_burden3)) {
+        // what has been learned is in the old units
+        configure_current ();
+        calib_reset_requested = true;
+    }
+    if (old->window != wificonfig_watchdog_active->window) {
+        duty_resize (wificonfig_watchdog_active->window);
+    }
+    if (old->maxtime_s != wificonfig_watchdog_active->maxtime_s) {
+        maxtime_changed = true;
+    }
+
+    if ((strcmp (old_mqtt->host, wificonfig_vals_mqtt.host) != 0) ||
+        (old_mqtt->port != wificonfig_vals_mqtt.port) ||
+        (strcmp (old_mqtt->client, wificonfig_vals_mqtt.client) != 0) ||
+        (strcmp (old_mqtt->user, wificonfig_vals_mqtt.user) != 0) ||
+        (strcmp (old_mqtt->pswd, wificonfig_vals_mqtt.pswd) != 0) ||
+        (strcmp (old_mqtt->topic, wificonfig_vals_mqtt.topic) != 0) ||
+        ((old_mqtt->update == 0) && (wificonfig_vals_mqtt.update != 0))) {
+        xTaskCreate(&mqtt_restart_task, "mqtt_restart", 4096, NULL, 5, NULL);
+    }
+}
+
+static void config_data (esp_mqtt_event_handle_t event) {
+    if (event->current_data_offset == 0) {
+        if (event->total_data_len == 0) {
+            if (wificonfig_json_dump (config_result, sizeof(config_result)) < 0) {
+                ESP_LOGE(TAG, "config: values too long to publish");
+                return;
+            }
+            publish_string ("CONFIG", config_result);
+            return;
+        }
+        if (wificonfig_json_begin (&config_doc, config_result, sizeof(config_result), false) != ESP_OK) {
+            publish_string ("CONFIG", "{\"errors\":[{\"key\":\"\",\"error\":\"busy\"}],\"ok\":false}");
+            return;
+        }
+        config_streaming = true;
+    } else if (!config_streaming) {
+        return;
+    }
+
+    wificonfig_json_feed (&config_doc, event->data, event->data_len);
+    if (event->current_data_offset + event->data_len < event->total_data_len) {
+        return;
+    }
+    config_streaming = false;
+    bool ok = (wificonfig_json_end (&config_doc) == ESP_OK);
+    if (ok) {
+        journal_record (JOURNAL_CONFIG, 1, 0);
+    }
+    publish_string ("CONFIG", config_result);
+}
+
+// the connection dropped part way through a message
+//
+static void config_abandon (void) {
+    if (config_streaming) {
+        config_streaming = false;
+        wificonfig_json_end (&config_doc);
+    }
+}
+
+// If an alarm was active when we last went down, pick up its cooldown
+// where it left off rather than letting a reset clear it.
+//
+static void restore_alarm (void) {
+    uint8_t type;
+    uint32_t elapsed_ms;
+
+    if (!journal_active_alarm (&type, &elapsed_ms)) {
+        return;
+    }
+    if (elapsed_ms / 1000 >= wificonfig_watchdog_active->cooldown_s) {
+        ESP_LOGI(TAG, "Alarm from before reset has cooled down");
+        journal_record (JOURNAL_ALARM_CLEAR, 0, 0);
+        return;
+    }
+    ESP_LOGI(TAG, "Restoring alarm %d, %u s into cooldown", type, elapsed_ms / 1000);
+    alarm_state = 1;
+    alarm_type = type;
+    deadline_after (&cooldown_deadline, deadline_expired, wificonfig_watchdog_active->cooldown_s - elapsed_ms / 1000);
+    journal_record (JOURNAL_ALARM, type, elapsed_ms);
+}
+
 void app_main(void) {
     TaskHandle_t xBlinkHandle = NULL;
 
     initialize_pins();
+    boot_mark (BOOT_PINS);
     initialize_timer();
+    boot_mark (BOOT_TIMER);
+    deadline_events = xEventGroupCreate();
+    deadline_init();
+    lease_init (lease_expired);
+    journal_init();
+    stats_init();
 
     // tasks related to wifi-based configuration
     xTaskCreate(&strobe_leds, "strobe_leds", 4096, NULL, 5, &xBlinkHandle);
-    wificonfig();
+    esp_err_t config_err = wificonfig();
     if (xBlinkHandle != NULL) {
         vTaskDelete (xBlinkHandle);
         gpio_set_level(GPIO_OUTPUT_CONNECTED_LED, 0);
         gpio_set_level(GPIO_OUTPUT_ACCESS_LED, 0);
         gpio_set_level(GPIO_OUTPUT_SENSE_LED, 0);
     }
-    load_aps();
-    if (ap_count == 0) {
-        // if no valid ssids -> go back to config mode
-        ESP_LOGI (TAG, "Whoa! No ssids configured");
+    boot_mark (BOOT_CONFIG);
+    wifimgr_init();
+    if ((config_err != ESP_OK) || (wifimgr_ap_count() == 0)) {
+        // invalid config or no valid ssids -> config mode, once the web
+        // server is up; meanwhile the watchdog runs on the defaults
+        ESP_LOGI (TAG, "Whoa! No valid config or no ssids configured");
+        journal_record (JOURNAL_CONFIG, 0, 0);
         trigger_wificonfig();
     }
     xTaskCreate(&check_gpio0, "check_gpio0", 4096, NULL, 5, NULL);
 
+    wifi_event_group = xEventGroupCreate();
+    configure_current();
+    select_sensor();
+    initialize_fast_trip();
+    initialize_duty_window();
+    wificonfig_set_commit_cb (config_committed);
+    restore_alarm();
+    wificonfig_register_uri (&journal_uri);
+    wificonfig_register_uri (&stats_uri);
+    wificonfig_register_config_uri (&ota_uri);
+    live_init (live_read);
+    wificonfig_register_uri (&live_uri);
+
+#ifdef CONFIG_WATCHDOG_FAST_START
+    // Protect the compressor as soon as the configuration is known;
+    // networking comes up behind the safety loops.
+    //
+    xTaskCreate(&watchdog_main_loop, "watchdog_main_loop", 4096, NULL, 5, NULL);
+    xTaskCreate(&dutycycle_loop, "dutycycle_loop", 4096, NULL, 5, NULL);
+    boot_mark (BOOT_LOOPS);
+
+    ESP_ERROR_CHECK( esp_event_loop_create_default() );
+    initialize_valve();
+    initialize_ota();
+    initialize_wifi();
+    wificonfig_start_server();
+    xTaskCreate(&mqtt_start_task, "mqtt_start", 4096, NULL, 5, NULL);
+#else
     ESP_ERROR_CHECK( esp_event_loop_create_default() );
+    initialize_valve();
+    initialize_ota();
     initialize_wifi();
+    wificonfig_start_server();
     initialize_mqtt();
 
-    // point to sensor in use
-    switch (wificonfig_vals_watchdog.sensor) {
-        case 0:
-            sensor_ring = amplitude_ring0;
-            break;
-        case 1:
-            sensor_ring = amplitude_ring1;
-            break;
-        case 2:
-            sensor_ring = amplitude_ring2;
-            break;
-        case 3:
-            sensor_ring = amplitude_ring3;
-            break;
-    }
-
     xTaskCreate(&watchdog_main_loop, "watchdog_main_loop", 4096, NULL, 5, NULL);
     xTaskCreate(&dutycycle_loop, "dutycycle_loop", 4096, NULL, 5, NULL);
+    boot_mark (BOOT_LOOPS);
 
     if ((mqtt_client != NULL) && (wificonfig_vals_mqtt.update != 0)) {
-        xTaskCreate(&update_loop, "update_loop", 4096, NULL, 5, NULL);
+        xTaskCreate(&update_loop, "update_loop", 4096, NULL, 5, &update_task);
     }
+#endif
 }
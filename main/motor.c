@@ -0,0 +1,90 @@
+/*
+ * motor
+ *
+ * The running/off decision uses the raw cycle amplitude, so starts are
+ * seen on the first cycle. Loaded/unloaded uses an exponential average
+ * (1/8 weight per cycle) and must hold for MOTOR_SETTLE_CYCLES before the
+ * state changes, so ripple near the unload level doesn't flap the state.
+ * Everything is integer arithmetic: no floating point in an ISR.
+ */
+#include "esp_attr.h"
+
+#include "motor.h"
+
+#define MOTOR_OFF_CYCLES     3   // cycles below run_level before we call it off
+#define MOTOR_SETTLE_CYCLES  30  // half a second
+
+static const char *state_names[MOTOR_NUM_STATES] = {
+    "off", "inrush", "loaded", "unloaded"
+};
+
+static volatile int run_level = 0x7fffffff;
+static volatile int unload_level = 0;
+static volatile int inrush_cycles = 0;
+
+static volatile enum motor_state_t state = MOTOR_OFF;
+static int avg8 = 0;        // average amplitude * 8
+static int count = 0;       // cycles left in inrush
+static int off_count = 0;
+static int settle = 0;
+
+void motor_configure (int run, int unload, int inrush) {
+    unload_level = unload;
+    inrush_cycles = inrush;
+    run_level = run;
+}
+
+static enum motor_state_t IRAM_ATTR classify (void) {
+    return ((unload_level > 0) && ((avg8 >> 3) < unload_level)) ? MOTOR_UNLOADED : MOTOR_LOADED;
+}
+
+void IRAM_ATTR motor_cycle (int amplitude) {
+    avg8 += amplitude - (avg8 >> 3);
+
+    switch (state) {
+        case MOTOR_OFF:
+            if (amplitude >= run_level) {
+                state = MOTOR_INRUSH;
+                count = inrush_cycles;
+                off_count = 0;
+            }
+            break;
+
+        case MOTOR_INRUSH:
+            if (amplitude < run_level) {
+                state = MOTOR_OFF;
+            } else if (--count <= 0) {
+                // start the average afresh, without the inrush peak
+                avg8 = amplitude << 3;
+                state = classify ();
+                settle = 0;
+            }
+            break;
+
+        default:
+            if (amplitude < run_level) {
+                if (++off_count >= MOTOR_OFF_CYCLES) {
+                    state = MOTOR_OFF;
+                }
+                break;
+            }
+            off_count = 0;
+            if (classify () != state) {
+                if (++settle >= MOTOR_SETTLE_CYCLES) {
+                    state = classify ();
+                    settle = 0;
+                }
+            } else {
+                settle = 0;
+            }
+            break;
+    }
+}
+
+enum motor_state_t motor_state (void) {
+    return state;
+}
+
+const char *motor_state_name (enum motor_state_t s) {
+    return (s < MOTOR_NUM_STATES) ? state_names[s] : "unknown";
+}
@@ -0,0 +1,29 @@
+/*
+ * motor
+ *
+ * Classifies the compressor motor from the per-cycle current amplitude:
+ * off, starting (inrush), running loaded, or running unloaded (idling, or
+ * a broken belt). motor_cycle is a fixed-cost state machine run by the
+ * sampling ISR once per AC cycle.
+ */
+#include <stdbool.h>
+
+enum motor_state_t {
+    MOTOR_OFF = 0,
+    MOTOR_INRUSH,
+    MOTOR_LOADED,
+    MOTOR_UNLOADED,
+    MOTOR_NUM_STATES
+};
+
+// run_level: amplitude at which the motor counts as running
+// unload_level: running below this counts as unloaded (0 -> never)
+// inrush_cycles: cycles after a start that count as inrush
+extern void motor_configure (int run_level, int unload_level, int inrush_cycles);
+
+// feed one cycle's amplitude; ISR-safe
+extern void motor_cycle (int amplitude);
+
+extern enum motor_state_t motor_state (void);
+
+extern const char *motor_state_name (enum motor_state_t state);
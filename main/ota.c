@@ -0,0 +1,372 @@
+/*
+ * ota
+ *
+ * Both ways in share one session: the image goes to esp_ota_write as it
+ * arrives, through a single fixed buffer, so only one update can run at
+ * a time. The push handler runs in the web server's task and the pull in
+ * a task of its own below the watchdog loops' priority; the sampling
+ * ISR runs from IRAM, so it carries on while flash is being written.
+ *
+ * Trial runs need CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE; without it new
+ * firmware is never pending verification and ota_health does nothing.
+ */
+#include <string.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_app_format.h"
+#include "esp_http_client.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "ota.h"
+
+#define OTA_CHUNK       1024
+#define OTA_DESC_END    (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t))
+#define OTA_RESTART_MS  2000    // after success, so the result can go out
+
+ESP_EVENT_DEFINE_BASE(OTA_EVENT);
+
+extern const char *TAG;
+
+static const char *state_names[] = {
+    "started", "done", "failed", "valid", "rollback"
+};
+
+const char *ota_state_name (int32_t event_id) {
+    return ((event_id >= 0) && (event_id < sizeof(state_names) / sizeof(state_names[0]))) ?
+           state_names[event_id] : "unknown";
+}
+
+struct ota_session {
+    esp_ota_handle_t handle;
+    const esp_partition_t *partition;
+    uint32_t bytes;
+    bool checked;           // the new image's description has been checked
+    char version[32];
+};
+
+static portMUX_TYPE ota_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool busy = false;
+static char chunk[OTA_CHUNK];
+static char pull_url[128];
+
+static uint8_t health = OTA_HEALTH_ALL;     // all passed unless on trial
+static esp_timer_handle_t health_timer = NULL;
+
+static bool claim (void) {
+    bool claimed = false;
+
+    portENTER_CRITICAL (&ota_mux);
+    if (!busy) {
+        busy = claimed = true;
+    }
+    portEXIT_CRITICAL (&ota_mux);
+    return claimed;
+}
+
+static void release (void) {
+    portENTER_CRITICAL (&ota_mux);
+    busy = false;
+    portEXIT_CRITICAL (&ota_mux);
+}
+
+static void post (int32_t id, const struct ota_session *s, esp_err_t err) {
+    struct ota_event_data data = {
+        .err = err,
+        .bytes = s->bytes,
+    };
+    strncpy (data.version, s->version, sizeof(data.version) - 1);
+    esp_event_post (OTA_EVENT, id, &data, sizeof(data), 0);
+}
+
+static esp_err_t session_begin (struct ota_session *s, size_t size) {
+    memset (s, 0, sizeof(*s));
+    s->partition = esp_ota_get_next_update_partition (NULL);
+    if (s->partition == NULL) {
+        ESP_LOGE(TAG, "ota: no partition to update");
+        return ESP_ERR_NOT_FOUND;
+    }
+    if ((size != OTA_SIZE_UNKNOWN) && (size > s->partition->size)) {
+        ESP_LOGE(TAG, "ota: image of %u bytes won't fit in %u", size, s->partition->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+#ifdef OTA_WITH_SEQUENTIAL_WRITES
+    // erase a sector at a time as it's reached, not all up front
+    size = OTA_WITH_SEQUENTIAL_WRITES;
+#endif
+    esp_err_t err = esp_ota_begin (s->partition, size, &s->handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ota: begin failed: %s", esp_err_to_name (err));
+        return err;
+    }
+    ESP_LOGI(TAG, "ota: writing to %s at 0x%x", s->partition->label, s->partition->address);
+    post (OTA_EVENT_STARTED, s, ESP_OK);
+    return ESP_OK;
+}
+
+// Once the image header is in, check its description: refuse an image
+// that has already failed its health check here, since it would only be
+// rolled back again.
+//
+static esp_err_t check_description (struct ota_session *s) {
+    esp_app_desc_t desc;
+    const esp_partition_t *invalid = esp_ota_get_last_invalid_partition ();
+    esp_app_desc_t invalid_desc;
+
+    s->checked = true;
+    if (esp_ota_get_partition_description (s->partition, &desc) != ESP_OK) {
+        ESP_LOGE(TAG, "ota: not an app image");
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    strncpy (s->version, desc.version, sizeof(s->version) - 1);
+    ESP_LOGI(TAG, "ota: new version %s, running %s", s->version, esp_ota_get_app_description ()->version);
+    if ((invalid != NULL) && (esp_ota_get_partition_description (invalid, &invalid_desc) == ESP_OK) &&
+        (strcmp (invalid_desc.version, desc.version) == 0)) {
+        ESP_LOGE(TAG, "ota: version %s was rolled back before", s->version);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t session_write (struct ota_session *s, const char *data, size_t len) {
+    esp_err_t err = esp_ota_write (s->handle, data, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ota: write failed at %u: %s", s->bytes, esp_err_to_name (err));
+        return err;
+    }
+    s->bytes += len;
+    if (!s->checked && (s->bytes >= OTA_DESC_END)) {
+        return check_description (s);
+    }
+    return ESP_OK;
+}
+
+// Finish the update, or abandon it if err is set: either way the running
+// firmware is untouched until the new image is verified and set to boot.
+//
+static esp_err_t session_end (struct ota_session *s, esp_err_t err) {
+    if (err == ESP_OK) {
+        // esp_ota_end checks the image's checksum and hash
+        if ((err = esp_ota_end (s->handle)) == ESP_OK) {
+            err = esp_ota_set_boot_partition (s->partition);
+        }
+    } else {
+        esp_ota_abort (s->handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ota: failed after %u bytes: %s", s->bytes, esp_err_to_name (err));
+        post (OTA_EVENT_FAILED, s, err);
+        return err;
+    }
+    ESP_LOGI(TAG, "ota: %u bytes written, version %s will boot next", s->bytes, s->version);
+    post (OTA_EVENT_DONE, s, ESP_OK);
+    return ESP_OK;
+}
+
+// read the response body into the session
+//
+static esp_err_t pull_body (esp_http_client_handle_t client, struct ota_session *s) {
+    esp_err_t err = ESP_OK;
+    int len;
+
+    while ((err == ESP_OK) && ((len = esp_http_client_read (client, chunk, sizeof(chunk))) > 0)) {
+        err = session_write (s, chunk, len);
+    }
+    if ((err == ESP_OK) && ((len < 0) || !esp_http_client_is_complete_data_received (client))) {
+        ESP_LOGE(TAG, "ota: download cut short");
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    return session_end (s, err);
+}
+
+static void pull_task (void *pvParameters) {
+    static struct ota_session s;
+    esp_http_client_config_t config = {
+        .url = pull_url,
+        .timeout_ms = 10000,
+    };
+    esp_http_client_handle_t client;
+    esp_err_t err;
+    bool reported = false;  // session_end has posted the outcome
+
+    ESP_LOGI(TAG, "ota: fetching %s", pull_url);
+    memset (&s, 0, sizeof(s));
+    client = esp_http_client_init (&config);
+    err = (client != NULL) ? esp_http_client_open (client, 0) : ESP_ERR_NO_MEM;
+    if (err == ESP_OK) {
+        int size = esp_http_client_fetch_headers (client);
+        int status = esp_http_client_get_status_code (client);
+        if (status != 200) {
+            ESP_LOGE(TAG, "ota: HTTP status %d", status);
+            err = ESP_ERR_INVALID_RESPONSE;
+        } else if ((err = session_begin (&s, (size > 0) ? size : OTA_SIZE_UNKNOWN)) == ESP_OK) {
+            err = pull_body (client, &s);
+            reported = true;
+        }
+    } else {
+        ESP_LOGE(TAG, "ota: unable to connect: %s", esp_err_to_name (err));
+    }
+    if (client != NULL) {
+        esp_http_client_close (client);
+        esp_http_client_cleanup (client);
+    }
+    if (err != ESP_OK) {
+        if (!reported) {
+            post (OTA_EVENT_FAILED, &s, err);
+        }
+        release ();
+        vTaskDelete (NULL);
+    }
+    vTaskDelay (OTA_RESTART_MS / portTICK_RATE_MS);
+    esp_restart ();
+}
+
+esp_err_t ota_pull (const char *url, int url_len) {
+#ifndef CONFIG_SECURE_SIGNED_ON_UPDATE
+    // nothing checks who built an unsigned image, so only take one from
+    // the URL fixed at build time
+    if (url_len > 0) {
+        ESP_LOGW(TAG, "ota: images aren't signed, ignoring URL and using CONFIG_WATCHDOG_OTA_URL");
+        url_len = 0;
+    }
+#endif
+    if (url_len == 0) {
+        url = CONFIG_WATCHDOG_OTA_URL;
+        url_len = strlen (url);
+    }
+    if ((url_len == 0) || (url_len >= sizeof(pull_url))) {
+        ESP_LOGE(TAG, "ota: no URL, or URL too long");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!claim ()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memcpy (pull_url, url, url_len);
+    pull_url[url_len] = '\0';
+    // below the watchdog loops, so a slow download can't hold them up
+    if (xTaskCreate (&pull_task, "ota_pull", 4096, NULL, 4, NULL) != pdPASS) {
+        release ();
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t ota_post_handler (httpd_req_t *req) {
+    static struct ota_session s;
+    size_t remaining = req->content_len;
+    esp_err_t err;
+    char result[96];
+
+    ESP_LOGI(TAG, "ota: push of %u bytes", req->content_len);
+    httpd_resp_set_type (req, "application/json");
+    if (!claim ()) {
+        httpd_resp_set_status (req, "409 Conflict");
+        httpd_resp_send (req, "{\"ok\":false,\"error\":\"busy\"}", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    err = session_begin (&s, remaining);
+    if (err == ESP_OK) {
+        while ((err == ESP_OK) && (remaining > 0)) {
+            int len = httpd_req_recv (req, chunk, MIN(remaining, sizeof(chunk)));
+            if (len == HTTPD_SOCK_ERR_TIMEOUT) {
+                continue;
+            }
+            if (len <= 0) {
+                // the connection is gone, so there is no one to answer
+                session_end (&s, ESP_FAIL);
+                release ();
+                return ESP_FAIL;
+            }
+            err = session_write (&s, chunk, len);
+            remaining -= len;
+        }
+        err = session_end (&s, err);
+    } else {
+        post (OTA_EVENT_FAILED, &s, err);
+    }
+
+    if (err != ESP_OK) {
+        snprintf (result, sizeof(result), "{\"ok\":false,\"error\":\"%s\",\"bytes\":%u}", esp_err_to_name (err), s.bytes);
+        httpd_resp_set_status (req, HTTPD_400);
+        httpd_resp_send (req, result, HTTPD_RESP_USE_STRLEN);
+        release ();
+        return ESP_OK;
+    }
+    snprintf (result, sizeof(result), "{\"ok\":true,\"version\":\"%s\",\"bytes\":%u}", s.version, s.bytes);
+    httpd_resp_send (req, result, HTTPD_RESP_USE_STRLEN);
+    vTaskDelay (OTA_RESTART_MS / portTICK_RATE_MS);
+    esp_restart ();
+    return ESP_OK;
+}
+
+const httpd_uri_t ota_uri = {
+    .uri       = "/ota",
+    .method    = HTTP_POST,
+    .handler   = ota_post_handler,
+    .user_ctx  = NULL
+};
+
+// The trial ran out before every part of the health check passed. A
+// reset would roll back too, but this way the journal says why.
+//
+static void rollback_task (void *arg) {
+    struct ota_session s = { .bytes = 0 };
+
+    ESP_LOGE(TAG, "ota: health check failed (0x%x passed), rolling back", health);
+    strncpy (s.version, esp_ota_get_app_description ()->version, sizeof(s.version) - 1);
+    post (OTA_EVENT_ROLLBACK, &s, ESP_OK);
+    // let the event be recorded; nothing else matters now
+    vTaskDelay (1000 / portTICK_RATE_MS);
+    esp_ota_mark_app_invalid_rollback_and_reboot ();
+    vTaskDelete (NULL);
+}
+
+// on the esp_timer task, which mustn't block
+static void health_timeout_cb (void *arg) {
+    if (xTaskCreate (&rollback_task, "ota_rollback", 3072, NULL, 5, NULL) != pdPASS) {
+        esp_ota_mark_app_invalid_rollback_and_reboot ();
+    }
+}
+
+void ota_init (void) {
+    esp_ota_img_states_t state;
+    const esp_partition_t *running = esp_ota_get_running_partition ();
+
+    ESP_LOGI(TAG, "ota: running %s from %s", esp_ota_get_app_description ()->version, running->label);
+    if ((esp_ota_get_state_partition (running, &state) != ESP_OK) || (state != ESP_OTA_IMG_PENDING_VERIFY)) {
+        return;
+    }
+    ESP_LOGW(TAG, "ota: new firmware on trial for %d s", CONFIG_WATCHDOG_OTA_HEALTH_TIMEOUT);
+    const esp_timer_create_args_t timer_args = {
+        .callback = &health_timeout_cb,
+        .name = "ota_health",
+    };
+    ESP_ERROR_CHECK( esp_timer_create (&timer_args, &health_timer) );
+    health = 0;
+    esp_timer_start_once (health_timer, CONFIG_WATCHDOG_OTA_HEALTH_TIMEOUT * 1000000LL);
+}
+
+void ota_health (uint8_t bits) {
+    bool passed = false;
+
+    if ((health & bits) == bits) {
+        return;
+    }
+    portENTER_CRITICAL (&ota_mux);
+    if (health != OTA_HEALTH_ALL) {
+        health |= bits;
+        passed = (health == OTA_HEALTH_ALL);
+    }
+    portEXIT_CRITICAL (&ota_mux);
+    if (passed) {
+        struct ota_session s = { .bytes = 0 };
+        esp_timer_stop (health_timer);
+        esp_ota_mark_app_valid_cancel_rollback ();
+        ESP_LOGI(TAG, "ota: health check passed, new firmware kept");
+        strncpy (s.version, esp_ota_get_app_description ()->version, sizeof(s.version) - 1);
+        post (OTA_EVENT_VALID, &s, ESP_OK);
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * ota
+ *
+ * Firmware updates over HTTP, pushed to POST /ota or pulled from a URL.
+ * The image is streamed into the inactive OTA partition a chunk at a
+ * time as it arrives, verified, and booted. New firmware runs on trial:
+ * unless it reports itself healthy (the watchdog loops running and the
+ * network up) within CONFIG_WATCHDOG_OTA_HEALTH_TIMEOUT, or if it resets
+ * first, the bootloader goes back to the previous firmware. Progress is
+ * posted as OTA_EVENT events on the default event loop.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_http_server.h"
+
+ESP_EVENT_DECLARE_BASE(OTA_EVENT);
+
+enum ota_event_t {
+    OTA_EVENT_STARTED = 0,  // writing a new image
+    OTA_EVENT_DONE,         // verified and set to boot; restarting shortly
+    OTA_EVENT_FAILED,       // err says why; the running firmware carries on
+    OTA_EVENT_VALID,        // this firmware passed its health check
+    OTA_EVENT_ROLLBACK,     // this firmware failed its health check; restarting
+};
+
+struct ota_event_data {
+    int32_t err;            // esp_err_t for OTA_EVENT_FAILED
+    uint32_t bytes;         // image bytes written
+    char version[32];       // of the new image, where known
+};
+
+// what has to be reported for new firmware to pass its health check
+#define OTA_HEALTH_LOOPS    0x01    // the watchdog main loop has run
+#define OTA_HEALTH_NETWORK  0x02    // MQTT connected (WiFi, with no MQTT)
+#define OTA_HEALTH_ALL      (OTA_HEALTH_LOOPS | OTA_HEALTH_NETWORK)
+
+// check whether this firmware is on trial; call once the default event
+// loop exists
+extern void ota_init (void);
+
+// report part of the health check passed; cheap once it has all passed
+extern void ota_health (uint8_t bits);
+
+// fetch and install the image at CONFIG_WATCHDOG_OTA_URL, in a task of
+// its own; url replaces it only when app images are signed
+extern esp_err_t ota_pull (const char *url, int url_len);
+
+// POST /ota with the image as the body; config mode only
+extern const httpd_uri_t ota_uri;
+
+extern const char *ota_state_name (int32_t event_id);
@@ -0,0 +1,70 @@
+/*
+ * outbox
+ *
+ * A ring of OUTBOX_SIZE events; recording never allocates or blocks, and
+ * when the ring is full the oldest event is overwritten and counted.
+ */
+#include <string.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#include "outbox.h"
+
+#define OUTBOX_SIZE CONFIG_WATCHDOG_OUTBOX_SIZE
+
+static struct outbox_event ring[OUTBOX_SIZE];
+static int head = 0;     // oldest event
+static int count = 0;
+static uint32_t seq = 0;
+static uint32_t overflows = 0;
+
+static portMUX_TYPE outbox_mux = portMUX_INITIALIZER_UNLOCKED;
+
+uint32_t outbox_record (const char *subtopic, int32_t val) {
+    uint32_t now = esp_timer_get_time () / 1000;
+    uint32_t s;
+
+    portENTER_CRITICAL(&outbox_mux);
+    if (count == OUTBOX_SIZE) {
+        head = (head + 1) % OUTBOX_SIZE;
+        count--;
+        overflows++;
+    }
+    struct outbox_event *e = &ring[(head + count) % OUTBOX_SIZE];
+    s = ++seq;
+    e->seq = s;
+    e->time_ms = now;
+    e->subtopic = subtopic;
+    e->val = val;
+    count++;
+    portEXIT_CRITICAL(&outbox_mux);
+    return s;
+}
+
+int outbox_peek (struct outbox_event *events, int max) {
+    int n;
+    portENTER_CRITICAL(&outbox_mux);
+    n = (count < max) ? count : max;
+    for (int i = 0; i < n; i++) {
+        events[i] = ring[(head + i) % OUTBOX_SIZE];
+    }
+    portEXIT_CRITICAL(&outbox_mux);
+    return n;
+}
+
+void outbox_drop_through (uint32_t last_seq) {
+    portENTER_CRITICAL(&outbox_mux);
+    while ((count > 0) && ((int32_t)(ring[head].seq - last_seq) <= 0)) {
+        head = (head + 1) % OUTBOX_SIZE;
+        count--;
+    }
+    portEXIT_CRITICAL(&outbox_mux);
+}
+
+int outbox_pending (void) {
+    return count;
+}
+
+uint32_t outbox_overflows (void) {
+    return overflows;
+}
@@ -0,0 +1,29 @@
+/*
+ * outbox
+ *
+ * Fixed-size store for state transitions that happen while MQTT is
+ * disconnected, replayed in order once the connection returns.
+ */
+#include <stdint.h>
+
+struct outbox_event {
+    uint32_t seq;           // transition sequence number
+    uint32_t time_ms;       // esp_timer time of the transition
+    const char *subtopic;   // must be a string literal
+    int32_t val;
+};
+
+// store a transition and return its sequence number; the oldest event is
+// dropped if the outbox is full
+extern uint32_t outbox_record (const char *subtopic, int32_t val);
+
+// copy up to max of the oldest events without removing them
+extern int outbox_peek (struct outbox_event *events, int max);
+
+// remove events up to and including last_seq (once they are published)
+extern void outbox_drop_through (uint32_t last_seq);
+
+extern int outbox_pending (void);
+
+// events lost because the outbox was full
+extern uint32_t outbox_overflows (void);
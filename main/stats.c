@@ -0,0 +1,233 @@
+/*
+ * stats
+ *
+ * The main loop feeds samples into the record for the current hour of
+ * uptime, which is kept in RTC memory so a reset doesn't lose it. When
+ * the hour rolls over the record is queued, and stats_poll writes it to
+ * the "stats" flashlog (see flashlog.h): one 16-byte write an hour.
+ *
+ * Export streams the log a few records at a time, so the whole history
+ * is never held in RAM. The binary format is an 8-byte header ("WDST",
+ * version, record size, two reserved bytes) followed by little-endian
+ * struct stats_hour records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "flashlog.h"
+#include "journal.h"
+#include "stats.h"
+
+#define STATS_MAGIC        0x54535457  // "WTST", marks the RTC copy valid; not the "WDST" export header
+#define STATS_VERSION      1
+#define STATS_CHUNK        16          // records per HTTP chunk
+#define STATS_CSV_LINE     64
+#define HOUR_MS            (60 * 60 * 1000)
+
+extern const char *TAG;
+
+struct stats_rtc {
+    uint32_t magic;
+    struct stats_hour cur;
+    uint32_t run_ms;
+    struct stats_hour done;     // finished hour waiting for stats_poll
+    bool done_valid;
+    uint32_t check;
+};
+
+static RTC_NOINIT_ATTR struct stats_rtc rtc;
+
+static struct flashlog flog;
+static bool have_flash = false;
+static uint32_t next_seq = 1;
+static SemaphoreHandle_t flash_mutex = NULL;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t last_sample = 0;
+static bool last_running = false;
+
+static uint32_t rtc_check (void) {
+    const uint8_t *p = (const uint8_t *) &rtc;
+    uint32_t sum = 5381;
+    for (int i = 0; i < offsetof(struct stats_rtc, check); i++) {
+        sum = (sum << 5) + sum + p[i];
+    }
+    return sum;
+}
+
+static void start_hour (uint16_t hour) {
+    memset (&rtc.cur, 0, sizeof(rtc.cur));
+    rtc.cur.boot = journal_boot ();
+    rtc.cur.hour = hour;
+    rtc.run_ms = 0;
+}
+
+static void write_hour (struct stats_hour *h) {
+    if (!have_flash) {
+        return;
+    }
+    xSemaphoreTake (flash_mutex, portMAX_DELAY);
+    h->seq = next_seq;
+    if (flashlog_append (&flog, h, 1) == 1) {
+        next_seq++;
+    }
+    xSemaphoreGive (flash_mutex);
+}
+
+void stats_init (void) {
+    struct stats_hour last;
+
+    flash_mutex = xSemaphoreCreateMutex ();
+    have_flash = (flashlog_open (&flog, "stats", sizeof(struct stats_hour)) == ESP_OK);
+    if (have_flash && flashlog_scan (&flog, &last)) {
+        next_seq = last.seq + 1;
+    }
+
+    // whatever the last boot had in progress goes to flash as a short hour
+    if ((rtc.magic == STATS_MAGIC) && (rtc.check == rtc_check ())) {
+        if (rtc.done_valid) {
+            write_hour (&rtc.done);
+        }
+        if (rtc.cur.minutes > 0) {
+            write_hour (&rtc.cur);
+        }
+    }
+
+    memset (&rtc, 0, sizeof(rtc));
+    rtc.magic = STATS_MAGIC;
+    start_hour (0);
+    rtc.check = rtc_check ();
+    last_sample = esp_timer_get_time ();
+}
+
+void stats_sample (bool running, int amplitude) {
+    int64_t now = esp_timer_get_time ();
+    uint16_t hour = now / (HOUR_MS * 1000LL);
+    uint32_t ms_into_hour = (now / 1000) % HOUR_MS;
+
+    portENTER_CRITICAL (&stats_lock);
+    if (hour != rtc.cur.hour) {
+        rtc.done = rtc.cur;
+        rtc.done_valid = true;
+        start_hour (hour);
+    }
+    if (last_running) {
+        rtc.run_ms += (now - last_sample) / 1000;
+        rtc.cur.run_s = rtc.run_ms / 1000;
+    }
+    if (running && !last_running) {
+        rtc.cur.starts++;
+    }
+    if (amplitude > rtc.cur.peak) {
+        rtc.cur.peak = (amplitude > 0xffff) ? 0xffff : amplitude;
+    }
+    rtc.cur.minutes = ms_into_hour / 60000 + 1;
+    rtc.check = rtc_check ();
+    portEXIT_CRITICAL (&stats_lock);
+
+    last_sample = now;
+    last_running = running;
+}
+
+void stats_alarm (void) {
+    portENTER_CRITICAL (&stats_lock);
+    if (rtc.cur.alarms < 0xff) {
+        rtc.cur.alarms++;
+    }
+    rtc.check = rtc_check ();
+    portEXIT_CRITICAL (&stats_lock);
+}
+
+void stats_poll (void) {
+    struct stats_hour done;
+    bool have_done;
+
+    portENTER_CRITICAL (&stats_lock);
+    have_done = rtc.done_valid;
+    done = rtc.done;
+    portEXIT_CRITICAL (&stats_lock);
+
+    if (have_done) {
+        write_hour (&done);
+        portENTER_CRITICAL (&stats_lock);
+        rtc.done_valid = false;
+        rtc.check = rtc_check ();
+        portEXIT_CRITICAL (&stats_lock);
+    }
+}
+
+static int format_hours (char *buf, struct stats_hour *h, int n, bool binary) {
+    if (binary) {
+        memcpy (buf, h, n * sizeof(*h));
+        return n * sizeof(*h);
+    }
+    int len = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned duty = (h[i].minutes > 0) ? (h[i].run_s * 100) / (h[i].minutes * 60) : 0;
+        len += sprintf (buf + len, "%u,%u,%u,%u,%u,%u,%u,%u,%u\n",
+                        h[i].seq, h[i].boot, h[i].hour, h[i].minutes, h[i].run_s,
+                        h[i].starts, duty, h[i].peak, h[i].alarms);
+    }
+    return len;
+}
+
+esp_err_t stats_send (httpd_req_t *req, bool binary) {
+    struct stats_hour h[STATS_CHUNK];
+    char *buf = malloc (STATS_CHUNK * STATS_CSV_LINE);
+    int n = 0;
+
+    if (buf == NULL) {
+        httpd_resp_send_500 (req);
+        return ESP_FAIL;
+    }
+
+    if (binary) {
+        uint8_t header[8] = { 'W', 'D', 'S', 'T', STATS_VERSION, sizeof(struct stats_hour), 0, 0 };
+        httpd_resp_set_type (req, "application/octet-stream");
+        httpd_resp_send_chunk (req, (char *) header, sizeof(header));
+    } else {
+        httpd_resp_set_type (req, "text/csv");
+        httpd_resp_sendstr_chunk (req, "seq,boot,hour,minutes,run_s,starts,duty_pct,peak,alarms\n");
+    }
+
+    if (have_flash) {
+        xSemaphoreTake (flash_mutex, portMAX_DELAY);
+        uint32_t slot = flashlog_oldest (&flog);
+        uint32_t remaining = (flog.pos + flog.slots - slot) % flog.slots;
+        xSemaphoreGive (flash_mutex);
+        if (remaining == 0) {
+            remaining = flog.slots;
+        }
+
+        while (remaining > 0) {
+            xSemaphoreTake (flash_mutex, portMAX_DELAY);
+            for (n = 0; (n < STATS_CHUNK) && (remaining > 0); remaining--) {
+                if (flashlog_read (&flog, slot, &h[n])) {
+                    n++;
+                }
+                slot = (slot + 1) % flog.slots;
+            }
+            xSemaphoreGive (flash_mutex);
+            if ((n > 0) && (httpd_resp_send_chunk (req, buf, format_hours (buf, h, n, binary)) != ESP_OK)) {
+                free (buf);
+                return ESP_FAIL;
+            }
+        }
+    }
+
+    // the hour in progress, numbered as it will be when it is written
+    portENTER_CRITICAL (&stats_lock);
+    h[0] = rtc.cur;
+    portEXIT_CRITICAL (&stats_lock);
+    h[0].seq = next_seq;
+    httpd_resp_send_chunk (req, buf, format_hours (buf, h, 1, binary));
+
+    free (buf);
+    return httpd_resp_send_chunk (req, NULL, 0);
+}
@@ -0,0 +1,35 @@
+/*
+ * stats
+ *
+ * Long-term usage statistics: one record per hour of uptime, kept in a
+ * circular log in the "stats" flash partition (about 170 days).
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include <esp_http_server.h>
+
+struct stats_hour {
+    uint32_t seq;
+    uint16_t boot;      // boot count (see journal)
+    uint16_t hour;      // hours since that boot
+    uint16_t run_s;     // seconds running
+    uint16_t starts;
+    uint16_t peak;      // peak sensor amplitude
+    uint8_t alarms;
+    uint8_t minutes;    // minutes covered; < 60 if a reset cut the hour short
+};
+
+// open the partition and save the hour the last reset interrupted
+extern void stats_init (void);
+
+// account for the time since the last sample; called from the main loop
+extern void stats_sample (bool running, int amplitude);
+
+extern void stats_alarm (void);
+
+// write finished hours to flash; call at least once a minute
+extern void stats_poll (void);
+
+// stream all hours, oldest first, as CSV or binary
+extern esp_err_t stats_send (httpd_req_t *req, bool binary);
@@ -0,0 +1,189 @@
+/*
+ * timerwheel
+ *
+ * A timer goes on the lowest level whose turn covers its delay, in the
+ * slot for its expiry. Each time the level below completes a turn, the
+ * next slot of a level is emptied and its timers re-added, which puts
+ * them a level (or more) lower. Delays beyond the top level's turn go in
+ * its furthest slot and are re-added from there until they fit.
+ */
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define MASK       (TIMERWHEEL_SLOTS - 1)
+#define SHIFT(l)   ((l) * TIMERWHEEL_BITS)
+#define SPAN(l)    (1u << SHIFT(l))     // ticks per slot on level l
+
+void timerwheel_init (struct timerwheel *wheel, uint32_t now) {
+    memset (wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+static void link_timer (struct timerwheel_timer **list, struct timerwheel_timer *timer) {
+    timer->next = *list;
+    if (timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = list;
+    *list = timer;
+}
+
+static void unlink_timer (struct timerwheel *wheel, struct timerwheel_timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    if (timer->level >= 0) {
+        wheel->count[timer->level]--;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void place (struct timerwheel *wheel, struct timerwheel_timer *timer) {
+    uint32_t at = timer->expires;
+    uint32_t delta = at - wheel->now;
+    int level = 0;
+
+    if ((int32_t) delta < 0) {
+        at = wheel->now;
+        delta = 0;
+    }
+    while ((level < TIMERWHEEL_LEVELS - 1) && (delta >= SPAN(level + 1))) {
+        level++;
+    }
+    if (delta >= SPAN(TIMERWHEEL_LEVELS)) {
+        at = wheel->now + SPAN(TIMERWHEEL_LEVELS) - 1;
+    }
+    timer->level = level;
+    link_timer (&wheel->slots[level][(at >> SHIFT(level)) & MASK], timer);
+    wheel->count[level]++;
+}
+
+void timerwheel_add (struct timerwheel *wheel, struct timerwheel_timer *timer, uint32_t expires) {
+    if (timer->pprev != NULL) {
+        unlink_timer (wheel, timer);
+    }
+    if ((int32_t) (expires - wheel->now) <= 0) {
+        expires = wheel->now + 1;
+    }
+    timer->expires = expires;
+    place (wheel, timer);
+}
+
+void timerwheel_cancel (struct timerwheel *wheel, struct timerwheel_timer *timer) {
+    if (timer->pprev != NULL) {
+        unlink_timer (wheel, timer);
+    }
+}
+
+bool timerwheel_running (const struct timerwheel_timer *timer) {
+    return (timer->pprev != NULL);
+}
+
+// re-add every timer in a slot, relative to the current tick
+//
+static void cascade (struct timerwheel *wheel, int level, int slot) {
+    struct timerwheel_timer *list = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = NULL;
+    while (list != NULL) {
+        struct timerwheel_timer *timer = list;
+        list = timer->next;
+        wheel->count[level]--;
+        place (wheel, timer);
+    }
+}
+
+static void tick (struct timerwheel *wheel) {
+    uint32_t now = ++wheel->now;
+
+    // each level whose turn below is complete brings its next slot down
+    for (int level = 1; level < TIMERWHEEL_LEVELS; level++) {
+        if ((now & (SPAN(level) - 1)) != 0) {
+            break;
+        }
+        cascade (wheel, level, (now >> SHIFT(level)) & MASK);
+    }
+
+    // every timer left in this level 0 slot expires now
+    struct timerwheel_timer **slot = &wheel->slots[0][now & MASK];
+    while (*slot != NULL) {
+        struct timerwheel_timer *timer = *slot;
+        unlink_timer (wheel, timer);
+        timer->level = -1;
+        link_timer (&wheel->expired, timer);
+    }
+}
+
+void timerwheel_advance (struct timerwheel *wheel, uint32_t now) {
+    while ((int32_t) (now - wheel->now) > 0) {
+        // nothing to do until the next slot of the lowest busy level
+        // comes round, so skip straight to it
+        int level = 0;
+        while ((level < TIMERWHEEL_LEVELS) && (wheel->count[level] == 0)) {
+            level++;
+        }
+        if (level == TIMERWHEEL_LEVELS) {
+            wheel->now = now;
+            break;
+        }
+        if (level > 0) {
+            uint32_t next = (wheel->now | (SPAN(level) - 1)) + 1;
+            if ((int32_t) (now - next) < 0) {
+                wheel->now = now;
+                break;
+            }
+            wheel->now = next - 1;
+        }
+        tick (wheel);
+    }
+}
+
+struct timerwheel_timer *timerwheel_pop (struct timerwheel *wheel) {
+    struct timerwheel_timer *timer = wheel->expired;
+    if (timer != NULL) {
+        unlink_timer (wheel, timer);
+    }
+    return timer;
+}
+
+bool timerwheel_next (const struct timerwheel *wheel, uint32_t *expires) {
+    bool found = false;
+
+    if (wheel->expired != NULL) {
+        *expires = wheel->now;
+        return true;
+    }
+    for (int level = 0; level < TIMERWHEEL_LEVELS; level++) {
+        if (wheel->count[level] == 0) {
+            continue;
+        }
+        // the first busy slot after the current one holds the level's
+        // earliest timers (the current slot itself is a whole turn away)
+        uint32_t base = wheel->now >> SHIFT(level);
+        for (int i = 1; i <= TIMERWHEEL_SLOTS; i++) {
+            const struct timerwheel_timer *t = wheel->slots[level][(base + i) & MASK];
+            if (t == NULL) {
+                continue;
+            }
+            for (; t != NULL; t = t->next) {
+                if (!found || ((int32_t) (t->expires - *expires) < 0)) {
+                    *expires = t->expires;
+                    found = true;
+                }
+            }
+            break;
+        }
+    }
+    return found;
+}
+
+int timerwheel_count (const struct timerwheel *wheel) {
+    int n = 0;
+    for (int level = 0; level < TIMERWHEEL_LEVELS; level++) {
+        n += wheel->count[level];
+    }
+    return n;
+}
@@ -0,0 +1,53 @@
+/*
+ * timerwheel
+ *
+ * Hierarchical timer wheel: TIMERWHEEL_LEVELS wheels of TIMERWHEEL_SLOTS
+ * lists each, the first one tick per slot and each further one a whole
+ * turn of the one below per slot. Adding or cancelling a timer is O(1)
+ * however many are running, and a timer is touched once per level on its
+ * way down rather than on every tick. The caller supplies the ticks and
+ * any locking.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMERWHEEL_BITS   6
+#define TIMERWHEEL_SLOTS  (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_LEVELS 3     // 64 s, 68 min and 3 days at 1 s per tick
+
+struct timerwheel_timer {
+    struct timerwheel_timer *next;
+    struct timerwheel_timer **pprev;    // NULL when not running
+    uint32_t expires;                   // tick
+    int8_t level;                       // -1: on the expired queue
+    void (*callback) (struct timerwheel_timer *timer);
+};
+
+struct timerwheel {
+    struct timerwheel_timer *slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+    struct timerwheel_timer *expired;   // due, waiting for timerwheel_pop
+    int count[TIMERWHEEL_LEVELS];       // timers on each level
+    uint32_t now;                       // last tick processed
+};
+
+extern void timerwheel_init (struct timerwheel *wheel, uint32_t now);
+
+// (re)start timer to expire at tick expires; one already due expires on
+// the next tick
+extern void timerwheel_add (struct timerwheel *wheel, struct timerwheel_timer *timer, uint32_t expires);
+
+extern void timerwheel_cancel (struct timerwheel *wheel, struct timerwheel_timer *timer);
+
+extern bool timerwheel_running (const struct timerwheel_timer *timer);
+
+// process ticks up to now; timers that expire are queued for
+// timerwheel_pop, and count as running until popped
+extern void timerwheel_advance (struct timerwheel *wheel, uint32_t now);
+
+// take the next expired timer off the queue, or NULL
+extern struct timerwheel_timer *timerwheel_pop (struct timerwheel *wheel);
+
+// earliest tick a running timer expires at; false if there are none
+extern bool timerwheel_next (const struct timerwheel *wheel, uint32_t *expires);
+
+extern int timerwheel_count (const struct timerwheel *wheel);
@@ -0,0 +1,167 @@
+/*
+ * valve
+ *
+ * The feedback switches connect their input to the common (ground) wire,
+ * so inputs are pulled up and active low. The ISR only timestamps the
+ * edge and posts it; like wifimgr, all state is kept on the event loop
+ * task, with an esp_timer posting the travel timeout.
+ */
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "driver/gpio.h"
+
+#include "valve.h"
+
+ESP_EVENT_DEFINE_BASE(VALVE_EVENT);
+
+static const char *position_names[VALVE_NUM_POSITIONS] = {
+    "moving", "open", "closed", "fault"
+};
+
+const char *valve_position_name (uint8_t position) {
+    return (position < VALVE_NUM_POSITIONS) ? position_names[position] : "unknown";
+}
+
+#ifdef CONFIG_WATCHDOG_VALVE_FEEDBACK
+
+#define VALVE_OPEN_GPIO   CONFIG_WATCHDOG_VALVE_OPEN_GPIO
+#define VALVE_CLOSED_GPIO CONFIG_WATCHDOG_VALVE_CLOSED_GPIO
+#define VALVE_TIMEOUT_US  (CONFIG_WATCHDOG_VALVE_TIMEOUT * 1000000LL)
+
+extern const char *TAG;
+
+static esp_timer_handle_t timeout_timer = NULL;
+
+static uint8_t position = VALVE_MOVING;
+static uint8_t target = VALVE_CLOSED;
+static int64_t target_time = 0;
+static bool travelling = false;
+static uint32_t avg_travel_ms[VALVE_NUM_POSITIONS];
+
+static uint8_t read_position (void) {
+    bool open = (gpio_get_level (VALVE_OPEN_GPIO) == 0);
+    bool closed = (gpio_get_level (VALVE_CLOSED_GPIO) == 0);
+    if (open && closed) {
+        return VALVE_FAULT;
+    }
+    return open ? VALVE_OPEN : (closed ? VALVE_CLOSED : VALVE_MOVING);
+}
+
+static void IRAM_ATTR valve_isr (void *arg) {
+    int64_t now = esp_timer_get_time ();
+    esp_event_isr_post (VALVE_EVENT, VALVE_EVENT_INPUT, &now, sizeof(now), NULL);
+}
+
+static void timeout_cb (void *arg) {
+    esp_event_post (VALVE_EVENT, VALVE_EVENT_TIMEOUT, NULL, 0, 0);
+}
+
+static void post (int32_t id, uint32_t travel_ms) {
+    struct valve_event_data data = {
+        .time = esp_timer_get_time (),
+        .position = position,
+        .target = target,
+        .travel_ms = travel_ms,
+        .avg_travel_ms = avg_travel_ms[target],
+    };
+    esp_event_post (VALVE_EVENT, id, &data, sizeof(data), 0);
+}
+
+static void valve_event_handler (void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+    switch (event_id) {
+        case VALVE_EVENT_TARGET:
+            target = ((struct valve_event_data *) event_data)->target;
+            target_time = ((struct valve_event_data *) event_data)->time;
+            travelling = (position != target);
+            esp_timer_stop (timeout_timer);
+            if (travelling) {
+                esp_timer_start_once (timeout_timer, VALVE_TIMEOUT_US);
+            }
+            break;
+
+        case VALVE_EVENT_INPUT: {
+            // switches bounce, and edges can be lost if the queue fills,
+            // so go by the current level rather than the edge
+            uint8_t new_position = read_position ();
+            if (new_position == position) {
+                break;
+            }
+            position = new_position;
+            post (VALVE_EVENT_POSITION, 0);
+            if (travelling && (position == target)) {
+                uint32_t travel_ms = (*(int64_t *) event_data - target_time) / 1000;
+                travelling = false;
+                esp_timer_stop (timeout_timer);
+                avg_travel_ms[target] = (avg_travel_ms[target] == 0) ? travel_ms :
+                                        (avg_travel_ms[target] * 7 + travel_ms) / 8;
+                ESP_LOGI(TAG, "valve: %s after %u ms", position_names[position], travel_ms);
+                post (VALVE_EVENT_ARRIVED, travel_ms);
+            }
+            break;
+        }
+
+        case VALVE_EVENT_TIMEOUT:
+            position = read_position ();
+            if (travelling && (position != target)) {
+                ESP_LOGE(TAG, "valve: stuck %s, never reached %s", position_names[position], position_names[target]);
+                travelling = false;
+                post (VALVE_EVENT_STUCK, 0);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+void valve_init (bool open) {
+    gpio_config_t io_conf = {
+        .intr_type = GPIO_INTR_ANYEDGE,
+        .mode = GPIO_MODE_INPUT,
+        .pin_bit_mask = (1ULL << VALVE_OPEN_GPIO) | (1ULL << VALVE_CLOSED_GPIO),
+        .pull_down_en = 0,
+        .pull_up_en = 1,
+    };
+    gpio_config (&io_conf);
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = &timeout_cb,
+        .name = "valve_timeout",
+    };
+    ESP_ERROR_CHECK( esp_timer_create (&timer_args, &timeout_timer) );
+    ESP_ERROR_CHECK( esp_event_handler_register (VALVE_EVENT, ESP_EVENT_ANY_ID, &valve_event_handler, NULL) );
+
+    position = read_position ();
+    ESP_LOGI(TAG, "valve: initially %s", position_names[position]);
+    post (VALVE_EVENT_POSITION, 0);
+    valve_expect (open);
+
+    gpio_install_isr_service (0);
+    gpio_isr_handler_add (VALVE_OPEN_GPIO, valve_isr, NULL);
+    gpio_isr_handler_add (VALVE_CLOSED_GPIO, valve_isr, NULL);
+}
+
+void valve_expect (bool open) {
+    struct valve_event_data data = {
+        .time = esp_timer_get_time (),
+        .target = open ? VALVE_OPEN : VALVE_CLOSED,
+    };
+    if (timeout_timer == NULL) {
+        return;
+    }
+    if (esp_event_post (VALVE_EVENT, VALVE_EVENT_TARGET, &data, sizeof(data), 0) != ESP_OK) {
+        ESP_LOGE(TAG, "valve: unable to post new target");
+    }
+}
+
+#else
+
+void valve_init (bool open) {
+}
+
+void valve_expect (bool open) {
+}
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * valve
+ *
+ * Supervises the motorised tank valve through its open/closed feedback
+ * switches (see docs/hardware-notes.md). The feedback inputs interrupt on
+ * every edge; each relay change sets a target position, and the time
+ * from then to the target switch closing is the travel time. Results are
+ * posted as VALVE_EVENT events on the default event loop.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_event.h"
+
+ESP_EVENT_DECLARE_BASE(VALVE_EVENT);
+
+enum valve_event_t {
+    VALVE_EVENT_POSITION = 0,   // position changed
+    VALVE_EVENT_ARRIVED,        // reached the target; travel_ms is valid
+    VALVE_EVENT_STUCK,          // didn't reach the target in time
+    VALVE_EVENT_INPUT,          // (internal) feedback edge
+    VALVE_EVENT_TARGET,         // (internal) new target
+    VALVE_EVENT_TIMEOUT,        // (internal) travel timer expired
+};
+
+enum valve_position_t {
+    VALVE_MOVING = 0,   // neither switch closed
+    VALVE_OPEN,
+    VALVE_CLOSED,
+    VALVE_FAULT,        // both switches closed
+    VALVE_NUM_POSITIONS
+};
+
+struct valve_event_data {
+    int64_t time;           // esp_timer time of the edge or command
+    uint8_t position;
+    uint8_t target;         // VALVE_OPEN or VALVE_CLOSED
+    uint32_t travel_ms;
+    uint32_t avg_travel_ms; // running average for this direction
+};
+
+// set up the feedback inputs; call once the default event loop exists
+extern void valve_init (bool open);
+
+// the relay has switched, so the valve should now travel open or closed
+extern void valve_expect (bool open);
+
+extern const char *valve_position_name (uint8_t position);
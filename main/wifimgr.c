@@ -0,0 +1,473 @@
+/*
+ * wifimgr
+ *
+ * Connection manager for the station interface.
+ *
+ * - On start-up, if we know the BSSID and channel of the last AP we got an
+ *   IP address from, go straight to it (no full scan).
+ * - Otherwise scan once, rank the configured SSIDs by the strongest RSSI
+ *   seen for each, and try them strongest first, each pinned to the BSSID
+ *   and channel found by the scan.
+ * - On a drop, retry the AP we were on immediately, then fall back to the
+ *   ranked list with exponential backoff, rescanning once it is exhausted.
+ *
+ * The last good AP is kept in RTC memory (survives soft resets) and in NVS
+ * (survives power cycles); NVS is only written when it actually changes.
+ *
+ * All state is touched only from the default event loop task: the backoff
+ * timer posts an event rather than reconnecting from the timer task.
+ */
+#include <string.h>
+#include <stddef.h>
+#include <sys/param.h>
+#include "esp_system.h"
+#include "esp_wifi.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "nvs.h"
+
+#include "wificonfig.h"
+#include "wifimgr.h"
+
+#define MAX_APS         4
+#define SCAN_LIST_SIZE  20
+#define BACKOFF_MIN_MS  250
+#define BACKOFF_MAX_MS  8000
+#define NUM_ATTEMPTS    16          // attempts remembered for stats
+#define CACHE_MAGIC     0x57494649  // "WIFI"
+
+#define D_NAMESPACE     "wifimgr"
+
+// disconnect reasons we treat specially (see wifi_err_reason_t)
+#define REASON_NO_AP_FOUND 201
+
+extern const char *TAG;
+
+ESP_EVENT_DEFINE_BASE(WIFIMGR_EVENT);
+enum {
+    WIFIMGR_EVENT_RETRY = 0,
+};
+
+enum attempt_method_t {
+    METHOD_CACHED = 0,   // last good BSSID/channel
+    METHOD_RANKED = 1,   // BSSID/channel from a scan
+    METHOD_SSID = 2,     // SSID only, driver does its own scan
+};
+
+static const char *method_names[] = { "cached", "ranked", "ssid" };
+
+struct ap_entry {
+    char *ssid;
+    char *password;
+    bool seen;           // present in last scan?
+    int8_t rssi;         // strongest RSSI in last scan
+    uint8_t bssid[6];    // ... and where it was seen
+    uint8_t channel;
+};
+
+struct ap_cache {
+    uint32_t magic;
+    char ssid[33];
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint32_t check;
+};
+
+struct attempt {
+    uint32_t duration_ms;
+    uint8_t method;
+    uint8_t ok;
+    uint8_t reason;
+};
+
+static struct ap_entry ap_list[MAX_APS];
+static int ap_count = 0;
+static int ap_rank[MAX_APS];    // indices into ap_list, strongest first
+static int ranked_count = 0;
+static int rank_pos = 0;
+static int ssid_pos = 0;        // round-robin when nothing was seen
+
+static RTC_NOINIT_ATTR struct ap_cache rtc_cache;
+static struct ap_cache cache;
+static bool cache_valid = false;
+
+static wifi_ap_record_t scan_list[SCAN_LIST_SIZE];
+
+static esp_timer_handle_t retry_timer = NULL;
+static bool connected = false;
+static bool attempting = false;
+static bool scanning = false;
+static int failures = 0;        // consecutive failed attempts
+static enum attempt_method_t attempt_method;
+static int64_t attempt_start = 0;
+static int64_t outage_start = 0;
+static int outage_attempts = 0;
+static uint32_t last_outage_ms = 0;
+static int last_outage_attempts = 0;
+
+static struct attempt attempts[NUM_ATTEMPTS];
+static int attempt_pos = 0;
+static uint32_t attempt_total = 0;
+
+static uint32_t cache_check (const struct ap_cache *c) {
+    const uint8_t *p = (const uint8_t *) c;
+    uint32_t sum = 5381;
+    for (int i = 0; i < offsetof(struct ap_cache, check); i++) {
+        sum = (sum << 5) + sum + p[i];
+    }
+    return sum;
+}
+
+static int find_ap (const char *ssid) {
+    for (int i = 0; i < ap_count; i++) {
+        if (strcmp (ap_list[i].ssid, ssid) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool cache_usable (const struct ap_cache *c) {
+    return ((c->magic == CACHE_MAGIC) && (c->check == cache_check (c)) &&
+            (c->ssid[sizeof(c->ssid) - 1] == '\0') && (find_ap (c->ssid) >= 0));
+}
+
+static void load_cache (void) {
+    cache_valid = false;
+    if (cache_usable (&rtc_cache)) {
+        cache = rtc_cache;
+        cache_valid = true;
+        ESP_LOGI(TAG, "wifimgr: using RTC cached AP %s channel %d", cache.ssid, cache.channel);
+        return;
+    }
+
+    nvs_handle_t my_handle;
+    if (nvs_open (D_NAMESPACE, NVS_READONLY, &my_handle) == ESP_OK) {
+        size_t len = sizeof(cache);
+        if ((nvs_get_blob (my_handle, "last_ap", &cache, &len) == ESP_OK) &&
+            (len == sizeof(cache)) && cache_usable (&cache)) {
+            cache_valid = true;
+            rtc_cache = cache;
+            ESP_LOGI(TAG, "wifimgr: using NVS cached AP %s channel %d", cache.ssid, cache.channel);
+        }
+        nvs_close (my_handle);
+    }
+}
+
+// remember the AP we are connected to; NVS is only written on change
+//
+static void save_cache (void) {
+    wifi_ap_record_t info;
+    struct ap_cache new_cache;
+
+    if (esp_wifi_sta_get_ap_info (&info) != ESP_OK) {
+        return;
+    }
+    memset (&new_cache, 0, sizeof(new_cache));
+    new_cache.magic = CACHE_MAGIC;
+    strncpy (new_cache.ssid, (char *) info.ssid, sizeof(new_cache.ssid) - 1);
+    memcpy (new_cache.bssid, info.bssid, sizeof(new_cache.bssid));
+    new_cache.channel = info.primary;
+    new_cache.check = cache_check (&new_cache);
+    rtc_cache = new_cache;
+
+    if (cache_valid && (memcmp (&new_cache, &cache, sizeof(cache)) == 0)) {
+        return;
+    }
+    cache = new_cache;
+    cache_valid = true;
+
+    nvs_handle_t my_handle;
+    if (nvs_open (D_NAMESPACE, NVS_READWRITE, &my_handle) == ESP_OK) {
+        if ((nvs_set_blob (my_handle, "last_ap", &cache, sizeof(cache)) != ESP_OK) ||
+            (nvs_commit (my_handle) != ESP_OK)) {
+            ESP_LOGE(TAG, "wifimgr: unable to save cached AP");
+        }
+        nvs_close (my_handle);
+    }
+    ESP_LOGI(TAG, "wifimgr: cached AP %s " MACSTR " channel %d", cache.ssid, MAC2STR(cache.bssid), cache.channel);
+}
+
+static void record_attempt (bool ok, uint8_t reason) {
+    struct attempt *a = &attempts[attempt_pos];
+    a->duration_ms = (esp_timer_get_time () - attempt_start) / 1000;
+    a->method = attempt_method;
+    a->ok = ok;
+    a->reason = reason;
+    attempt_pos = (attempt_pos + 1) % NUM_ATTEMPTS;
+    attempt_total++;
+    attempting = false;
+    ESP_LOGI(TAG, "wifimgr: %s attempt %s after %u ms (reason %d)",
+             method_names[a->method], ok ? "succeeded" : "failed", a->duration_ms, reason);
+}
+
+static void connect_to (enum attempt_method_t method, int idx) {
+    wifi_config_t wifi_config;
+
+    memset (&wifi_config, 0, sizeof(wifi_config));
+    strncpy ((char *) wifi_config.sta.ssid, ap_list[idx].ssid, sizeof(wifi_config.sta.ssid));
+    strncpy ((char *) wifi_config.sta.password, ap_list[idx].password, sizeof(wifi_config.sta.password));
+
+    switch (method) {
+        case METHOD_CACHED:
+            wifi_config.sta.bssid_set = true;
+            memcpy (wifi_config.sta.bssid, cache.bssid, sizeof(cache.bssid));
+            wifi_config.sta.channel = cache.channel;
+            break;
+
+        case METHOD_RANKED:
+            wifi_config.sta.bssid_set = true;
+            memcpy (wifi_config.sta.bssid, ap_list[idx].bssid, sizeof(ap_list[idx].bssid));
+            wifi_config.sta.channel = ap_list[idx].channel;
+            break;
+
+        default:
+            wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+            wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+            break;
+    }
+
+    ESP_LOGI(TAG, "wifimgr: connecting to SSID %s (%s, channel %d)",
+             wifi_config.sta.ssid, method_names[method], wifi_config.sta.channel);
+    attempt_method = method;
+    attempt_start = esp_timer_get_time ();
+    attempting = true;
+    outage_attempts++;
+    ESP_ERROR_CHECK( esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
+    esp_wifi_connect();
+}
+
+static void start_scan (void) {
+    wifi_scan_config_t scan_config = {
+        .ssid = NULL,
+        .bssid = NULL,
+        .channel = 0,
+        .show_hidden = false,
+    };
+
+    ESP_LOGI(TAG, "wifimgr: scanning");
+    if (esp_wifi_scan_start (&scan_config, false) == ESP_OK) {
+        scanning = true;
+    } else {
+        // fall back to letting the driver find the next SSID
+        connect_to (METHOD_SSID, ssid_pos);
+        ssid_pos = (ssid_pos + 1) % ap_count;
+    }
+}
+
+// rank configured APs by the strongest RSSI seen for each in the last scan
+//
+static void rank_aps (void) {
+    uint16_t number = SCAN_LIST_SIZE;
+
+    scanning = false;
+    if (esp_wifi_scan_get_ap_records (&number, scan_list) != ESP_OK) {
+        number = 0;
+    }
+
+    for (int i = 0; i < ap_count; i++) {
+        ap_list[i].seen = false;
+        for (int j = 0; j < number; j++) {
+            if ((strcmp ((char *) scan_list[j].ssid, ap_list[i].ssid) == 0) &&
+                (!ap_list[i].seen || (scan_list[j].rssi > ap_list[i].rssi))) {
+                ap_list[i].seen = true;
+                ap_list[i].rssi = scan_list[j].rssi;
+                memcpy (ap_list[i].bssid, scan_list[j].bssid, sizeof(ap_list[i].bssid));
+                ap_list[i].channel = scan_list[j].primary;
+            }
+        }
+    }
+
+    // insertion sort of the APs we saw, strongest first
+    ranked_count = 0;
+    for (int i = 0; i < ap_count; i++) {
+        if (!ap_list[i].seen) {
+            continue;
+        }
+        int j = ranked_count++;
+        while ((j > 0) && (ap_list[ap_rank[j-1]].rssi < ap_list[i].rssi)) {
+            ap_rank[j] = ap_rank[j-1];
+            j--;
+        }
+        ap_rank[j] = i;
+    }
+    rank_pos = 0;
+
+    for (int i = 0; i < ranked_count; i++) {
+        ESP_LOGI(TAG, "wifimgr: rank %d: %s rssi %d channel %d", i,
+                 ap_list[ap_rank[i]].ssid, ap_list[ap_rank[i]].rssi, ap_list[ap_rank[i]].channel);
+    }
+}
+
+static void next_attempt (void) {
+    if (connected || attempting || scanning) {
+        return;
+    }
+    if (cache_valid && (failures == 0)) {
+        connect_to (METHOD_CACHED, find_ap (cache.ssid));
+    } else if (rank_pos < ranked_count) {
+        connect_to (METHOD_RANKED, ap_rank[rank_pos++]);
+    } else {
+        start_scan ();
+    }
+}
+
+static void schedule_retry (void) {
+    uint32_t delay_ms = 0;
+
+    // first retry is immediate, then back off exponentially
+    if (failures > 1) {
+        delay_ms = BACKOFF_MIN_MS << MIN(failures - 2, 5);
+        if (delay_ms > BACKOFF_MAX_MS) {
+            delay_ms = BACKOFF_MAX_MS;
+        }
+    }
+
+    if (delay_ms == 0) {
+        next_attempt ();
+    } else {
+        ESP_LOGI(TAG, "wifimgr: retrying in %u ms", delay_ms);
+        esp_timer_stop (retry_timer);
+        esp_timer_start_once (retry_timer, delay_ms * 1000ULL);
+    }
+}
+
+static void retry_timer_cb (void *arg) {
+    esp_event_post (WIFIMGR_EVENT, WIFIMGR_EVENT_RETRY, NULL, 0, 0);
+}
+
+static void wifimgr_event_handler (void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+    // nothing to join: the station is only up for config mode's scans
+    if (ap_count == 0) {
+        return;
+    }
+    if (event_base == WIFIMGR_EVENT) {
+        next_attempt ();
+
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+        outage_start = esp_timer_get_time ();
+        outage_attempts = 0;
+        if (cache_valid) {
+            next_attempt ();
+        } else {
+            start_scan ();
+        }
+
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
+        if (!scanning) {
+            return;
+        }
+        rank_aps ();
+        if (ranked_count > 0) {
+            connect_to (METHOD_RANKED, ap_rank[rank_pos++]);
+        } else {
+            // nothing seen (hidden SSID, or a poor scan): let the driver look
+            connect_to (METHOD_SSID, ssid_pos);
+            ssid_pos = (ssid_pos + 1) % ap_count;
+        }
+
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *) event_data;
+
+        if (connected) {
+            // dropped: start timing the outage and go straight back
+            connected = false;
+            failures = 0;
+            outage_start = esp_timer_get_time ();
+            outage_attempts = 0;
+        } else {
+            if (attempting) {
+                record_attempt (false, event->reason);
+                if ((attempt_method == METHOD_CACHED) && (event->reason == REASON_NO_AP_FOUND)) {
+                    ESP_LOGI(TAG, "wifimgr: cached AP not found");
+                    cache_valid = false;
+                }
+            }
+            failures++;
+        }
+        attempting = false;
+        schedule_retry ();
+
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        if (attempting) {
+            record_attempt (true, 0);
+        }
+        connected = true;
+        failures = 0;
+        last_outage_ms = (esp_timer_get_time () - outage_start) / 1000;
+        last_outage_attempts = outage_attempts;
+        ESP_LOGI(TAG, "wifimgr: connected after %u ms, %d attempts", last_outage_ms, last_outage_attempts);
+        save_cache ();
+    }
+}
+
+void wifimgr_init (void) {
+    char *ssids[MAX_APS] = {
+        wificonfig_vals_wifi.ap1_ssid, wificonfig_vals_wifi.ap2_ssid,
+        wificonfig_vals_wifi.ap3_ssid, wificonfig_vals_wifi.ap4_ssid,
+    };
+    char *pswds[MAX_APS] = {
+        wificonfig_vals_wifi.ap1_pswd, wificonfig_vals_wifi.ap2_pswd,
+        wificonfig_vals_wifi.ap3_pswd, wificonfig_vals_wifi.ap4_pswd,
+    };
+
+    ap_count = 0;
+    for (int i = 0; i < MAX_APS; i++) {
+        if (strlen (ssids[i]) > 0) {
+            ap_list[ap_count].ssid = ssids[i];
+            ap_list[ap_count].password = pswds[i];
+            ap_list[ap_count].seen = false;
+            ap_count++;
+        }
+    }
+
+    load_cache ();
+}
+
+int wifimgr_ap_count (void) {
+    return ap_count;
+}
+
+// register for events; call once the default event loop exists and
+// before esp_wifi_start()
+//
+void wifimgr_start (void) {
+    const esp_timer_create_args_t timer_args = {
+        .callback = &retry_timer_cb,
+        .name = "wifimgr_retry",
+    };
+    ESP_ERROR_CHECK( esp_timer_create (&timer_args, &retry_timer) );
+
+    ESP_ERROR_CHECK( esp_event_handler_register (WIFIMGR_EVENT, ESP_EVENT_ANY_ID, &wifimgr_event_handler, NULL) );
+    ESP_ERROR_CHECK( esp_event_handler_register (WIFI_EVENT, ESP_EVENT_ANY_ID, &wifimgr_event_handler, NULL) );
+    ESP_ERROR_CHECK( esp_event_handler_register (IP_EVENT, IP_EVENT_STA_GOT_IP, &wifimgr_event_handler, NULL) );
+}
+
+int wifimgr_stats_json (char *buf, size_t len) {
+    wifi_ap_record_t info;
+    int n;
+
+    n = snprintf (buf, len, "{\"attempts\":%u,\"last_outage_ms\":%u,\"last_outage_attempts\":%d",
+                  attempt_total, last_outage_ms, last_outage_attempts);
+    if ((n < len) && connected && (esp_wifi_sta_get_ap_info (&info) == ESP_OK)) {
+        n += snprintf (buf + n, len - n, ",\"ssid\":\"%s\",\"rssi\":%d,\"channel\":%d",
+                       (char *) info.ssid, info.rssi, info.primary);
+    }
+
+    // most recent attempts first: [duration_ms, method, ok, reason]
+    if (n < len) {
+        n += snprintf (buf + n, len - n, ",\"recent\":[");
+    }
+    int count = MIN(attempt_total, 8);
+    for (int i = 0; (i < count) && (n < len); i++) {
+        struct attempt *a = &attempts[(attempt_pos + NUM_ATTEMPTS - 1 - i) % NUM_ATTEMPTS];
+        n += snprintf (buf + n, len - n, "%s[%u,\"%s\",%d,%d]", (i > 0) ? "," : "",
+                       a->duration_ms, method_names[a->method], a->ok, a->reason);
+    }
+    if (n < len) {
+        n += snprintf (buf + n, len - n, "]}");
+    }
+    return (n < len) ? n : -1;
+}
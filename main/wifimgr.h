@@ -0,0 +1,22 @@
+/*
+ * wifimgr
+ *
+ * Chooses which of the configured access points to join and handles
+ * reconnects: APs are ranked by scan RSSI, and the last AP that gave us an
+ * IP address is cached (RTC memory and NVS) so reconnects can go straight
+ * to its BSSID and channel without a full scan.
+ */
+#include "esp_event.h"
+
+// load configured APs and any cached AP
+extern void wifimgr_init (void);
+
+// number of configured APs (0 -> nothing to connect to)
+extern int wifimgr_ap_count (void);
+
+// register for WiFi events; call before esp_wifi_start()
+extern void wifimgr_start (void);
+
+// describe recent connection attempts as a JSON object; the length, or
+// -1 if it didn't fit
+extern int wifimgr_stats_json (char *buf, size_t len);
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Serve a firmware image for the controller to fetch with cmnd/<topic>/OTA,
+standing in for a real update server. It can also misbehave in the ways a
+real server or network might, to check that a bad update leaves the
+running firmware alone:
+
+    tools/ota-server.py                              # build/Watchdog_ESP32-IDF.bin on :8070
+    tools/ota-server.py --truncate 100000            # connection drops part way
+    tools/ota-server.py --corrupt 50000              # one byte flipped
+    tools/ota-server.py --chunked --delay 0.05       # no length, slow link
+    tools/ota-server.py --status 404                 # no image
+
+Any path serves the image, so the URL can be e.g.
+http://<this host>:8070/firmware.bin. Only the standard library is used.
+"""
+
+import argparse
+import http.server
+import os
+import sys
+import time
+
+DEFAULT_IMAGE = os.path.join(os.path.dirname(__file__), "..", "build", "Watchdog_ESP32-IDF.bin")
+CHUNK = 4096
+
+
+def make_handler(args, image):
+    class Handler(http.server.BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def do_GET(self):
+            if args.status != 200:
+                self.send_response(args.status)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+
+            data = bytearray(image)
+            if args.corrupt is not None:
+                data[args.corrupt] ^= 0xff
+            send_len = len(data) if args.truncate is None else min(args.truncate, len(data))
+
+            self.send_response(200)
+            self.send_header("Content-Type", "application/octet-stream")
+            if args.chunked:
+                self.send_header("Transfer-Encoding", "chunked")
+            else:
+                # a truncated response still claims the full length
+                self.send_header("Content-Length", str(len(data)))
+            self.send_header("Connection", "close")
+            self.end_headers()
+
+            sent = 0
+            while sent < send_len:
+                piece = data[sent:min(sent + CHUNK, send_len)]
+                if args.chunked:
+                    self.wfile.write(b"%x\r\n" % len(piece) + piece + b"\r\n")
+                else:
+                    self.wfile.write(piece)
+                sent += len(piece)
+                if args.delay:
+                    time.sleep(args.delay)
+            if args.chunked and args.truncate is None:
+                self.wfile.write(b"0\r\n\r\n")
+            self.wfile.flush()
+            self.log_message("sent %d of %d bytes", sent, len(data))
+            self.close_connection = True
+
+    return Handler
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", nargs="?", default=DEFAULT_IMAGE, help="firmware image (default: %(default)s)")
+    parser.add_argument("--port", type=int, default=8070)
+    parser.add_argument("--truncate", type=int, metavar="BYTES", help="close the connection after BYTES")
+    parser.add_argument("--corrupt", type=int, metavar="OFFSET", help="flip the byte at OFFSET")
+    parser.add_argument("--chunked", action="store_true", help="send without a Content-Length")
+    parser.add_argument("--delay", type=float, default=0, metavar="SECONDS", help="pause after each 4K")
+    parser.add_argument("--status", type=int, default=200, help="answer with this HTTP status instead")
+    args = parser.parse_args()
+
+    try:
+        with open(args.image, "rb") as f:
+            image = f.read()
+    except OSError as e:
+        sys.exit("ota-server: %s" % e)
+    if (args.corrupt is not None) and not (0 <= args.corrupt < len(image)):
+        sys.exit("ota-server: --corrupt offset is outside the image")
+
+    server = http.server.ThreadingHTTPServer(("", args.port), make_handler(args, image))
+    print("serving %s (%d bytes) on port %d" % (args.image, len(image), args.port))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()